@@ -47,13 +47,41 @@ namespace mamba
 
         bool use_index_cache = false;
         std::size_t local_repodata_ttl = 1;  // take from header
+        // use an expired repodata cache right away and refresh it in the
+        // background (see SubdirRevalidation)
+        bool stale_while_revalidate = false;
+        // solve with the smaller current_repodata.json (latest versions only)
+        // first, and with the full repodata if that fails
+        bool current_repodata = false;
+        // fetch only the repodata shards of the packages reachable from the
+        // specs when the channel publishes repodata_shards.json
+        bool sharded_repodata = false;
+        // fetch repodata.json.zst when the server has it, and store the
+        // repodata cache zstd compressed
+        bool repodata_zst = false;
+        bool compress_repodata_cache = false;
+        // update an expired repodata cache from the patch journal of the
+        // repodata (see PatchJournal) instead of downloading it again
+        bool repodata_patches = false;
         bool offline = false;
         bool quiet = false;
         bool json = false;
         bool strict_channel_priority = false;
+        // the number of solver configurations solving in parallel, the first
+        // solution is taken (see MSolver::set_portfolio); 0 to disable
+        std::size_t solver_portfolio = 0;
+        // only load the packages reachable from the requested specs and the
+        // installed packages into the pool (see RepodataIndex)
+        bool sparse_repodata = false;
+        // read the channel repos from a single snapshot file when their
+        // repodata did not change (see PoolSnapshot)
+        bool pool_snapshot = false;
         bool auto_activate_base = false;
 
         long max_parallel_downloads = 5;
+        // size of the thread pool used for validation, extraction and
+        // linking, 0 means one thread per core
+        int max_parallel_tasks = 0;
         int verbosity = 0;
 
         bool dev = false;
@@ -0,0 +1,89 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_DIR_CACHE_HPP
+#define MAMBA_DIR_CACHE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    /*
+     * Caches open directory file descriptors (and known existing directories)
+     * below a prefix, so that the linker can use the *at family of syscalls
+     * (openat, linkat, symlinkat, unlinkat, ...) relative to the parent
+     * directory instead of resolving the full absolute path for every file.
+     *
+     * All paths passed to the member functions are relative to the prefix.
+     * On Windows, the operations fall back to the regular fs:: functions and
+     * only the known directories are cached.
+     */
+    class DirectoryCache
+    {
+    public:
+        DirectoryCache(const fs::path& prefix);
+        ~DirectoryCache() = default;
+
+        DirectoryCache(const DirectoryCache&) = delete;
+        DirectoryCache& operator=(const DirectoryCache&) = delete;
+        DirectoryCache(DirectoryCache&&) = delete;
+        DirectoryCache& operator=(DirectoryCache&&) = delete;
+
+        const fs::path& prefix() const;
+
+        void create_directories(const fs::path& rel_dir);
+        bool lexists(const fs::path& rel_path);
+        // removes a file or a symlink, returns false if it did not exist
+        bool remove(const fs::path& rel_path);
+        // removes a directory only if it is empty, returns false otherwise
+        bool remove_empty_directory(const fs::path& rel_dir);
+        void create_hard_link(const fs::path& src, const fs::path& rel_dst);
+        void copy_symlink(const fs::path& src, const fs::path& rel_dst);
+
+        // Directories that might have become empty are only recorded while
+        // unlinking, and removed bottom-up (together with their parents
+        // becoming empty) by a single call to prune_empty_directories.
+        void mark_for_pruning(const std::set<std::string>& rel_dirs);
+        std::size_t prune_empty_directories();
+
+        void clear();
+
+    private:
+        struct file_descriptor
+        {
+            explicit file_descriptor(int f);
+            ~file_descriptor();
+
+            file_descriptor(const file_descriptor&) = delete;
+            file_descriptor& operator=(const file_descriptor&) = delete;
+
+            int fd;
+        };
+        using fd_ptr = std::shared_ptr<file_descriptor>;
+
+        fd_ptr prefix_fd();
+        fd_ptr directory_fd(const fs::path& rel_dir, bool create);
+        void forget(const std::string& rel_dir);
+
+        // upper bound for the number of cached open directories
+        static constexpr std::size_t max_open_directories = 512;
+
+        fs::path m_prefix;
+        fd_ptr m_prefix_fd;
+        std::map<std::string, fd_ptr> m_fds;
+        std::set<std::string> m_known_dirs;
+        std::set<std::string> m_prune_candidates;
+        std::mutex m_mutex;
+    };
+}  // namespace mamba
+
+#endif
@@ -41,6 +41,13 @@ namespace mamba
         void set_expected_size(std::size_t size);
 
         const std::string& name() const;
+        const std::string& url() const;
+
+        // requested in turn when the server does not have the url (e.g. a
+        // repodata.json.zst), or when the finalize callback asks for it with
+        // try_fallback() (the transfer is then retried with the next url)
+        void add_fallback_url(const std::string& url);
+        bool try_fallback();
 
         void init_curl_target(const std::string& url);
         bool perform();
@@ -83,6 +90,8 @@ namespace mamba
         std::function<bool()> m_finalize_callback;
 
         std::string m_name, m_filename, m_url;
+        std::vector<std::string> m_fallback_urls;
+        bool m_use_fallback = false;
 
         // validation
         std::size_t m_expected_size = 0;
@@ -95,7 +104,8 @@ namespace mamba
         std::size_t m_retries = 0;
 
         CURL* m_handle;
-        curl_slist* m_headers;
+        curl_slist* m_headers = nullptr;
+        std::vector<std::string> m_conditional_headers;
 
         bool m_has_progress_bar = false;
         bool m_ignore_failure = false;
@@ -8,6 +8,7 @@
 #define MAMBA_LINK
 
 #include <iostream>
+#include <set>
 #include <stack>
 #include <string>
 #include <tuple>
@@ -41,12 +42,13 @@ namespace mamba
         bool undo();
 
     private:
-        bool unlink_path(const nlohmann::json& path_data);
+        bool unlink_path(const std::string& path);
 
         PackageInfo m_pkg_info;
         fs::path m_cache_path;
         std::string m_specifier;
         TransactionContext* m_context;
+        std::set<std::string> m_touched_dirs;
     };
 
     class LinkPackage
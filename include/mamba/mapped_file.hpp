@@ -0,0 +1,41 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_MAPPED_FILE_HPP
+#define MAMBA_MAPPED_FILE_HPP
+
+#include <cstddef>
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    // read-only memory mapping of a whole file, data() is null if the file
+    // could not be mapped (or is empty)
+    class MappedFile
+    {
+    public:
+        MappedFile(const fs::path& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const;
+        std::size_t size() const;
+
+    private:
+        const char* m_data = nullptr;
+        std::size_t m_size = 0;
+#ifdef _WIN32
+        // HANDLEs of the file and of the mapping
+        void* m_file = nullptr;
+        void* m_mapping = nullptr;
+#endif
+    };
+}  // namespace mamba
+
+#endif  // MAMBA_MAPPED_FILE_HPP
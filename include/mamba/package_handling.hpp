@@ -7,6 +7,7 @@
 #ifndef MAMBA_PACKAGE_HANDLING_HPP
 #define MAMBA_PACKAGE_HANDLING_HPP
 
+#include <cstdio>
 #include <string>
 #include <system_error>
 #include <vector>
@@ -35,6 +36,13 @@ namespace mamba
     fs::path extract(const fs::path& file);
     bool transmute(const fs::path& pkg_file, const fs::path& target, int compression_level);
     bool validate(const fs::path& pkg_folder);
+
+    // single zstd compressed files (e.g. the repodata cache), recognized by
+    // their magic number
+    bool is_zstd_file(const fs::path& file);
+    void compress_zstd_file(const fs::path& file, const fs::path& destination, int compression_level);
+    // opens a file for reading, zstd compressed files are decompressed on the fly
+    FILE* open_decompressed(const fs::path& file);
 }  // namespace mamba
 
 #endif  // MAMBA_PACKAGE_HANDLING_HPP
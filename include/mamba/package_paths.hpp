@@ -7,11 +7,14 @@
 #ifndef MAMBA_READ_PATHS_HPP
 #define MAMBA_READ_PATHS_HPP
 
+#include <iosfwd>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
 
+#include "nlohmann/json.hpp"
+
 #include "util.hpp"
 
 const char PREFIX_PLACEHOLDER_1[] = "/opt/anaconda1anaconda2";
@@ -55,6 +58,8 @@ namespace mamba
         std::string path;
         PathType path_type = PathType::UNDEFINED;
         std::string sha256;
+        // only set for the paths of a prefix record
+        std::string sha256_in_prefix;
         std::size_t size_in_bytes = 0;
 
         std::string prefix_placeholder;
@@ -65,6 +70,24 @@ namespace mamba
     std::map<std::string, PrefixFileParse> read_has_prefix(const fs::path& path);
     std::set<std::string> read_no_link(const fs::path& info_dir);
     std::vector<PathData> read_paths(const fs::path& directory);
+
+    PathType path_type_from_string(const std::string& str);
+    std::string path_type_to_string(PathType type);
+
+    // The paths.json and conda-meta readers / writer below stream the paths
+    // from / to the file, without building a JSON document of all paths.
+
+    // reads the `paths_data` of a conda-meta record (or its `files` for old
+    // records without `paths_data`), skipping everything else
+    std::vector<PathData> read_prefix_record_paths(const fs::path& record_path);
+    // reads the fields of a conda-meta record without its `files` and
+    // `paths_data`
+    nlohmann::json read_prefix_record_header(const fs::path& record_path);
+    // writes a conda-meta record made of the (small) record fields, and the
+    // `files` and `paths_data` generated from `paths`
+    void write_prefix_record(std::ostream& out,
+                             const nlohmann::json& record,
+                             const std::vector<PathData>& paths);
 }  // namespace mamba
 
 #endif
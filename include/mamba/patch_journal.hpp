@@ -0,0 +1,60 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_PATCH_JOURNAL_HPP
+#define MAMBA_PATCH_JOURNAL_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    /*
+     * Patch journal published next to a repodata.json (repodata.patches.jsonl
+     * for repodata.json), one JSON object per line:
+     *
+     *   {"from": "<sha256>", "to": "<sha256>", "patch": [<JSON patch>]}
+     *   ...
+     *   {"latest": "<sha256>"}
+     *
+     * The hashes are the sha256 of the repodata.json as published, the
+     * patches (RFC 6902) lead from one version to the next. The last line is
+     * optional, the latest version is otherwise the one of the last patch.
+     * Servers are free to drop the oldest lines.
+     */
+    class PatchJournal
+    {
+    public:
+        // the patches leading from the repodata with the hash `from`
+        PatchJournal(const fs::path& journal_file, const std::string& from);
+
+        static std::string url(const std::string& repodata_url);
+        static bool is_journal_url(const std::string& url);
+
+        // false if the journal does not start from `from` (too old, or
+        // unknown) or is invalid, the full repodata is then needed
+        bool applies() const;
+        bool up_to_date() const;
+        const std::string& latest() const;
+
+        // patches the repodata and collects the file names of the records
+        // that were added, changed or removed; false if other parts of the
+        // repodata changed as well
+        bool apply(nlohmann::json& repodata, std::set<std::string>& changed_fns) const;
+
+    private:
+        std::vector<nlohmann::json> m_patches;
+        std::string m_latest;
+        bool m_applies = false;
+    };
+}  // namespace mamba
+
+#endif  // MAMBA_PATCH_JOURNAL_HPP
@@ -7,10 +7,17 @@
 #ifndef MAMBA_POOL_HPP
 #define MAMBA_POOL_HPP
 
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "context.hpp"
 
 extern "C"
 {
+#include "solv/bitmap.h"
 #include "solv/pool.h"
 }
 
@@ -28,12 +35,68 @@ namespace mamba
         MPool& operator=(MPool&&) = delete;
 
         void set_debuglevel();
+        // (re)creates the whatprovides index, unless the solvables did not
+        // change since the last call (e.g. a Query and a solver on the same pool)
         void create_whatprovides();
 
+        // The state of the input a repo was loaded from (e.g. the etag of its
+        // repodata), used to identify the repo in the solution cache. An empty
+        // state means the repo cannot be identified.
+        void set_repo_state(Repo* repo, const std::string& state);
+        std::string repo_state(Repo* repo) const;
+
+        // The channel a repo was loaded from, parsed once when the repo is
+        // created (see MRepo). Channel-specific jobs and pins then select the
+        // solvables of a channel by repo id.
+        void set_repo_channel(Repo* repo, const std::string& channel_url);
+        // sets the ids of the repos from `channel` (a name or a url, as in a
+        // MatchSpec) in `repos`, a map of pool->nrepos bits
+        void select_channel_repos(const std::string& channel, Map* repos);
+
+        // Strict channel priority: the solvables of a name are only considered
+        // in the repos of the highest priority providing that name. The
+        // installed repo and the `keep_names` (e.g. channel-specific specs)
+        // are exempt. Returns the number of solvables that were pruned.
+        int prune_lower_priority(const std::set<std::string>& keep_names = {});
+        // the solvables prune_lower_priority keeps, in `considered`, a map
+        // of pool->nsolvables bits; returns the number of the others
+        int select_higher_priority(const std::set<std::string>& keep_names,
+                                   Map* considered) const;
+        // identifies the pruning in the solution cache, empty without
+        std::string considered_state() const;
+
+        // pool_conda_matchspec, memoized by spec string: each distinct spec
+        // (e.g. a dependency shared by many records) is parsed and interned
+        // once per pool
+        Id matchspec(const std::string& spec);
+        // the matchspec() lookups answered by the memo table, and the others
+        std::size_t matchspec_hits() const;
+        std::size_t matchspec_misses() const;
+
         operator Pool*();
 
     private:
         Pool* m_pool;
+        std::map<Repo*, std::string> m_repo_states;
+        std::unordered_map<std::string, Id> m_matchspec_ids;
+        std::size_t m_matchspec_hits = 0;
+        std::size_t m_matchspec_misses = 0;
+
+        struct channel_identity
+        {
+            std::string canonical_name;
+            std::string name;
+        };
+        int channel_id(const std::string& channel_url);
+
+        std::vector<channel_identity> m_channels;
+        // channel id by repo id, -1 if not registered
+        std::vector<int> m_repo_channels;
+        std::vector<int> m_whatprovides_layout;
+
+        Map m_considered;
+        std::string m_considered_state;
+        int m_considered_generation = 0;
     };
 }  // namespace mamba
 
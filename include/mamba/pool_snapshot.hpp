@@ -0,0 +1,61 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_POOL_SNAPSHOT_HPP
+#define MAMBA_POOL_SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+
+#include "mamba_fs.hpp"
+#include "pool.hpp"
+#include "repo.hpp"
+
+namespace mamba
+{
+    /*
+     * Snapshot of the channel repos of a pool, with their priorities, in a
+     * single file under the cache dir.
+     *
+     * The repos are described up front (repodata metadata, state and
+     * priorities, in pool order); the file is named after the channel list
+     * and only used if the metadata of all the repos still matches. It is
+     * memory-mapped and the repos are read back with repo_add_solv, which
+     * skips opening and validating one .solv file per subdir.
+     */
+    class PoolSnapshot
+    {
+    public:
+        PoolSnapshot(const fs::path& cache_dir);
+
+        void add_repo(const RepoMetadata& metadata,
+                      const std::string& state,
+                      int priority,
+                      int subpriority);
+
+        // adds the snapshot repos to the pool, false if there is no valid
+        // snapshot for the described repos
+        bool load(MPool& pool, std::vector<MRepo>& repos) const;
+        // writes the described repos, in the same order
+        bool save(MPool& pool, const std::vector<MRepo*>& repos) const;
+
+        fs::path path() const;
+
+    private:
+        struct repo_entry
+        {
+            std::string url;
+            std::string state;
+            int priority;
+            int subpriority;
+        };
+
+        fs::path m_cache_dir;
+        std::vector<repo_entry> m_repos;
+    };
+}  // namespace mamba
+
+#endif  // MAMBA_POOL_SNAPSHOT_HPP
@@ -23,16 +23,34 @@ namespace mamba
 
         PrefixData(const std::string& prefix_path);
 
+        // loads the records of conda-meta through their binary index (see
+        // index_path), whose entries are used as long as the size and mtime
+        // of their record did not change. The other records are read in
+        // parallel (in thread_pool::global()), without their `files` and
+        // `paths_data` (see full_record), and the index is rewritten.
         void load();
+        // reloads the records that changed and rewrites the index, once
+        // packages have been linked or unlinked
+        void update_index();
         const package_map& records() const;
         void load_single_record(const fs::path& path);
+        // the whole record of an installed package, read on demand
+        nlohmann::json full_record(const std::string& name) const;
 
         History& history();
         const fs::path& path() const;
 
+        static fs::path index_path(const fs::path& prefix);
+
         History m_history;
         std::unordered_map<std::string, PackageInfo> m_package_records;
         fs::path m_prefix_path;
+
+    private:
+        void load_records();
+        void add_record(PackageInfo&& prec, const fs::path& path);
+
+        std::unordered_map<std::string, fs::path> m_record_paths;
     };
 }  // namespace mamba
 
@@ -0,0 +1,91 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_PREFIX_FILE_INDEX_HPP
+#define MAMBA_PREFIX_FILE_INDEX_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    /*
+     * Persistent mapping of every file in a prefix to the package owning it,
+     * stored next to the package records in `conda-meta`.
+     *
+     * Packages are identified by the stem of their conda-meta record
+     * (name-version-build). The index is loaded lazily, and missing or
+     * outdated entries (e.g. after conda modified the prefix) are rebuilt
+     * from the `paths_data` of the corresponding records. Link and unlink
+     * operations update it incrementally, and save() writes it back.
+     *
+     * Every package gets an install sequence number, and a clobbered file is
+     * owned by the package with the highest one, also once the owner is
+     * removed. Packages re-indexed from their records are ordered by the
+     * mtime of the record.
+     */
+    class PrefixFileIndex
+    {
+    public:
+        PrefixFileIndex(const fs::path& prefix);
+
+        PrefixFileIndex(const PrefixFileIndex&) = delete;
+        PrefixFileIndex& operator=(const PrefixFileIndex&) = delete;
+        PrefixFileIndex(PrefixFileIndex&&) = delete;
+        PrefixFileIndex& operator=(PrefixFileIndex&&) = delete;
+
+        // returns the package owning the path (relative to the prefix),
+        // or an empty string if the path is not owned by any package
+        std::string owner(const fs::path& rel_path);
+        bool contains(const std::string& pkg);
+        // the files recorded for the package
+        std::vector<std::string> files(const std::string& pkg);
+        // the files of the package that were not clobbered by another one
+        std::vector<std::string> owned_files(const std::string& pkg);
+
+        // to be called once the package record has been written, later
+        // packages take over the ownership of clobbered files
+        void add(const std::string& pkg, const std::vector<std::string>& paths);
+        void remove(const std::string& pkg);
+
+        // writes the index to conda-meta (atomically), if it changed
+        void save();
+
+        static fs::path index_path(const fs::path& prefix);
+
+    private:
+        struct package_entry
+        {
+            std::string mtime;
+            std::size_t sequence = 0;
+            std::vector<std::string> files;
+        };
+        using package_map = std::map<std::string, package_entry>;
+
+        void load();
+        bool read_index();
+        void add_entry(const std::string& pkg, package_entry entry);
+        void remove_entry(const std::string& pkg);
+        std::string record_mtime(const std::string& pkg) const;
+
+        fs::path m_prefix;
+        bool m_loaded = false;
+        bool m_dirty = false;
+        std::size_t m_last_sequence = 0;
+        // the packages having a file, by increasing sequence: the last one
+        // owns it. They point into m_packages (stable in a std::map).
+        package_map m_packages;
+        std::unordered_map<std::string, std::vector<const package_map::value_type*>> m_owners;
+        std::mutex m_mutex;
+    };
+}  // namespace mamba
+
+#endif
@@ -7,10 +7,15 @@
 #ifndef MAMBA_REPO_HPP
 #define MAMBA_REPO_HPP
 
+#include <set>
 #include <string>
 #include <tuple>
+#include <vector>
 
+#include "package_info.hpp"
 #include "prefix_data.hpp"
+#include "repodata_index.hpp"
+#include "sharded_repodata.hpp"
 
 extern "C"
 {
@@ -30,23 +35,51 @@ namespace mamba
         bool pip_added;
         std::string etag;
         std::string mod;
+        // hash of the repodata as published, for patch journals
+        std::string sha256 = "";
     };
 
     inline bool operator==(const RepoMetadata& lhs, const RepoMetadata& rhs)
     {
         return lhs.url == rhs.url && lhs.pip_added == rhs.pip_added && lhs.etag == rhs.etag
-               && lhs.mod == rhs.mod;
+               && lhs.mod == rhs.mod && lhs.sha256 == rhs.sha256;
     }
 
+    // version of mamba and libsolv, .solv files of other versions are rebuilt
+    const char* mamba_tool_version();
+
+    // identifies the content of a cached repodata.json (see MPool::set_repo_state)
+    std::string repodata_state(const RepoMetadata& metadata, const fs::path& json_file);
+
     class MRepo
     {
     public:
+        // the installed packages of a prefix, from its loaded records
         MRepo(MPool& pool, const PrefixData& prefix_data);
+        // the installed packages of a prefix, read from its conda-meta through
+        // conda-meta/installed.solv (updated with the records that changed
+        // since it was written) without loading the records
+        static MRepo from_conda_meta(MPool& pool, const fs::path& prefix);
         MRepo(MPool& pool,
               const std::string& name,
               const std::string& filename,
               const std::string& url);
         MRepo(MPool& pool, const std::string& name, const fs::path& path, const RepoMetadata& meta);
+        // sparse loading: only the records of the given package names
+        MRepo(MPool& pool,
+              const RepodataIndex& index,
+              const std::set<std::string>& names,
+              const RepoMetadata& meta);
+        // the records of the given package names, from their fetched shards
+        MRepo(MPool& pool,
+              const ShardedRepodata& shards,
+              const std::set<std::string>& names,
+              const RepoMetadata& meta);
+        // repo of individual packages (e.g. from an explicit spec file),
+        // every package is fetched from its own url
+        MRepo(MPool& pool, const std::string& name, const std::vector<PackageInfo>& package_infos);
+        // a repo already loaded in the pool (e.g. from a PoolSnapshot)
+        MRepo(Repo* repo, const std::string& url);
         ~MRepo();
 
         void set_installed();
@@ -56,19 +89,35 @@ namespace mamba
         bool write() const;
         const std::string& url() const;
         Repo* repo();
+        // the id of the repo in its pool, kept once the pool is freed
+        Id id() const;
         std::tuple<int, int> priority() const;
         std::size_t size() const;
 
         bool clear(bool reuse_ids);
 
+        // replaces the records of the given file names by the ones of
+        // `repodata` (a repodata.json with the added and changed records)
+        // and writes the .solv with the new metadata, see MSubdirData
+        void update_records(const std::set<std::string>& fns,
+                            const std::string& repodata,
+                            const RepoMetadata& metadata);
+
     private:
         bool read_file(const std::string& filename);
+        void add_repodata(const std::string& repodata);
+        Id add_package_info(MPool& pool, Repodata* data, const PackageInfo& info);
+        void add_pip_as_python_dependency(Id start = 0);
+        void read_conda_meta(MPool& pool, const fs::path& conda_meta_dir);
 
         std::string m_json_file, m_solv_file;
+        // size and mtime of the records of an installed repo read from conda-meta
+        std::string m_conda_meta_state;
         std::string m_url;
 
         RepoMetadata m_metadata;
 
+        Id m_repoid = 0;
         Repo* m_repo;
     };
 }  // namespace mamba
@@ -0,0 +1,75 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_REPODATA_INDEX_HPP
+#define MAMBA_REPODATA_INDEX_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    /*
+     * On-disk index of a cached repodata.json, grouping the package records
+     * by package name together with the names of their dependencies.
+     *
+     * It is stored next to the repodata cache (`<cache>.names`) and rebuilt
+     * whenever the state of the repodata (etag / mod, or size and mtime)
+     * changes. It allows walking the dependency names without parsing the
+     * repodata, and reading back the records of a few names only (see
+     * sparse loading in MRepo).
+     */
+    class RepodataIndex
+    {
+    public:
+        RepodataIndex(const fs::path& json_file, const std::string& state);
+
+        // reads the index, building it first if it is missing or outdated
+        void load();
+
+        bool contains(const std::string& name) const;
+        const std::vector<std::string>& dependencies(const std::string& name) const;
+
+        // a repodata.json document with the records of the given names only
+        std::string repodata(const std::set<std::string>& names) const;
+
+        const fs::path& json_file() const;
+        static fs::path index_path(const fs::path& json_file);
+
+        // the package names reachable from the roots through the dependencies
+        // recorded in all the indexes (packages of a subdir often depend on
+        // packages of another one, e.g. noarch)
+        static std::set<std::string> reachable(const std::vector<RepodataIndex*>& indexes,
+                                               const std::vector<std::string>& roots);
+
+    private:
+        struct name_entry
+        {
+            std::size_t packages_offset = 0, packages_size = 0;
+            std::size_t conda_offset = 0, conda_size = 0;
+            std::vector<std::string> dependencies;
+        };
+
+        bool read_index();
+        void build();
+
+        fs::path m_json_file;
+        fs::path m_index_file;
+        std::string m_state;
+        std::string m_info;
+        std::size_t m_data_offset = 0;
+        std::map<std::string, name_entry> m_names;
+    };
+
+    // the package name of a dependency (e.g. "python >=3.6" -> "python")
+    std::string dependency_name(const std::string& dep);
+}  // namespace mamba
+
+#endif  // MAMBA_REPODATA_INDEX_HPP
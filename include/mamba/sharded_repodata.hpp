@@ -0,0 +1,76 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_SHARDED_REPODATA_HPP
+#define MAMBA_SHARDED_REPODATA_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "mamba_fs.hpp"
+
+namespace mamba
+{
+    /*
+     * Sharded repodata of a subdir: repodata_shards.json maps every package
+     * name to the sha256 of its shard, a repodata.json with the records of
+     * that name only:
+     *
+     *   {"info": {"subdir": "linux-64", "shards_base_url": "shards/"},
+     *    "shards": {"<name>": "<sha256>", ...}}
+     *
+     * The shards are published at <shards_base_url><sha256>.json (relative to
+     * the subdir by default). They never change and are cached by hash, only
+     * the index is refreshed like a repodata.json (see MSubdirData).
+     */
+    class ShardedRepodata
+    {
+    public:
+        ShardedRepodata(const fs::path& index_file,
+                        const std::string& subdir_url,
+                        const fs::path& shards_dir);
+
+        static bool is_index_url(const std::string& url);
+
+        bool contains(const std::string& name) const;
+        // from the loaded shard of the name
+        const std::vector<std::string>& dependencies(const std::string& name) const;
+
+        // a repodata.json document with the records of the given names, their
+        // shards must have been fetched
+        std::string repodata(const std::set<std::string>& names) const;
+
+        const fs::path& index_file() const;
+
+        // the package names reachable from the roots over all the subdirs:
+        // the shards are fetched one level of dependencies at a time, in
+        // parallel, then loaded
+        static std::set<std::string> fetch(const std::vector<ShardedRepodata*>& subdirs,
+                                           const std::vector<std::string>& roots);
+
+    private:
+        struct shard
+        {
+            std::string packages, conda_packages;
+            std::vector<std::string> dependencies;
+        };
+
+        fs::path shard_path(const std::string& name) const;
+        std::string shard_url(const std::string& name) const;
+        void load_shard(const std::string& name);
+
+        fs::path m_index_file;
+        fs::path m_shards_dir;
+        std::string m_shards_url;
+        std::string m_info;
+        std::map<std::string, std::string> m_hashes;
+        std::map<std::string, shard> m_shards;
+    };
+}  // namespace mamba
+
+#endif  // MAMBA_SHARDED_REPODATA_HPP
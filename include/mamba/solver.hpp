@@ -12,6 +12,7 @@
 #include <utility>
 #include <vector>
 
+#include "mamba_fs.hpp"
 #include "match_spec.hpp"
 #include "output.hpp"
 #include "pool.hpp"
@@ -23,11 +24,13 @@ extern "C"
 #include "solv/queue.h"
 #include "solv/solver.h"
 #include "solv/solverdebug.h"
+#include "solv/transaction.h"
 }
 
 #define MAMBA_NO_DEPS 0b0001
 #define MAMBA_ONLY_DEPS 0b0010
 #define MAMBA_FORCE_REINSTALL 0b0100
+#define MAMBA_FREEZE_INSTALLED 0b1000
 
 namespace mamba
 {
@@ -53,18 +56,64 @@ namespace mamba
         bool solve();
         std::string problems_to_str();
 
+        // Enables the solution cache in the given directory (usually
+        // `pkgs/cache`). Solutions are keyed on the state of every repo in the
+        // pool, the jobs and the solver flags, so that solving the same request
+        // against unchanged repodata skips the solve entirely.
+        void set_solution_cache(const fs::path& cache_dir);
+        bool solution_from_cache() const;
+
+        // Portfolio mode: up to `size` solver configurations (job order, focus
+        // flags, strict priority pruning) solve clones of the pool in tasks of
+        // thread_pool::global(). The first solution is taken unless one of the
+        // configurations before it also solves within a fifth of the time it
+        // took (at least 10 ms), the lowest index wins then. The configurations
+        // that are still running finish in the pool since libsolv cannot be
+        // interrupted, wait_for_all_threads() waits for them; the ones that
+        // have not started are skipped. 0 or 1 disables it.
+        void set_portfolio(std::size_t size);
+        // the configuration of the solution, empty if not solved by the portfolio
+        const std::string& portfolio_winner() const;
+
+        // Solves the solvers of one pool as solve() does, the job sets being
+        // solved together beforehand in `threads` tasks of thread_pool::global()
+        // (at most its size, see Context::max_parallel_tasks; its size if 0),
+        // or one after the other in the pool with a single thread.
+        // Every task solves its share of the job sets in its own clone of
+        // the pool, whose whatprovides is created once. The pool cannot be
+        // shared read-only: libsolv writes to it while solving (the
+        // whatprovides of relations and of job selections are added lazily).
+        // The cost of a clone is logged, see also benchmark_solver --batch.
+        // Returns the result of solve() for each solver.
+        static std::vector<bool> solve_batch(const std::vector<MSolver*>& solvers,
+                                             std::size_t threads = 0);
+
+        // the transaction of the solution, owned by the caller
+        Transaction* create_transaction();
+
         const std::vector<MatchSpec>& install_specs() const;
         const std::vector<MatchSpec>& remove_specs() const;
 
-        operator Solver*();
-
         bool only_deps = false;
         bool no_deps = false;
         bool force_reinstall = false;
+        // installed packages outside of the dependencies of the specs are
+        // locked, the solve is retried without the locks if it fails
+        bool freeze_installed = false;
 
     private:
         void add_channel_specific_job(const MatchSpec& ms, int job_flag);
         void add_reinstall_job(MatchSpec& ms, int job_flag);
+        bool add_freeze_installed_job();
+        bool solve_jobs();
+        void run_solver();
+        bool solve_portfolio();
+
+        std::string jobs_key() const;
+        std::string solution_cache_key() const;
+        bool load_cached_solution(const std::string& key);
+        bool check_cached_solution(const Map& chosen) const;
+        void store_solution(const std::string& key, const Queue& decisions) const;
 
         std::vector<std::pair<int, int>> m_flags;
         std::vector<MatchSpec> m_install_specs;
@@ -72,9 +121,21 @@ namespace mamba
         std::vector<MatchSpec> m_neuter_specs;  // unused for now
         bool m_is_solved;
         Solver* m_solver;
+        MPool& m_mpool;
         Pool* m_pool;
         Queue m_jobs;
         const PrefixData* m_prefix_data = nullptr;
+
+        fs::path m_solution_cache_dir;
+        bool m_from_cache = false;
+        std::size_t m_portfolio_size = 0;
+        std::string m_portfolio_winner;
+        // decisions of a cached or portfolio solution, installed packages
+        // that are removed are negative
+        Queue m_decisions;
+        // the jobs solved by solve_batch and their decisions
+        std::string m_batch_jobs;
+        Queue m_batch_decisions;
     };
 }  // namespace mamba
 
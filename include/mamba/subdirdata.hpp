@@ -7,9 +7,12 @@
 #ifndef MAMBA_SUBDIRDATA_HPP
 #define MAMBA_SUBDIRDATA_HPP
 
+#include <map>
 #include <memory>
 #include <regex>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -17,7 +20,11 @@
 #include "fetch.hpp"
 #include "mamba_fs.hpp"
 #include "output.hpp"
+#include "patch_journal.hpp"
 #include "repo.hpp"
+#include "repodata_index.hpp"
+#include "sharded_repodata.hpp"
+#include "thread_utils.hpp"
 #include "util.hpp"
 
 
@@ -49,7 +56,42 @@ namespace mamba
 
         MRepo create_repo(MPool& pool);
 
+        // sparse loading, see RepodataIndex
+        RepodataIndex& name_index();
+        MRepo create_repo(MPool& pool, const std::set<std::string>& names);
+
+        // sharded repodata: the url is a shard index (see ShardedRepodata),
+        // create_repo(pool, names) then reads the fetched shards
+        bool sharded() const;
+        ShardedRepodata& shards();
+
+        RepoMetadata repo_metadata();
+        // state of the cached repodata, see MPool::set_repo_state
+        std::string repo_state();
+
+        // Tiered repodata: the subdir is first loaded from a smaller repodata
+        // (e.g. current_repodata.json). When it is not available, or when it
+        // is not enough to solve, use_full_repodata() switches to the full
+        // repodata; the subdir then has to be loaded again.
+        void set_full_repodata(const std::string& url, const std::string& repodata_fn);
+        bool use_full_repodata();
+
+        // loaded from an expired cache, see SubdirRevalidation
+        bool stale() const;
+        DownloadTarget* revalidation_target();
+        // writes the refreshed repodata to the cache and returns the file
+        // names of the records that changed, were added or were removed
+        std::set<std::string> finish_revalidation();
+
     private:
+        void check_solv_cache(const fs::file_time_type::clock::time_point& now,
+                              fs::file_time_type::duration cache_age);
+        bool finalize_revalidation();
+        bool check_patch_journal();
+        bool apply_patch_journal(std::set<std::string>& changed_fns, nlohmann::json& changes);
+        void update_solv_cache(const RepoMetadata& previous,
+                               const std::set<std::string>& changed_fns,
+                               const nlohmann::json& changes);
         bool decompress();
         void create_target(nlohmann::json& mod_etag);
         std::size_t get_cache_control_max_age(const std::string& val);
@@ -59,6 +101,7 @@ namespace mamba
 
         bool m_json_cache_valid = false;
         bool m_solv_cache_valid = false;
+        bool m_stale = false;
 
         std::ofstream out_file;
 
@@ -70,8 +113,44 @@ namespace mamba
         std::string m_name;
         std::string m_json_fn;
         std::string m_solv_fn;
+        std::string m_full_url;
+        std::string m_full_json_fn;
         nlohmann::json m_mod_etag;
         std::unique_ptr<TemporaryFile> m_temp_file;
+        std::unique_ptr<RepodataIndex> m_name_index;
+        std::unique_ptr<PatchJournal> m_patch_journal;
+        std::unique_ptr<ShardedRepodata> m_shards;
+    };
+
+    /*
+     * Stale-while-revalidate refresh of the subdirs loaded from an expired
+     * cache: the conditional requests run in the background while the stale
+     * repodata is used (e.g. for solving), finish() then writes the refreshed
+     * repodata to the cache.
+     */
+    class SubdirRevalidation
+    {
+    public:
+        SubdirRevalidation(const std::vector<std::shared_ptr<MSubdirData>>& subdirs);
+        ~SubdirRevalidation();
+
+        SubdirRevalidation(const SubdirRevalidation&) = delete;
+        SubdirRevalidation& operator=(const SubdirRevalidation&) = delete;
+
+        // waits for the refresh and returns the changed records (file names)
+        // per repo url, only for the subdirs that changed
+        std::map<std::string, std::set<std::string>> finish();
+        // once finished, whether a solve done with the stale repodata has to
+        // be redone: it failed and records changed, or its solution installs
+        // a record that changed (given by repo url and file name)
+        bool outdated_solution(
+            bool solved, const std::vector<std::pair<std::string, std::string>>& installed) const;
+
+    private:
+        std::map<std::string, std::set<std::string>> m_changed;
+        std::vector<std::shared_ptr<MSubdirData>> m_subdirs;
+        std::unique_ptr<MultiDownloadTarget> m_multi_dl;
+        thread m_thread;
     };
 
     // Contrary to conda original function, this one expects a full url
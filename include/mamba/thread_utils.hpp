@@ -10,11 +10,16 @@
 #include <atomic>
 #include <condition_variable>
 #include <csignal>
+#include <deque>
 #include <exception>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace mamba
 {
@@ -108,6 +113,79 @@ namespace mamba
         });
     }
 
+    /***************
+     * thread_pool *
+     ***************/
+
+    // Fixed size pool of worker threads. Each worker has its own task queue,
+    // and steals tasks from the other queues when its own one is empty.
+    // Tasks that have not started yet when the program is interrupted are
+    // not run, their future holds a thread_interrupted exception instead.
+    // Pending tasks are accounted as threads for wait_for_all_threads.
+    class thread_pool
+    {
+    public:
+        // 0 means one thread per core
+        explicit thread_pool(std::size_t n_threads = 0);
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        thread_pool(thread_pool&&) = delete;
+        thread_pool& operator=(thread_pool&&) = delete;
+
+        template <class Function, class... Args>
+        auto submit(Function&& func, Args&&... args)
+            -> std::future<std::invoke_result_t<std::decay_t<Function>, std::decay_t<Args>...>>;
+
+        std::size_t size() const;
+        // true if called from a task of this pool, which must not block on
+        // other tasks of the pool
+        bool in_worker() const;
+
+        // Pool shared by the whole program, its size is taken from
+        // Context::max_parallel_tasks when it is first used
+        static thread_pool& global();
+
+    private:
+        using task = std::function<void()>;
+
+        struct task_queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        void schedule(task t);
+        bool pop(std::size_t idx, task& t);
+        void run(std::size_t idx);
+
+        std::vector<std::unique_ptr<task_queue>> m_queues;
+        std::vector<std::thread> m_workers;
+        std::atomic<std::size_t> m_next_queue{ 0 };
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::size_t m_pending = 0;
+        bool m_stop = false;
+    };
+
+    template <class Function, class... Args>
+    inline auto thread_pool::submit(Function&& func, Args&&... args)
+        -> std::future<std::invoke_result_t<std::decay_t<Function>, std::decay_t<Args>...>>
+    {
+        using result_type = std::invoke_result_t<std::decay_t<Function>, std::decay_t<Args>...>;
+        auto f = std::bind(std::forward<Function>(func), std::forward<Args>(args)...);
+        auto t = std::make_shared<std::packaged_task<result_type()>>([f]() mutable {
+            interruption_point();
+            return f();
+        });
+        std::future<result_type> res = t->get_future();
+        schedule([t]() { (*t)(); });
+        return res;
+    }
+
     /**********************
      * interruption_guard *
      **********************/
@@ -7,6 +7,8 @@
 #ifndef MAMBA_TRANSACTION_HPP
 #define MAMBA_TRANSACTION_HPP
 
+#include <atomic>
+#include <condition_variable>
 #include <future>
 #include <iomanip>
 #include <memory>
@@ -32,6 +34,7 @@ extern "C"
 }
 
 #include "solver.hpp"
+#include "thread_utils.hpp"
 
 
 namespace mamba
@@ -49,6 +52,15 @@ namespace mamba
         void add_url();
         bool finalize_callback();
         bool finished();
+        // blocks until the package is extracted (or failed to), returns
+        // false if interrupted
+        bool wait_finished();
+        // blocks until the package is downloaded and validated (or failed
+        // to), its extraction may still be running. Returns false if
+        // interrupted
+        bool wait_validated();
+        // marks the package as failed if its download did not finish
+        void set_download_failed();
         void validate();
         bool extract();
         bool extract_from_cache();
@@ -66,13 +78,21 @@ namespace mamba
             SHA256_ERROR,
             MD5SUM_ERROR,
             SIZE_ERROR,
-            EXTRACT_ERROR
+            EXTRACT_ERROR,
+            DOWNLOAD_ERROR
         };
 
         std::exception m_decompress_exception;
 
     private:
+        void set_finished();
+        void set_validation_result(VALIDATION_RESULT result);
+
         bool m_finished;
+        bool m_validated = false;
+        bool m_download_finished = false;
+        mutable std::mutex m_finished_mutex;
+        std::condition_variable m_finished_cv;
         PackageInfo m_package_info;
 
         std::string m_sha256, m_md5;
@@ -87,7 +107,6 @@ namespace mamba
         std::future<bool> m_extract_future;
 
         VALIDATION_RESULT m_validation_result = VALIDATION_RESULT::UNDEFINED;
-        static std::mutex extract_mutex;
     };
 
     class MTransaction
@@ -100,7 +119,19 @@ namespace mamba
             ignore
         };
 
+        // The solvables of the transaction are turned into PackageInfo records
+        // once it is planned: the solver, the pool and its repos can be freed
+        // before fetching and linking (only the id() and url() of the MRepo
+        // handles passed to prompt(), execute() and fetch_extract_packages()
+        // are used).
         MTransaction(MSolver& solver, MultiPackageCache& cache);
+        // Transaction unlinking and linking the given packages without a solve
+        // (e.g. to apply a lock file). The installed packages must be in the
+        // installed repo of the pool, the packages to install are added to it.
+        MTransaction(MPool& pool,
+                     const std::vector<PackageInfo>& to_remove,
+                     const std::vector<PackageInfo>& to_install,
+                     MultiPackageCache& cache);
         ~MTransaction();
 
         MTransaction(const MTransaction&) = delete;
@@ -118,25 +149,86 @@ namespace mamba
         void log_json();
         bool fetch_extract_packages(const std::string& cache_dir, std::vector<MRepo*>& repos);
         bool empty();
+        // asks for confirmation, then blocks until the packages are fetched
+        // and extracted (as fetch_extract_packages())
         bool prompt(const std::string& cache_dir, std::vector<MRepo*>& repos);
+        // only asks for confirmation, execute(prefix, cache_dir, repos) is
+        // expected to fetch the packages
+        bool prompt();
         void print();
+        // the packages must have been fetched (see prompt())
         bool execute(PrefixData& prefix, const fs::path& cache_dir);
+        // fetches the packages, and links every one of them as soon as it is
+        // extracted, while the other downloads are running. A failed download
+        // rolls back the transaction. If a package to unlink could not be
+        // relinked from the cache, nothing is unlinked before all of the
+        // downloads are validated.
+        bool execute(PrefixData& prefix,
+                     const fs::path& cache_dir,
+                     std::vector<MRepo*>& repos);
         bool filter(Solvable* s);
 
         std::string find_python_version();
 
     private:
+        // Packages are downloaded and extracted in the background, while
+        // execute() links every package as soon as it has been extracted.
+        void start_fetch(const fs::path& cache_dir, std::vector<MRepo*>& repos);
+        // false if the package could not be fetched (or validated only, if
+        // not extracted) or on interruption
+        bool wait_for_fetch(PackageDownloadExtractTarget& target, bool extracted);
+        bool wait_for_fetch(const std::string& name);
+        bool wait_for_downloads();
+        void finish_fetch();
+
+        // a package of the transaction classes, as printed by print()
+        struct classified_package
+        {
+            Id cls;
+            // filtered out, see filter()
+            bool ignored;
+            // the package, then the one replacing it (for changes)
+            std::vector<PackageInfo> packages;
+        };
+
         FilterType m_filter_type = FilterType::none;
         std::set<Id> m_filter_name_ids;
 
         TransactionContext m_transaction_context;
         MultiPackageCache m_multi_cache;
-        std::vector<Solvable*> m_to_install, m_to_remove;
+        std::vector<PackageInfo> m_to_install, m_to_remove;
+        // the repo ids of m_to_install, compared with the ids of the repos to
+        // fetch from, which may have been freed with their pool
+        std::vector<Id> m_install_repos;
+        std::vector<classified_package> m_classified;
+        // in execution order, the indices of the package to unlink (in
+        // m_to_remove) and of the package to link (in m_to_install), or -1
+        std::vector<std::pair<int, int>> m_steps;
+        std::string m_python_version;
         History::UserRequest m_history_entry;
-        Transaction* m_transaction;
+        // freed by init(), once the transaction is planned
+        Transaction* m_transaction = nullptr;
+        // repo of the packages of an explicit transaction
+        std::unique_ptr<MRepo> m_explicit_repo;
 
         bool m_force_reinstall = false;
+
+        bool m_fetch_started = false;
+        std::atomic<bool> m_downloaded{ false };
+        std::vector<std::unique_ptr<PackageDownloadExtractTarget>> m_fetch_targets;
+        std::unique_ptr<MultiDownloadTarget> m_multi_dl;
+        thread m_fetch_thread;
     };
+
+    // Parses explicit specs (package urls with an optional `#md5` suffix),
+    // skipping empty lines and comments.
+    std::vector<PackageInfo> explicit_specs_to_packages(const std::vector<std::string>& specs);
+
+    // The packages to unlink from and to link into the prefix so that it
+    // contains exactly the given packages. Packages are compared by name,
+    // version, build string and md5 (when both sides have one).
+    std::pair<std::vector<PackageInfo>, std::vector<PackageInfo>> diff_prefix_packages(
+        const PrefixData& prefix, const std::vector<PackageInfo>& packages);
 }  // namespace mamba
 
 #endif  // MAMBA_TRANSACTION_HPP
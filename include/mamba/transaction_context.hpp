@@ -7,9 +7,12 @@
 #ifndef MAMBA_TRANSACTION_CONTEXT
 #define MAMBA_TRANSACTION_CONTEXT
 
+#include <memory>
 #include <string>
 
+#include "dir_cache.hpp"
 #include "mamba_fs.hpp"
+#include "prefix_file_index.hpp"
 
 namespace mamba
 {
@@ -33,6 +36,9 @@ namespace mamba
         fs::path python_path;
         std::string python_version;
         std::string short_python_version;
+        // shared between all link / unlink operations of a transaction
+        std::shared_ptr<DirectoryCache> dir_cache;
+        std::shared_ptr<PrefixFileIndex> file_index;
     };
 }  // namespace mamba
 
@@ -14,6 +14,8 @@
 namespace validate
 {
     std::string sha256sum(const std::string& path);
+    // hashes the content of data, not the file it names
+    std::string sha256sum_string(const std::string& data);
     std::string md5sum(const std::string& path);
     bool sha256(const std::string& path, const std::string& validation);
     bool md5(const std::string& path, const std::string& validation);
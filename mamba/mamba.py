@@ -229,9 +229,8 @@ def remove(args, parser):
 
         # add installed
         if use_mamba_experimental:
-            prefix_data = api.PrefixData(context.target_prefix)
-            prefix_data.load()
-            repo = api.Repo(pool, prefix_data)
+            # read from conda-meta through its .solv cache
+            repo = api.Repo.from_conda_meta(pool, context.target_prefix)
             repos.append(repo)
         else:
             repo = api.Repo(pool, "installed", installed_json_f.name, "")
@@ -523,6 +522,10 @@ def install(args, parser, command="install"):
                 (api.MAMBA_NO_DEPS, context.deps_modifier == DepsModifier.NO_DEPS),
                 (api.MAMBA_ONLY_DEPS, context.deps_modifier == DepsModifier.ONLY_DEPS),
                 (api.MAMBA_FORCE_REINSTALL, context.force_reinstall),
+                (
+                    api.MAMBA_FREEZE_INSTALLED,
+                    context.update_modifier == UpdateModifier.FREEZE_INSTALLED,
+                ),
             ]
         )
         solver.add_jobs(mamba_solve_specs, solver_task)
@@ -562,6 +565,9 @@ def install(args, parser, command="install"):
 
         package_cache = api.MultiPackageCache(context.pkgs_dirs)
         transaction = api.Transaction(solver, package_cache)
+        # the transaction keeps its own package records, the solver and the
+        # pool are freed before fetching
+        del solver, pool
         mmb_specs, to_link, to_unlink = transaction.to_conda()
 
         specs_to_add = [MatchSpec(m) for m in mmb_specs[0]]
@@ -37,9 +37,8 @@ def create_pool(
     repos = []
 
     if installed:
-        prefix_data = api.PrefixData(context.target_prefix)
-        prefix_data.load()
-        repo = api.Repo(pool, prefix_data)
+        # read from conda-meta through its .solv cache
+        repo = api.Repo.from_conda_meta(pool, context.target_prefix)
         repos.append(repo)
 
     if channels:
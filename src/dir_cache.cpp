@@ -0,0 +1,403 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <system_error>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mamba/dir_cache.hpp"
+#include "mamba/output.hpp"
+#include "mamba/util.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        std::string dir_key(const fs::path& rel_dir)
+        {
+            std::string key = rel_dir.generic_string();
+            while (!key.empty() && key.back() == '/')
+            {
+                key.pop_back();
+            }
+            return key;
+        }
+
+        [[noreturn]] void throw_fs_error(const std::string& what, const fs::path& p, int err)
+        {
+            throw fs::filesystem_error(what, p, std::error_code(err, std::generic_category()));
+        }
+    }  // namespace
+
+    DirectoryCache::file_descriptor::file_descriptor(int f)
+        : fd(f)
+    {
+    }
+
+    DirectoryCache::file_descriptor::~file_descriptor()
+    {
+#ifndef _WIN32
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+#endif
+    }
+
+    DirectoryCache::DirectoryCache(const fs::path& prefix)
+        : m_prefix(prefix)
+    {
+    }
+
+    const fs::path& DirectoryCache::prefix() const
+    {
+        return m_prefix;
+    }
+
+    void DirectoryCache::clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fds.clear();
+        m_known_dirs.clear();
+        m_prune_candidates.clear();
+        m_prefix_fd.reset();
+    }
+
+    void DirectoryCache::mark_for_pruning(const std::set<std::string>& rel_dirs)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& d : rel_dirs)
+        {
+            std::string key = dir_key(d);
+            if (!key.empty())
+            {
+                m_prune_candidates.insert(std::move(key));
+            }
+        }
+    }
+
+    std::size_t DirectoryCache::prune_empty_directories()
+    {
+        auto depth = [](const std::string& p) {
+            return static_cast<std::size_t>(std::count(p.begin(), p.end(), '/'));
+        };
+
+        // deepest directories first, so that every directory is only
+        // checked once all its (candidate) children have been handled
+        std::set<std::pair<std::size_t, std::string>, std::greater<>> queue;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& c : m_prune_candidates)
+            {
+                queue.emplace(depth(c), c);
+            }
+            m_prune_candidates.clear();
+        }
+
+        std::size_t removed = 0;
+        while (!queue.empty())
+        {
+            std::string dir = queue.begin()->second;
+            queue.erase(queue.begin());
+            if (remove_empty_directory(dir))
+            {
+                ++removed;
+                std::string parent = fs::path(dir).parent_path().generic_string();
+                if (!parent.empty())
+                {
+                    queue.emplace(depth(parent), parent);
+                }
+            }
+        }
+        LOG_INFO << "Pruned " << removed << " empty directories in " << m_prefix;
+        return removed;
+    }
+
+    void DirectoryCache::forget(const std::string& key)
+    {
+        // drop the directory and everything below it
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::string sub = key + "/";
+
+        m_fds.erase(key);
+        for (auto it = m_fds.lower_bound(sub); it != m_fds.end() && starts_with(it->first, sub);)
+        {
+            it = m_fds.erase(it);
+        }
+
+        m_known_dirs.erase(key);
+        for (auto it = m_known_dirs.lower_bound(sub);
+             it != m_known_dirs.end() && starts_with(*it, sub);)
+        {
+            it = m_known_dirs.erase(it);
+        }
+    }
+
+#ifndef _WIN32
+
+    auto DirectoryCache::prefix_fd() -> fd_ptr
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_prefix_fd)
+        {
+            int fd = ::open(m_prefix.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                throw_fs_error("Could not open prefix directory", m_prefix, errno);
+            }
+            m_prefix_fd = std::make_shared<file_descriptor>(fd);
+        }
+        return m_prefix_fd;
+    }
+
+    auto DirectoryCache::directory_fd(const fs::path& rel_dir, bool create) -> fd_ptr
+    {
+        std::string key = dir_key(rel_dir);
+        if (key.empty())
+        {
+            return prefix_fd();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_fds.find(key);
+            if (it != m_fds.end())
+            {
+                return it->second;
+            }
+        }
+
+        fd_ptr root = prefix_fd();
+        int fd = ::openat(root->fd, key.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT && create)
+        {
+            fs::path rel(key);
+            fd_ptr parent = directory_fd(rel.parent_path(), true);
+            std::string name = rel.filename().string();
+            if (::mkdirat(parent->fd, name.c_str(), 0777) != 0 && errno != EEXIST)
+            {
+                throw_fs_error("Could not create directory", m_prefix / rel, errno);
+            }
+            fd = ::openat(parent->fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (fd < 0)
+        {
+            if (!create && (errno == ENOENT || errno == ENOTDIR))
+            {
+                return nullptr;
+            }
+            throw_fs_error("Could not open directory", m_prefix / key, errno);
+        }
+
+        auto res = std::make_shared<file_descriptor>(fd);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_fds.size() >= max_open_directories)
+        {
+            // descriptors still in use are kept alive by their shared_ptr
+            m_fds.clear();
+        }
+        m_fds.emplace(key, res);
+        m_known_dirs.insert(key);
+        return res;
+    }
+
+    void DirectoryCache::create_directories(const fs::path& rel_dir)
+    {
+        directory_fd(rel_dir, true);
+    }
+
+    bool DirectoryCache::lexists(const fs::path& rel_path)
+    {
+        fd_ptr dir = directory_fd(rel_path.parent_path(), false);
+        if (!dir)
+        {
+            return false;
+        }
+        struct stat st;
+        std::string name = rel_path.filename().string();
+        return ::fstatat(dir->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    bool DirectoryCache::remove(const fs::path& rel_path)
+    {
+        fd_ptr dir = directory_fd(rel_path.parent_path(), false);
+        if (!dir)
+        {
+            return false;
+        }
+        std::string name = rel_path.filename().string();
+        if (::unlinkat(dir->fd, name.c_str(), 0) != 0)
+        {
+            if (errno == ENOENT)
+            {
+                return false;
+            }
+            if (errno == EISDIR || errno == EPERM)
+            {
+                // fs::remove also handles (empty) directories
+                return remove_empty_directory(rel_path);
+            }
+            throw_fs_error("Could not remove file", m_prefix / rel_path, errno);
+        }
+        return true;
+    }
+
+    bool DirectoryCache::remove_empty_directory(const fs::path& rel_dir)
+    {
+        std::string key = dir_key(rel_dir);
+        if (key.empty())
+        {
+            // never remove the prefix itself
+            return false;
+        }
+        fs::path rel(key);
+        fd_ptr parent = directory_fd(rel.parent_path(), false);
+        if (!parent)
+        {
+            return false;
+        }
+        std::string name = rel.filename().string();
+        if (::unlinkat(parent->fd, name.c_str(), AT_REMOVEDIR) != 0)
+        {
+            if (errno == ENOTEMPTY || errno == EEXIST || errno == ENOENT || errno == ENOTDIR
+                || errno == EBUSY)
+            {
+                return false;
+            }
+            throw_fs_error("Could not remove directory", m_prefix / rel, errno);
+        }
+        forget(key);
+        return true;
+    }
+
+    void DirectoryCache::create_hard_link(const fs::path& src, const fs::path& rel_dst)
+    {
+        std::string name = rel_dst.filename().string();
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            fd_ptr dir = directory_fd(rel_dst.parent_path(), true);
+            if (::linkat(AT_FDCWD, src.c_str(), dir->fd, name.c_str(), 0) == 0)
+            {
+                return;
+            }
+            if (errno != ENOENT || attempt != 0)
+            {
+                break;
+            }
+            // the cached directory might have been removed in the meantime
+            forget(dir_key(rel_dst.parent_path()));
+        }
+        throw_fs_error("Could not create hard link", m_prefix / rel_dst, errno);
+    }
+
+    void DirectoryCache::copy_symlink(const fs::path& src, const fs::path& rel_dst)
+    {
+        std::vector<char> target(256);
+        while (true)
+        {
+            ssize_t len = ::readlink(src.c_str(), target.data(), target.size());
+            if (len < 0)
+            {
+                throw_fs_error("Could not read symlink", src, errno);
+            }
+            if (static_cast<std::size_t>(len) < target.size())
+            {
+                target[len] = '\0';
+                break;
+            }
+            target.resize(target.size() * 2);
+        }
+
+        std::string name = rel_dst.filename().string();
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            fd_ptr dir = directory_fd(rel_dst.parent_path(), true);
+            if (::symlinkat(target.data(), dir->fd, name.c_str()) == 0)
+            {
+                return;
+            }
+            if (errno != ENOENT || attempt != 0)
+            {
+                break;
+            }
+            forget(dir_key(rel_dst.parent_path()));
+        }
+        throw_fs_error("Could not create symlink", m_prefix / rel_dst, errno);
+    }
+
+#else
+
+    auto DirectoryCache::prefix_fd() -> fd_ptr
+    {
+        return nullptr;
+    }
+
+    auto DirectoryCache::directory_fd(const fs::path& rel_dir, bool create) -> fd_ptr
+    {
+        return nullptr;
+    }
+
+    void DirectoryCache::create_directories(const fs::path& rel_dir)
+    {
+        std::string key = dir_key(rel_dir);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (key.empty() || m_known_dirs.count(key))
+            {
+                return;
+            }
+        }
+        if (!fs::exists(m_prefix / rel_dir))
+        {
+            fs::create_directories(m_prefix / rel_dir);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_known_dirs.insert(key);
+    }
+
+    bool DirectoryCache::lexists(const fs::path& rel_path)
+    {
+        return mamba::lexists(m_prefix / rel_path);
+    }
+
+    bool DirectoryCache::remove(const fs::path& rel_path)
+    {
+        return fs::remove(m_prefix / rel_path);
+    }
+
+    bool DirectoryCache::remove_empty_directory(const fs::path& rel_dir)
+    {
+        std::string key = dir_key(rel_dir);
+        fs::path dir = m_prefix / rel_dir;
+        if (key.empty() || !fs::is_directory(dir) || !fs::is_empty(dir))
+        {
+            return false;
+        }
+        fs::remove(dir);
+        forget(key);
+        return true;
+    }
+
+    void DirectoryCache::create_hard_link(const fs::path& src, const fs::path& rel_dst)
+    {
+        fs::create_hard_link(src, m_prefix / rel_dst);
+    }
+
+    void DirectoryCache::copy_symlink(const fs::path& src, const fs::path& rel_dst)
+    {
+        fs::copy_symlink(src, m_prefix / rel_dst);
+    }
+
+#endif
+}  // namespace mamba
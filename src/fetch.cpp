@@ -48,13 +48,24 @@ namespace mamba
         curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, &DownloadTarget::write_callback);
         curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, this);
 
+        curl_slist_free_all(m_headers);
         m_headers = nullptr;
         if (ends_with(url, ".json"))
         {
-            curl_easy_setopt(
-                m_handle, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, compress, identity");
+            // zstd only if libcurl can decode it
+            static const bool has_zstd
+                = curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_ZSTD;
+            curl_easy_setopt(m_handle,
+                             CURLOPT_ACCEPT_ENCODING,
+                             has_zstd ? "zstd, gzip, deflate, compress, identity"
+                                      : "gzip, deflate, compress, identity");
             m_headers = curl_slist_append(m_headers, "Content-Type: application/json");
         }
+        // kept for retries and fallback urls
+        for (const auto& header : m_conditional_headers)
+        {
+            m_headers = curl_slist_append(m_headers, header.c_str());
+        }
         curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
         curl_easy_setopt(m_handle, CURLOPT_VERBOSE, Context::instance().verbosity >= 2);
 
@@ -107,6 +118,10 @@ namespace mamba
 
     bool DownloadTarget::can_retry()
     {
+        if (m_use_fallback)
+        {
+            return true;
+        }
         return m_retries < size_t(Context::instance().max_retries) && http_status >= 500
                && !starts_with(m_url, "file://");
     }
@@ -114,6 +129,26 @@ namespace mamba
     CURL* DownloadTarget::retry()
     {
         auto now = std::chrono::steady_clock::now();
+        if (m_use_fallback)
+        {
+            LOG_INFO << "Trying " << m_fallback_urls.front() << " instead of " << m_url;
+            m_url = m_fallback_urls.front();
+            m_fallback_urls.erase(m_fallback_urls.begin());
+            m_use_fallback = false;
+            etag.clear();
+            mod.clear();
+            cache_control.clear();
+            m_file.close();
+            m_file.open(m_filename, std::ios::trunc);
+            init_curl_target(m_url);
+            if (m_has_progress_bar)
+            {
+                curl_easy_setopt(
+                    m_handle, CURLOPT_XFERINFOFUNCTION, &DownloadTarget::progress_callback);
+                curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
+            }
+            return m_handle;
+        }
         if (now >= m_next_retry)
         {
             if (fs::exists(m_filename))
@@ -252,16 +287,21 @@ namespace mamba
             return std::string(key + ": " + value);
         };
 
+        auto add_header = [&](const std::string& header) {
+            m_conditional_headers.push_back(header);
+            m_headers = curl_slist_append(m_headers, header.c_str());
+        };
+
         if (mod_etag.find("_etag") != mod_etag.end())
         {
-            m_headers = curl_slist_append(m_headers,
-                                          to_header("If-None-Match", mod_etag["_etag"]).c_str());
+            add_header(to_header("If-None-Match", mod_etag["_etag"]));
         }
         if (mod_etag.find("_mod") != mod_etag.end())
         {
-            m_headers = curl_slist_append(m_headers,
-                                          to_header("If-Modified-Since", mod_etag["_mod"]).c_str());
+            add_header(to_header("If-Modified-Since", mod_etag["_mod"]));
         }
+        // the list was empty for urls other than .json
+        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
     }
 
     void DownloadTarget::set_progress_bar(ProgressProxy progress_proxy)
@@ -283,6 +323,22 @@ namespace mamba
         return m_name;
     }
 
+    const std::string& DownloadTarget::url() const
+    {
+        return m_url;
+    }
+
+    void DownloadTarget::add_fallback_url(const std::string& url)
+    {
+        m_fallback_urls.push_back(url);
+    }
+
+    bool DownloadTarget::try_fallback()
+    {
+        m_use_fallback = !m_fallback_urls.empty();
+        return m_use_fallback;
+    }
+
     bool DownloadTarget::perform()
     {
         result = curl_easy_perform(m_handle);
@@ -343,6 +399,11 @@ namespace mamba
         LOG_INFO << "Transfer finalized, status: " << http_status << " [" << effective_url << "] "
                  << downloaded_size << " bytes";
 
+        if (http_status >= 400 && http_status < 500 && try_fallback())
+        {
+            return false;
+        }
+
         if (http_status >= 500 && can_retry())
         {
             // this request didn't work!
@@ -4,6 +4,8 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <future>
 #include <regex>
 #include <string>
 #include <tuple>
@@ -16,6 +18,7 @@
 #include "mamba/link.hpp"
 #include "mamba/match_spec.hpp"
 #include "mamba/output.hpp"
+#include "mamba/thread_utils.hpp"
 #include "mamba/transaction_context.hpp"
 #include "mamba/util.hpp"
 #include "mamba/validate.hpp"
@@ -28,6 +31,23 @@
 
 namespace mamba
 {
+    namespace
+    {
+        // number of files of a package linked by one task of the thread pool
+        constexpr std::size_t link_chunk_size = 64;
+
+        void clobber_warning(const fs::path& rel_path, const std::string& owner)
+        {
+            std::cerr << termcolor::yellow << "Clobberwarning: " << termcolor::reset
+                      << "$CONDA_PREFIX/" << rel_path.string();
+            if (!owner.empty())
+            {
+                std::cerr << " (owned by " << owner << ")";
+            }
+            std::cerr << std::endl;
+        }
+    }  // namespace
+
     void python_entry_point_template(std::ostream& out, const python_entry_point_parsed& p)
     {
         auto import_name = split(p.func, ".")[0];
@@ -131,16 +151,15 @@ namespace mamba
         // We add -script.py to WIN32, and link the conda.exe launcher which will
         // automatically find the correct script to launch
         std::string win_script = path.string() + "-script.py";
-        fs::path script_path = m_context->target_prefix / win_script;
+        fs::path rel_script_path = win_script;
 #else
-        fs::path script_path = m_context->target_prefix / path;
+        fs::path rel_script_path = path;
 #endif
-        if (fs::exists(script_path))
+        fs::path script_path = m_context->target_prefix / rel_script_path;
+        if (m_context->dir_cache->lexists(rel_script_path))
         {
-            std::cerr << termcolor::yellow << "Clobberwarning: " << termcolor::reset
-                      << "$CONDA_PREFIX/"
-                      << fs::relative(script_path, m_context->target_prefix).string() << std::endl;
-            fs::remove(script_path);
+            clobber_warning(rel_script_path, m_context->file_index->owner(rel_script_path));
+            m_context->dir_cache->remove(rel_script_path);
         }
         std::ofstream out_file(script_path);
 
@@ -672,40 +691,41 @@ namespace mamba
     {
     }
 
-    bool UnlinkPackage::unlink_path(const nlohmann::json& path_data)
+    bool UnlinkPackage::unlink_path(const std::string& path)
     {
-        std::string subtarget = path_data["_path"].get<std::string>();
-        fs::path dst = m_context->target_prefix / subtarget;
-        fs::remove(dst);
-
-        // TODO what do we do with empty directories?
-        // remove empty parent path
-        auto parent_path = dst.parent_path();
-        while (fs::is_empty(parent_path))
+        fs::path subtarget = path;
+        m_context->dir_cache->remove(subtarget);
+
+        // empty parent directories are pruned once at the end of the transaction
+        auto parent_path = subtarget.parent_path();
+        if (!parent_path.empty())
         {
-            fs::remove(parent_path);
-            parent_path = parent_path.parent_path();
+            m_touched_dirs.insert(parent_path.generic_string());
         }
         return true;
     }
 
     bool UnlinkPackage::execute()
     {
-        // find the recorded JSON file
-        fs::path json = m_context->target_prefix / "conda-meta" / (m_specifier + ".json");
-        LOG_INFO << "unlink: opening " << json << std::endl;
-        std::ifstream json_file(json);
-        nlohmann::json json_record;
-        json_file >> json_record;
+        PrefixFileIndex& file_index = *m_context->file_index;
+        if (!file_index.contains(m_specifier))
+        {
+            throw std::runtime_error("Could not find package record for " + m_specifier);
+        }
 
-        for (auto& path : json_record["paths_data"]["paths"])
+        // files clobbered by another package are left in place
+        for (auto& path : file_index.owned_files(m_specifier))
         {
             unlink_path(path);
         }
 
-        json_file.close();
-
+        fs::path json = m_context->target_prefix / "conda-meta" / (m_specifier + ".json");
+        LOG_INFO << "unlink: removing " << json << std::endl;
         fs::remove(json);
+        file_index.remove(m_specifier);
+
+        m_context->dir_cache->mark_for_pruning(m_touched_dirs);
+        m_touched_dirs.clear();
 
         return true;
     }
@@ -744,20 +764,23 @@ namespace mamba
         }
 
         fs::path src = m_source / subtarget;
-        if (!fs::exists(dst.parent_path()))
-        {
-            fs::create_directories(dst.parent_path());
-        }
+        DirectoryCache& dir_cache = *m_context->dir_cache;
+        dir_cache.create_directories(rel_dst.parent_path());
 
-        if (fs::exists(dst))
+        // files of installed packages are found in the index, untracked
+        // files only when creating the new file fails
+        std::string owner = m_context->file_index->owner(rel_dst);
+        if (!owner.empty())
         {
             // Sometimes we might want to raise here ...
-            std::cerr << termcolor::yellow << "Clobberwarning: " << termcolor::reset
-                      << "$CONDA_PREFIX/" << rel_dst.string() << std::endl;
+            if (owner != m_pkg_info.str())
+            {
+                clobber_warning(rel_dst, owner);
+            }
 #ifdef _WIN32
             return std::make_tuple(validate::sha256sum(dst), rel_dst);
 #endif
-            fs::remove(dst);
+            dir_cache.remove(rel_dst);
         }
 
 #ifdef __APPLE__
@@ -768,6 +791,16 @@ namespace mamba
         {
             // we have to replace the PREFIX stuff in the data
             // and copy the file
+            if (owner.empty() && dir_cache.lexists(rel_dst))
+            {
+                // do not write through an untracked file or symlink
+                clobber_warning(rel_dst, "");
+#ifdef _WIN32
+                return std::make_tuple(validate::sha256sum(dst), rel_dst);
+#endif
+                dir_cache.remove(rel_dst);
+            }
+
             std::string new_prefix = m_context->target_prefix;
 #ifdef _WIN32
             replace_all(new_prefix, "\\", "/");
@@ -905,20 +938,41 @@ namespace mamba
             return std::make_tuple(validate::sha256sum(dst), rel_dst);
         }
 
-        if (path_data.path_type == PathType::HARDLINK)
-        {
-            LOG_INFO << "hard linked " << src << " --> " << dst;
-            fs::create_hard_link(src, dst);
-        }
-        else if (path_data.path_type == PathType::SOFTLINK)
+        auto create_link = [&]() {
+            if (path_data.path_type == PathType::HARDLINK)
+            {
+                LOG_INFO << "hard linked " << src << " --> " << dst;
+                dir_cache.create_hard_link(src, rel_dst);
+            }
+            else if (path_data.path_type == PathType::SOFTLINK)
+            {
+                LOG_INFO << "soft linked " << src << " --> " << dst;
+                dir_cache.copy_symlink(src, rel_dst);
+            }
+            else
+            {
+                throw std::runtime_error(
+                    std::string("Path type not implemented: ")
+                    + std::to_string(static_cast<int>(path_data.path_type)));
+            }
+        };
+
+        try
         {
-            LOG_INFO << "soft linked " << src << " --> " << dst;
-            fs::copy_symlink(src, dst);
+            create_link();
         }
-        else
+        catch (const fs::filesystem_error& e)
         {
-            throw std::runtime_error(std::string("Path type not implemented: ")
-                                     + std::to_string(static_cast<int>(path_data.path_type)));
+            if (e.code() != std::errc::file_exists)
+            {
+                throw;
+            }
+            clobber_warning(rel_dst, "");
+#ifdef _WIN32
+            return std::make_tuple(validate::sha256sum(dst), rel_dst);
+#endif
+            dir_cache.remove(rel_dst);
+            create_link();
         }
         // TODO we could also use the SHA256 sum of the paths json
         return std::make_tuple(validate::sha256sum(dst), rel_dst);
@@ -1023,59 +1077,82 @@ namespace mamba
             }
         }
 
-        std::vector<std::string> files_record;
-
-        // for (auto& path : paths_json["paths"])
-        nlohmann::json paths_json = nlohmann::json::object();
-        paths_json["paths"] = nlohmann::json::array();
-        paths_json["paths_version"] = 1;
-        for (auto& path : paths_data)
-        {
-            auto [sha256_in_prefix, final_path]
-                = link_path(path, noarch_type == NoarchType::PYTHON);
-            files_record.push_back(final_path);
-
-            nlohmann::json json_record
-                = { { "_path", final_path }, { "sha256_in_prefix", sha256_in_prefix } };
-
-            if (!path.sha256.empty())
+        std::vector<PathData> linked_paths(paths_data.size());
+        auto link_paths = [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i)
             {
-                json_record["sha256"] = path.sha256;
-            }
-            if (path.path_type == PathType::SOFTLINK)
-            {
-                json_record["path_type"] = "softlink";
-            }
-            else if (path.path_type == PathType::HARDLINK)
-            {
-                json_record["path_type"] = "hardlink";
+                const PathData& path = paths_data[i];
+                auto [sha256_in_prefix, final_path]
+                    = link_path(path, noarch_type == NoarchType::PYTHON);
+
+                PathData& linked = linked_paths[i];
+                linked.path = final_path;
+                linked.path_type = path.path_type;
+                linked.sha256 = path.sha256;
+                linked.sha256_in_prefix = sha256_in_prefix;
+                linked.no_link = path.no_link;
+                // note: in conda this is the size in bytes _before_ prefix replacement
+                linked.size_in_bytes = path.size_in_bytes;
             }
-            else if (path.path_type == PathType::DIRECTORY)
+        };
+
+        // the files are linked and hashed in chunks on the thread pool
+        thread_pool& pool = thread_pool::global();
+        std::size_t n_chunks = (paths_data.size() + link_chunk_size - 1) / link_chunk_size;
+        if (n_chunks <= 1 || pool.in_worker())
+        {
+            link_paths(0, paths_data.size());
+        }
+        else
+        {
+            std::vector<std::future<void>> futures;
+            for (std::size_t begin = 0; begin < paths_data.size(); begin += link_chunk_size)
             {
-                json_record["path_type"] = "directory";
+                std::size_t end = std::min(begin + link_chunk_size, paths_data.size());
+                futures.push_back(pool.submit(link_paths, begin, end));
             }
 
-            if (path.no_link)
+            // every chunk is waited for, as they refer to the paths
+            std::exception_ptr error;
+            for (std::size_t i = 0; i < futures.size(); ++i)
             {
-                json_record["no_link"] = true;
+                try
+                {
+                    futures[i].get();
+                }
+                catch (thread_interrupted&)
+                {
+                    // not started, a package is never partially linked
+                    std::size_t begin = i * link_chunk_size;
+                    link_paths(begin, std::min(begin + link_chunk_size, paths_data.size()));
+                }
+                catch (...)
+                {
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
             }
-
-            if (path.size_in_bytes != 0)
+            if (error)
             {
-                // note: in conda this is the size in bytes _before_ prefix replacement
-                json_record["size_in_bytes"] = path.size_in_bytes;
+                std::rethrow_exception(error);
             }
-
-            paths_json["paths"].push_back(json_record);
         }
 
+        auto add_linked_path = [&linked_paths](const std::string& path, PathType path_type) {
+            PathData linked;
+            linked.path = path;
+            linked.path_type = path_type;
+            linked_paths.push_back(std::move(linked));
+        };
+
         std::string f_name = index_json["name"].get<std::string>() + "-"
                              + index_json["version"].get<std::string>() + "-"
                              + index_json["build"].get<std::string>();
 
+        // the paths are streamed out separately, see write_prefix_record
         out_json = index_json;
-        out_json["paths_data"] = paths_json;
-        out_json["files"] = files_record;
         out_json["requested_spec"] = "TODO";
         out_json["package_tarball_full_path"] = std::string(m_source) + ".tar.bz2";
         out_json["extracted_package_dir"] = m_source;
@@ -1108,10 +1185,7 @@ namespace mamba
 
             for (const fs::path& pyc_path : pyc_files)
             {
-                out_json["paths_data"]["paths"].push_back(
-                    { { "_path", std::string(pyc_path) }, { "path_type", "pyc_file" } });
-
-                out_json["files"].push_back(pyc_path);
+                add_linked_path(pyc_path.string(), PathType::PYC_FILE);
             }
 
             if (link_json.find("noarch") != link_json.end()
@@ -1127,18 +1201,10 @@ namespace mamba
                     auto files = create_python_entry_point(entry_point_path, entry_point_parsed);
 
 #ifdef _WIN32
-                    out_json["paths_data"]["paths"].push_back(
-                        { { "_path", files[0] },
-                          { "path_type", "windows_python_entry_point_script" } });
-                    out_json["paths_data"]["paths"].push_back(
-                        { { "_path", files[1] },
-                          { "path_type", "windows_python_entry_point_exe" } });
-                    out_json["files"].push_back(files[0]);
-                    out_json["files"].push_back(files[1]);
+                    add_linked_path(files[0], PathType::WINDOWS_PYTHON_ENTRY_POINT_SCRIPT);
+                    add_linked_path(files[1], PathType::WINDOWS_PYTHON_ENTRY_POINT_EXE);
 #else
-                    out_json["paths_data"]["paths"].push_back(
-                        { { "_path", files }, { "path_type", "unix_python_entry_point" } });
-                    out_json["files"].push_back(files);
+                    add_linked_path(files, PathType::UNIX_PYTHON_ENTRY_POINT);
 #endif
                 }
             }
@@ -1154,7 +1220,16 @@ namespace mamba
 
         LOG_INFO << "Finalizing package " << f_name << " installation";
         std::ofstream out_file(prefix_meta / (f_name + ".json"));
-        out_file << out_json.dump(4);
+        write_prefix_record(out_file, out_json, linked_paths);
+        out_file.close();
+
+        std::vector<std::string> files;
+        files.reserve(linked_paths.size());
+        for (const auto& p : linked_paths)
+        {
+            files.push_back(p.path);
+        }
+        m_context->file_index->add(f_name, files);
 
         return true;
     }
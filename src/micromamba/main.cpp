@@ -23,6 +23,7 @@
 #include "mamba/channel.hpp"
 #include "mamba/context.hpp"
 #include "mamba/output.hpp"
+#include "mamba/pool_snapshot.hpp"
 #include "mamba/prefix_data.hpp"
 #include "mamba/repo.hpp"
 #include "mamba/shell_init.hpp"
@@ -73,6 +74,14 @@ static struct
     std::vector<std::string> channels;
     bool override_channels = false;  // currently a no-op!
     bool strict_channel_priority = false;
+    std::size_t solver_portfolio = 0;
+    bool sparse_repodata = false;
+    bool pool_snapshot = false;
+    bool stale_while_revalidate = false;
+    bool current_repodata = false;
+    bool sharded_repodata = false;
+    bool freeze_installed = false;
+    bool sync = false;
     std::string extra_safety_checks;
 } create_options;
 
@@ -81,6 +90,9 @@ static struct
     bool ssl_verify = true;
     std::size_t repodata_ttl = 1;
     bool retry_clean_cache = false;
+    bool repodata_zst = false;
+    bool compress_repodata_cache = false;
+    bool repodata_patches = false;
     std::string cacert_path;
 } network_options;
 
@@ -167,6 +179,15 @@ init_network_parser(CLI::App* subcom)
         "--repodata-ttl",
         network_options.repodata_ttl,
         "Repodata cache lifetime:\n 0 = always update\n 1 = respect HTTP header (default)\n>1 = cache lifetime in seconds");
+    subcom->add_flag("--repodata-zst",
+                     network_options.repodata_zst,
+                     "Fetch repodata.json.zst, fall back to repodata.json if not available");
+    subcom->add_flag("--compress-repodata-cache",
+                     network_options.compress_repodata_cache,
+                     "Store the repodata cache zstd compressed");
+    subcom->add_flag("--repodata-patches",
+                     network_options.repodata_patches,
+                     "Update expired repodata from its patch journal when available");
 }
 
 void
@@ -223,6 +244,9 @@ set_network_options(Context& ctx)
     }
 
     ctx.local_repodata_ttl = network_options.repodata_ttl;
+    ctx.repodata_zst = network_options.repodata_zst;
+    ctx.compress_repodata_cache = network_options.compress_repodata_cache;
+    ctx.repodata_patches = network_options.repodata_patches;
 }
 
 void
@@ -271,6 +295,24 @@ init_channel_parser(CLI::App* subcom)
     subcom->add_flag("--strict-channel-priority",
                      create_options.strict_channel_priority,
                      "Enable strict channel priority");
+    subcom->add_option("--solver-portfolio",
+                       create_options.solver_portfolio,
+                       "Solve with up to N solver configurations in parallel");
+    subcom->add_flag("--sparse-repodata",
+                     create_options.sparse_repodata,
+                     "Only load the packages reachable from the specs and installed packages");
+    subcom->add_flag("--pool-snapshot",
+                     create_options.pool_snapshot,
+                     "Read the channel repos from a pool snapshot in the cache when possible");
+    subcom->add_flag("--stale-while-revalidate",
+                     create_options.stale_while_revalidate,
+                     "Use expired repodata right away and refresh it while solving");
+    subcom->add_flag("--current-repodata",
+                     create_options.current_repodata,
+                     "Solve with current_repodata.json first, fall back to the full repodata");
+    subcom->add_flag("--sharded-repodata",
+                     create_options.sharded_repodata,
+                     "Only fetch the repodata shards of the packages reachable from the specs");
 }
 
 void
@@ -424,6 +466,8 @@ create_repo_from_pkgs_dir(MPool& pool, const fs::path& pkgs_dir)
 
 int RETRY_SUBDIR_FETCH = 1 << 0;
 int RETRY_SOLVE_ERROR = 1 << 1;
+int RETRY_STALE_REPODATA = 1 << 2;
+int RETRY_FULL_REPODATA = 1 << 3;
 
 void
 install_specs(const std::vector<std::string>& specs, bool create_env = false, int is_retry = 0)
@@ -473,6 +517,13 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
     std::vector<std::shared_ptr<MSubdirData>> subdirs;
     MultiDownloadTarget multi_dl;
 
+    // solve with current_repodata.json first, the full repodata is used for
+    // the subdirs that do not publish it and if solving fails
+    bool use_current = ctx.current_repodata && !(is_retry & RETRY_FULL_REPODATA);
+    // with sharded repodata, the shard index is fetched instead, and the full
+    // repodata for the subdirs that do not publish one
+    bool use_shards = ctx.sharded_repodata && !use_current && !ctx.offline;
+
     std::vector<std::pair<int, int>> priorities;
     int max_prio = static_cast<int>(channel_urls.size());
     std::string prev_channel_name;
@@ -480,10 +531,17 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
     {
         auto& channel = make_channel(url);
         std::string full_url = concat(channel.url(true), "/repodata.json");
+        std::string current_url = concat(channel.url(true), "/current_repodata.json");
+        std::string shards_url = concat(channel.url(true), "/repodata_shards.json");
+        std::string subdir_url = use_current ? current_url : use_shards ? shards_url : full_url;
 
         auto sdir = std::make_shared<MSubdirData>(concat(channel.name(), "/", channel.platform()),
-                                                  full_url,
-                                                  cache_dir / cache_fn_url(full_url));
+                                                  subdir_url,
+                                                  cache_dir / cache_fn_url(subdir_url));
+        if (use_current || use_shards)
+        {
+            sdir->set_full_repodata(full_url, cache_dir / cache_fn_url(full_url));
+        }
 
         sdir->load();
         multi_dl.add(sdir->target());
@@ -507,21 +565,116 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
         multi_dl.download(true);
     }
 
+    if (use_current || use_shards)
+    {
+        MultiDownloadTarget full_dl;
+        for (auto& subdir : subdirs)
+        {
+            if (!subdir->loaded() && subdir->use_full_repodata())
+            {
+                subdir->load();
+                full_dl.add(subdir->target());
+            }
+        }
+        if (!ctx.offline)
+        {
+            full_dl.download(true);
+        }
+    }
+
     std::vector<MRepo> repos;
-    MPool pool;
+    // freed once the transaction is planned, before fetching the packages
+    auto pool_ptr = std::make_unique<MPool>();
+    MPool& pool = *pool_ptr;
     if (ctx.offline)
     {
         LOG_INFO << "Creating repo from pkgs_dir for offline";
         repos.push_back(create_repo_from_pkgs_dir(pool, pkgs_dirs));
     }
-    PrefixData prefix_data(ctx.target_prefix);
-    prefix_data.load();
-    auto repo = MRepo(pool, prefix_data);
-    repos.push_back(repo);
+    // the records are not loaded, the installed repo is read from conda-meta
+    repos.push_back(MRepo::from_conda_meta(pool, ctx.target_prefix));
+
+    std::vector<std::string> roots;
+    for (auto& spec : specs)
+    {
+        roots.push_back(MatchSpec(spec).name);
+    }
+    Id pkg_id;
+    Solvable* pkg_s;
+    FOR_REPO_SOLVABLES(repo.repo(), pkg_id, pkg_s)
+    {
+        roots.push_back(pool_id2str(pool, pkg_s->name));
+    }
+
+    // with sparse loading, only the package names reachable from the specs
+    // and the installed packages are loaded from the repodata
+    bool sparse = ctx.sparse_repodata;
+    std::set<std::string> sparse_names;
+    if (sparse)
+    {
+        sparse = std::none_of(roots.begin(), roots.end(), [](const std::string& name) {
+            return name.find('*') != std::string::npos;
+        });
+
+        try
+        {
+            std::vector<RepodataIndex*> indexes;
+            for (auto& subdir : subdirs)
+            {
+                if (subdir->loaded())
+                {
+                    indexes.push_back(&subdir->name_index());
+                }
+            }
+            sparse_names = RepodataIndex::reachable(indexes, roots);
+            LOG_INFO << "Sparse loading of " << sparse_names.size() << " package names";
+        }
+        catch (std::runtime_error& e)
+        {
+            LOG_WARNING << "Could not use sparse repodata loading: " << e.what();
+            sparse = false;
+        }
+    }
+
+    // the shards of the same package names are fetched for the sharded subdirs
+    std::vector<ShardedRepodata*> sharded;
+    std::set<std::string> shard_names;
+    for (auto& subdir : subdirs)
+    {
+        if (subdir->loaded() && subdir->sharded())
+        {
+            sharded.push_back(&subdir->shards());
+        }
+    }
+    if (!sharded.empty())
+    {
+        shard_names = ShardedRepodata::fetch(sharded, roots);
+        LOG_INFO << "Loading the shards of " << shard_names.size() << " package names";
+    }
+
+    // with a pool snapshot, the channel repos are read from a single file
+    // as long as the repodata of the subdirs did not change
+    std::unique_ptr<PoolSnapshot> snapshot;
+    if (ctx.pool_snapshot && !sparse && sharded.empty() && !ctx.offline)
+    {
+        snapshot = std::make_unique<PoolSnapshot>(cache_dir);
+        for (std::size_t i = 0; i < subdirs.size(); ++i)
+        {
+            if (subdirs[i]->loaded())
+            {
+                snapshot->add_repo(subdirs[i]->repo_metadata(),
+                                   subdirs[i]->repo_state(),
+                                   priorities[i].first,
+                                   priorities[i].second);
+            }
+        }
+    }
+    std::size_t channel_repos_begin = repos.size();
+    bool from_snapshot = snapshot && snapshot->load(pool, repos);
 
     std::string prev_channel;
     bool loading_failed = false;
-    for (std::size_t i = 0; i < subdirs.size(); ++i)
+    for (std::size_t i = 0; !from_snapshot && i < subdirs.size(); ++i)
     {
         auto& subdir = subdirs[i];
         if (!subdir->loaded())
@@ -539,7 +692,9 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
         auto& prio = priorities[i];
         try
         {
-            MRepo repo = subdir->create_repo(pool);
+            MRepo repo = subdir->sharded() ? subdir->create_repo(pool, shard_names)
+                         : sparse          ? subdir->create_repo(pool, sparse_names)
+                                           : subdir->create_repo(pool);
             repo.set_priority(prio.first, prio.second);
             repos.push_back(repo);
         }
@@ -570,13 +725,59 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
         throw std::runtime_error("Could not load repodata. Cache corrupted?");
     }
 
-    MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
-    solver.add_jobs(create_options.specs, SOLVER_INSTALL);
+    if (snapshot && !from_snapshot)
+    {
+        std::vector<MRepo*> channel_repos;
+        for (std::size_t i = channel_repos_begin; i < repos.size(); ++i)
+        {
+            channel_repos.push_back(&repos[i]);
+        }
+        snapshot->save(pool, channel_repos);
+    }
 
-    bool success = solver.solve();
+    if (ctx.strict_channel_priority)
+    {
+        // the candidates of lower priority channels never win, they are left
+        // out of the solve; specs asking for a channel keep them
+        std::set<std::string> channel_specific;
+        for (auto& spec : specs)
+        {
+            MatchSpec ms(spec);
+            if (!ms.channel.empty())
+            {
+                channel_specific.insert(ms.name);
+            }
+        }
+        pool.prune_lower_priority(channel_specific);
+    }
+
+    // subdirs loaded from an expired cache are refreshed while solving
+    SubdirRevalidation revalidation(subdirs);
+
+    auto solver = std::make_unique<MSolver>(pool,
+                                            std::vector<std::pair<int, int>>{
+                                                { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+    solver->set_solution_cache(cache_dir);
+    solver->freeze_installed = create_options.freeze_installed;
+    solver->set_portfolio(ctx.solver_portfolio);
+    solver->add_jobs(create_options.specs, SOLVER_INSTALL);
+
+    bool success = solver->solve();
+    revalidation.finish();
+    if (!success && use_current)
+    {
+        LOG_INFO << "Could not solve with current_repodata.json, using the full repodata";
+        return install_specs(specs, create_env, is_retry | RETRY_FULL_REPODATA);
+    }
+    bool retry_stale = !(is_retry & RETRY_STALE_REPODATA);
+    if (!success && retry_stale && revalidation.outdated_solution(false, {}))
+    {
+        LOG_INFO << "Refreshed repodata changed, solving again";
+        return install_specs(specs, create_env, is_retry | RETRY_STALE_REPODATA);
+    }
     if (!success)
     {
-        std::cout << "\n" << solver.problems_to_str() << std::endl;
+        std::cout << "\n" << solver->problems_to_str() << std::endl;
         if (network_options.retry_clean_cache && !(is_retry & RETRY_SOLVE_ERROR))
         {
             ctx.local_repodata_ttl = 2;
@@ -586,7 +787,27 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
     }
 
     mamba::MultiPackageCache package_caches({ pkgs_dirs });
-    mamba::MTransaction trans(solver, package_caches);
+    mamba::MTransaction trans(*solver, package_caches);
+
+    // the solution is only redone if it uses records that changed
+    if (retry_stale)
+    {
+        std::vector<std::pair<std::string, std::string>> installed;
+        for (auto& [channel, fn, json] : std::get<1>(trans.to_conda()))
+        {
+            installed.emplace_back(channel, fn);
+        }
+        if (revalidation.outdated_solution(true, installed))
+        {
+            LOG_INFO << "Solving again with the refreshed repodata";
+            return install_specs(specs, create_env, is_retry | RETRY_STALE_REPODATA);
+        }
+    }
+
+    // the transaction does not need the solver and the pool anymore, the
+    // repos are only used as handles
+    solver.reset();
+    pool_ptr.reset();
 
     if (ctx.json)
     {
@@ -600,7 +821,7 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
     }
 
     std::cout << std::endl;
-    bool yes = trans.prompt(pkgs_dirs, repo_ptrs);
+    bool yes = trans.prompt();
     if (!yes)
         exit(0);
 
@@ -610,7 +831,7 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false, in
         fs::create_directories(ctx.target_prefix / "pkgs");
     }
 
-    trans.execute(prefix_data, pkgs_dirs);
+    trans.execute(prefix_data, pkgs_dirs, repo_ptrs);
 }
 
 bool
@@ -631,9 +852,7 @@ remove_specs(const std::vector<std::string>& specs)
     std::vector<MRepo> repos;
     MPool pool;
     PrefixData prefix_data(ctx.target_prefix);
-    prefix_data.load();
-    auto repo = MRepo(pool, prefix_data);
-    repos.push_back(repo);
+    repos.push_back(MRepo::from_conda_meta(pool, ctx.target_prefix));
 
     MSolver solver(pool,
                    { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 }, { SOLVER_FLAG_ALLOW_UNINSTALL, 1 } });
@@ -655,11 +874,11 @@ remove_specs(const std::vector<std::string>& specs)
     }
 
     std::cout << std::endl;
-    bool yes = trans.prompt(ctx.root_prefix / "pkgs", repo_ptrs);
+    bool yes = trans.prompt();
     if (!yes)
         exit(0);
 
-    trans.execute(prefix_data, ctx.root_prefix / "pkgs");
+    trans.execute(prefix_data, ctx.root_prefix / "pkgs", repo_ptrs);
 
     return true;
 }
@@ -763,6 +982,13 @@ init_install_parser(CLI::App* subcom)
     subcom->add_option("-f,--file", create_options.files, "File (yaml, explicit or plain)")
         ->type_size(1)
         ->allow_extra_args(false);
+    subcom->add_flag("--sync",
+                     create_options.sync,
+                     "Make the prefix match the explicit spec file exactly, without solving\n"
+                     "(packages not listed in the file are removed)");
+    subcom->add_flag("--freeze-installed",
+                     create_options.freeze_installed,
+                     "Do not update the installed packages the specs do not depend on");
 
     init_network_parser(subcom);
     init_channel_parser(subcom);
@@ -773,6 +999,12 @@ init_install_parser(CLI::App* subcom)
         set_global_options(ctx);
         set_network_options(ctx);
         ctx.strict_channel_priority = create_options.strict_channel_priority;
+        ctx.solver_portfolio = create_options.solver_portfolio;
+        ctx.sparse_repodata = create_options.sparse_repodata;
+        ctx.pool_snapshot = create_options.pool_snapshot;
+        ctx.stale_while_revalidate = create_options.stale_while_revalidate;
+        ctx.current_repodata = create_options.current_repodata;
+        ctx.sharded_repodata = create_options.sharded_repodata;
 
         if (!create_options.name.empty() && !create_options.prefix.empty())
         {
@@ -921,6 +1153,37 @@ install_explicit_specs(std::vector<std::string>& specs)
     }
 }
 
+void
+sync_explicit_specs(const std::vector<std::string>& specs)
+{
+    auto& ctx = Context::instance();
+    fs::path pkgs_dir = ctx.root_prefix / "pkgs";
+
+    PrefixData prefix_data(ctx.target_prefix);
+    prefix_data.load();
+    auto [to_remove, to_install]
+        = diff_prefix_packages(prefix_data, explicit_specs_to_packages(specs));
+
+    MPool pool;
+    MRepo installed_repo(pool, prefix_data);
+    MultiPackageCache package_caches({ pkgs_dir });
+    MTransaction trans(pool, to_remove, to_install, package_caches);
+
+    if (ctx.json)
+    {
+        trans.log_json();
+    }
+    std::vector<MRepo*> repo_ptrs = { &installed_repo };
+    bool yes = trans.prompt();
+    if (!yes)
+        exit(0);
+
+    if (!ctx.dry_run)
+    {
+        fs::create_directories(ctx.target_prefix / "conda-meta");
+    }
+    trans.execute(prefix_data, pkgs_dir, repo_ptrs);
+}
 
 void
 set_target_prefix()
@@ -1071,9 +1334,17 @@ parse_file_options()
                         }
                     }
 
-                    std::cout << "Installing explicit specs for platform " << platform << std::endl;
                     std::vector<std::string> explicit_specs(file_contents.begin() + i + 1,
                                                             file_contents.end());
+                    if (create_options.sync)
+                    {
+                        std::cout << "Syncing explicit specs for platform " << platform
+                                  << std::endl;
+                        sync_explicit_specs(explicit_specs);
+                        exit(0);
+                    }
+
+                    std::cout << "Installing explicit specs for platform " << platform << std::endl;
                     set_target_prefix();
                     install_explicit_specs(explicit_specs);
                     exit(0);
@@ -1093,6 +1364,13 @@ parse_file_options()
             }
         }
     }
+
+    // an explicit file exits above, anything else would be solved as usual
+    if (create_options.sync)
+    {
+        throw std::runtime_error(
+            "--sync requires an explicit spec file (-f) with an @EXPLICIT line");
+    }
 }
 
 
@@ -1118,6 +1396,12 @@ init_create_parser(CLI::App* subcom)
         set_global_options(ctx);
         set_network_options(ctx);
         ctx.strict_channel_priority = create_options.strict_channel_priority;
+        ctx.solver_portfolio = create_options.solver_portfolio;
+        ctx.sparse_repodata = create_options.sparse_repodata;
+        ctx.pool_snapshot = create_options.pool_snapshot;
+        ctx.stale_while_revalidate = create_options.stale_while_revalidate;
+        ctx.current_repodata = create_options.current_repodata;
+        ctx.sharded_repodata = create_options.sharded_repodata;
 
         // file options have to be parsed _before_ the following checks
         // to fill in name and prefix
@@ -8,6 +8,8 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <array>
+#include <fstream>
 #include <sstream>
 
 #include "nlohmann/json.hpp"
@@ -119,30 +121,22 @@ namespace mamba
 
         archive_write_open_filename(a, abs_out_path.c_str());
 
-        auto prev_path = fs::current_path();
         if (!fs::exists(directory))
         {
             throw std::runtime_error("Directory does not exist.");
         }
-        fs::current_path(directory);
 
-        for (auto& dir_entry : fs::recursive_directory_iterator("."))
+        // the files are read from their full path and stored relative to the
+        // directory, the current directory is shared by every thread
+        for (auto& dir_entry : fs::recursive_directory_iterator(directory))
         {
             if (dir_entry.is_directory())
             {
                 continue;
             }
 
-            std::string p = dir_entry.path().string();
-            // do this in a better way?
-            if (p[0] == '.')
-            {
-                p = p.substr(1);
-            }
-            if (p[0] == '/')
-            {
-                p = p.substr(1);
-            }
+            std::string full_path = dir_entry.path().string();
+            std::string p = dir_entry.path().lexically_relative(directory).generic_string();
             if (filter && filter(p))
             {
                 continue;
@@ -162,7 +156,7 @@ namespace mamba
             {
                 throw std::runtime_error(concat("libarchive error: ", archive_error_string(disk)));
             }
-            if (archive_read_disk_open(disk, p.c_str()) < ARCHIVE_OK)
+            if (archive_read_disk_open(disk, full_path.c_str()) < ARCHIVE_OK)
             {
                 throw std::runtime_error(concat("libarchive error: ", archive_error_string(disk)));
             }
@@ -170,6 +164,7 @@ namespace mamba
             {
                 throw std::runtime_error(concat("libarchive error: ", archive_error_string(disk)));
             }
+            archive_entry_set_pathname(entry, p.c_str());
             if (archive_read_disk_descend(disk) < ARCHIVE_OK)
             {
                 throw std::runtime_error(concat("libarchive error: ", archive_error_string(disk)));
@@ -180,10 +175,10 @@ namespace mamba
             }
 
 
-            if (!fs::is_symlink(p))
+            if (!fs::is_symlink(dir_entry.path()))
             {
                 std::array<char, 8192> buffer;
-                std::ifstream fin(p, std::ios::in | std::ios::binary);
+                std::ifstream fin(dir_entry.path(), std::ios::in | std::ios::binary);
                 while (!fin.eof() && !is_sig_interrupted())
                 {
                     fin.read(buffer.data(), buffer.size());
@@ -209,7 +204,6 @@ namespace mamba
 
         archive_write_close(a);  // Note 4
         archive_write_free(a);   // Note 5
-        fs::current_path(prev_path);
     }
 
     // note the info folder must have already been created!
@@ -253,12 +247,22 @@ namespace mamba
         LOG_INFO << "Extracting " << file << " to " << destination;
         extraction_guard g(destination);
 
-        auto prev_path = fs::current_path();
         if (!fs::exists(destination))
         {
             fs::create_directories(destination);
         }
-        fs::current_path(destination);
+        // the entries are extracted below the destination instead of the
+        // current directory, which is shared by every thread. Without symlinks
+        // in it, ARCHIVE_EXTRACT_SECURE_SYMLINKS only checks the entries.
+        fs::path abs_destination = fs::canonical(destination);
+        auto destination_path = [&](const char* entry_path) {
+            fs::path rel_path(entry_path);
+            if (rel_path.is_absolute())
+            {
+                throw std::runtime_error(concat(file.string(), ": absolute path in archive"));
+            }
+            return (abs_destination / rel_path).string();
+        };
 
         struct archive* a;
         struct archive* ext;
@@ -271,7 +275,7 @@ namespace mamba
         flags |= ARCHIVE_EXTRACT_PERM;
         flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
         flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
-        flags |= ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS;
+        // the absolute paths of the archive are rejected by destination_path
         flags |= ARCHIVE_EXTRACT_SPARSE;
         flags |= ARCHIVE_EXTRACT_UNLINK;
 
@@ -306,6 +310,13 @@ namespace mamba
                 throw std::runtime_error(archive_error_string(a));
             }
 
+            archive_entry_set_pathname(entry,
+                                       destination_path(archive_entry_pathname(entry)).c_str());
+            if (const char* hardlink = archive_entry_hardlink(entry))
+            {
+                archive_entry_set_hardlink(entry, destination_path(hardlink).c_str());
+            }
+
             r = archive_write_header(ext, entry);
             if (r < ARCHIVE_OK)
             {
@@ -342,8 +353,6 @@ namespace mamba
         archive_read_free(a);
         archive_write_close(ext);
         archive_write_free(ext);
-
-        fs::current_path(prev_path);
     }
 
     void extract_conda(const fs::path& file,
@@ -470,4 +479,142 @@ namespace mamba
         }
         return true;
     }
+
+    bool is_zstd_file(const fs::path& file)
+    {
+        static const std::array<unsigned char, 4> zstd_magic = { 0x28, 0xB5, 0x2F, 0xFD };
+        std::array<unsigned char, 4> magic = {};
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        in.read(reinterpret_cast<char*>(magic.data()), magic.size());
+        return in && magic == zstd_magic;
+    }
+
+    void compress_zstd_file(const fs::path& file, const fs::path& destination, int compression_level)
+    {
+        struct archive* a = archive_write_new();
+        archive_write_add_filter_zstd(a);
+        archive_write_set_format_raw(a);
+        // no padding after the zstd frame
+        archive_write_set_bytes_in_last_block(a, 1);
+        std::string comp_level
+            = std::string("zstd:compression-level=") + std::to_string(compression_level);
+        archive_write_set_options(a, comp_level.c_str());
+
+        auto fail = [&]() {
+            std::string msg = concat("libarchive error: ", check_char(archive_error_string(a)));
+            archive_write_free(a);
+            throw std::runtime_error(msg);
+        };
+
+        if (archive_write_open_filename(a, destination.string().c_str()) < ARCHIVE_OK)
+        {
+            fail();
+        }
+
+        struct archive_entry* entry = archive_entry_new();
+        archive_entry_set_pathname(entry, file.filename().string().c_str());
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_size(entry, fs::file_size(file));
+        int r = archive_write_header(a, entry);
+        archive_entry_free(entry);
+        if (r < ARCHIVE_OK)
+        {
+            fail();
+        }
+
+        std::array<char, 1 << 16> buffer;
+        std::ifstream fin(file, std::ios::in | std::ios::binary);
+        while (fin)
+        {
+            fin.read(buffer.data(), buffer.size());
+            std::streamsize len = fin.gcount();
+            if (len > 0 && archive_write_data(a, buffer.data(), len) < 0)
+            {
+                fail();
+            }
+        }
+        if (archive_write_close(a) < ARCHIVE_OK)
+        {
+            fail();
+        }
+        archive_write_free(a);
+    }
+
+    namespace
+    {
+#if defined(__GLIBC__)
+        ssize_t archive_cookie_read(void* cookie, char* buf, size_t size)
+        {
+            la_ssize_t n = archive_read_data(static_cast<struct archive*>(cookie), buf, size);
+            return n < 0 ? -1 : n;
+        }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+        int archive_cookie_read(void* cookie, char* buf, int size)
+        {
+            la_ssize_t n = archive_read_data(static_cast<struct archive*>(cookie), buf, size);
+            return n < 0 ? -1 : static_cast<int>(n);
+        }
+#endif
+
+        int archive_cookie_close(void* cookie)
+        {
+            archive_read_free(static_cast<struct archive*>(cookie));
+            return 0;
+        }
+    }  // namespace
+
+    FILE* open_decompressed(const fs::path& file)
+    {
+        if (!is_zstd_file(file))
+        {
+            return fopen(file.string().c_str(), "rb");
+        }
+
+        struct archive* a = archive_read_new();
+        archive_read_support_filter_zstd(a);
+        archive_read_support_format_raw(a);
+        struct archive_entry* entry;
+        if (archive_read_open_filename(a, file.string().c_str(), 1 << 16) != ARCHIVE_OK
+            || archive_read_next_header(a, &entry) != ARCHIVE_OK)
+        {
+            LOG_WARNING << "Could not open " << file << ": " << check_char(archive_error_string(a));
+            archive_read_free(a);
+            return nullptr;
+        }
+
+#if defined(__GLIBC__)
+        cookie_io_functions_t io = { &archive_cookie_read, nullptr, nullptr, &archive_cookie_close };
+        FILE* fp = fopencookie(a, "r", io);
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+        FILE* fp = funopen(a, &archive_cookie_read, nullptr, nullptr, &archive_cookie_close);
+#else
+        // no custom streams, decompress to a temporary file
+        FILE* fp = std::tmpfile();
+        if (fp)
+        {
+            std::array<char, 1 << 16> buffer;
+            la_ssize_t n;
+            while ((n = archive_read_data(a, buffer.data(), buffer.size())) > 0)
+            {
+                fwrite(buffer.data(), 1, n, fp);
+            }
+            if (n < 0)
+            {
+                fclose(fp);
+                fp = nullptr;
+            }
+            else
+            {
+                rewind(fp);
+            }
+        }
+        archive_cookie_close(a);
+        return fp;
+#endif
+        if (!fp)
+        {
+            archive_cookie_close(a);
+        }
+        return fp;
+    }
 }  // namespace mamba
@@ -128,7 +128,7 @@ namespace mamba
         str = check_char(solvable_lookup_str(s, SOLVABLE_LICENSE));
         if (str)
             license = str;
-        size = solvable_lookup_num(s, SOLVABLE_DOWNLOADSIZE, -1);
+        size = solvable_lookup_num(s, SOLVABLE_DOWNLOADSIZE, 0);
         timestamp = solvable_lookup_num(s, SOLVABLE_BUILDTIME, 0) * 1000;
         str = solvable_lookup_checksum(s, SOLVABLE_PKGID, &check_type);
         if (str)
@@ -4,6 +4,9 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <map>
 #include <set>
 #include <string>
@@ -71,83 +74,543 @@ namespace mamba
         return result;
     }
 
-    std::vector<PathData> read_paths(const fs::path& directory)
+    namespace
     {
-        auto info_dir = directory / "info";
-        auto paths_json_path = info_dir / "paths.json";
+        /*
+         * SAX handler collecting the entries of the "paths" array found at
+         * `paths_location` (e.g. "/paths" in paths.json), the top-level
+         * "files" and "paths_version". Everything else is skipped.
+         */
+        class PathsJsonHandler
+        {
+        public:
+            using json = nlohmann::json;
+
+            explicit PathsJsonHandler(const std::string& paths_location)
+                : m_entry_location(paths_location + "/[]")
+            {
+            }
 
-        auto parse_file_mode = [](nlohmann::json& j) -> FileMode {
-            if (j.find("file_mode") != j.end())
+            bool null()
             {
-                // check if "text" or "binary"
-                if (j["file_mode"].get<std::string>()[0] == 't')
+                return true;
+            }
+
+            bool boolean(bool val)
+            {
+                if (in_entry() && m_key == "no_link")
                 {
-                    return FileMode::TEXT;
+                    m_current.no_link = val;
                 }
-                else if (j["file_mode"].get<std::string>()[0] == 'b')
+                return true;
+            }
+
+            bool number_integer(json::number_integer_t val)
+            {
+                return number(static_cast<std::size_t>(val));
+            }
+
+            bool number_unsigned(json::number_unsigned_t val)
+            {
+                return number(static_cast<std::size_t>(val));
+            }
+
+            bool number_float(json::number_float_t, const json::string_t&)
+            {
+                return true;
+            }
+
+            bool string(json::string_t& val)
+            {
+                if (in_entry())
                 {
-                    return FileMode::BINARY;
+                    if (m_key == "_path")
+                        m_current.path = std::move(val);
+                    else if (m_key == "path_type")
+                        m_current.path_type = path_type_from_string(val);
+                    else if (m_key == "sha256")
+                        m_current.sha256 = std::move(val);
+                    else if (m_key == "sha256_in_prefix")
+                        m_current.sha256_in_prefix = std::move(val);
+                    else if (m_key == "prefix_placeholder")
+                        m_current.prefix_placeholder = std::move(val);
+                    else if (m_key == "file_mode" && !val.empty())
+                        m_current.file_mode = val[0] == 't'   ? FileMode::TEXT
+                                              : val[0] == 'b' ? FileMode::BINARY
+                                                              : FileMode::UNDEFINED;
                 }
+                else if (m_location == "/files")
+                {
+                    files.push_back(std::move(val));
+                }
+                return true;
             }
-            return FileMode::UNDEFINED;
-        };
 
-        auto parse_path_type = [](nlohmann::json& j) -> PathType {
-            if (j.find("path_type") != j.end())
+            template <class B>
+            bool binary(B&)
             {
-                // TODO find a DIRECTORY path type
-                // check if "text" or "binary"
-                if (j["path_type"].get<std::string>()[0] == 's')
+                return true;
+            }
+
+            bool start_object(std::size_t)
+            {
+                enter(false);
+                if (in_entry())
                 {
-                    return PathType::SOFTLINK;
+                    m_current = PathData();
+                    m_current.file_mode = FileMode::UNDEFINED;
                 }
-                else if (j["path_type"].get<std::string>()[0] == 'h')
+                return true;
+            }
+
+            bool key(json::string_t& val)
+            {
+                m_key = val;
+                return true;
+            }
+
+            bool end_object()
+            {
+                if (in_entry())
                 {
-                    return PathType::HARDLINK;
+                    paths.push_back(std::move(m_current));
                 }
+                leave();
+                return true;
+            }
+
+            bool start_array(std::size_t)
+            {
+                enter(true);
+                return true;
             }
-            return PathType::UNDEFINED;
+
+            bool end_array()
+            {
+                leave();
+                return true;
+            }
+
+            bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex)
+            {
+                error = ex.what();
+                return false;
+            }
+
+            std::vector<PathData> paths;
+            std::vector<std::string> files;
+            std::size_t paths_version = 0;
+            std::string error;
+
+        private:
+            bool number(std::size_t val)
+            {
+                if (in_entry() && m_key == "size_in_bytes")
+                {
+                    m_current.size_in_bytes = val;
+                }
+                else if (m_location.empty() && m_key == "paths_version")
+                {
+                    paths_version = val;
+                }
+                return true;
+            }
+
+            bool in_entry() const
+            {
+                return !m_is_array.empty() && !m_is_array.back() && m_location == m_entry_location;
+            }
+
+            void enter(bool is_array)
+            {
+                m_lengths.push_back(m_location.size());
+                if (!m_is_array.empty())
+                {
+                    m_location += '/';
+                    m_location += m_is_array.back() ? "[]" : m_key;
+                }
+                m_is_array.push_back(is_array);
+            }
+
+            void leave()
+            {
+                m_location.resize(m_lengths.back());
+                m_lengths.pop_back();
+                m_is_array.pop_back();
+            }
+
+            std::string m_entry_location;
+            std::string m_location;
+            std::string m_key;
+            std::vector<std::size_t> m_lengths;
+            std::vector<bool> m_is_array;
+            PathData m_current;
         };
 
-        std::vector<PathData> res;
-        if (fs::exists(paths_json_path))
+        /*
+         * Reads the top-level fields of a conda-meta record. The values of
+         * "files" and "paths_data" are skipped over without being parsed, and
+         * records written by mamba have them last: the file is read up to
+         * there once the name, version and build are known.
+         */
+        class RecordHeaderReader
         {
-            nlohmann::json paths_json;
-            std::ifstream paths_file(paths_json_path);
-            paths_file >> paths_json;
-            if (paths_json["paths_version"] != 1)
+        public:
+            explicit RecordHeaderReader(const fs::path& path)
+                : m_path(path)
+                , m_in(path, std::ios::in | std::ios::binary)
             {
-                throw std::runtime_error("Package version (paths.json file) too new for mamba.");
+                if (!m_in)
+                {
+                    throw std::runtime_error("Could not open " + path.string());
+                }
             }
-            for (auto& jpath : paths_json["paths"])
-            {
-                PathData p;
-                p.path = jpath["_path"];
-                p.size_in_bytes = jpath["size_in_bytes"];
 
-                // tentative data
-                p.file_mode = parse_file_mode(jpath);
-                p.path_type = parse_path_type(jpath);
+            nlohmann::json read()
+            {
+                nlohmann::json header = nlohmann::json::object();
+                expect('{');
+                if (peek_token() == '}')
+                {
+                    return header;
+                }
+                while (true)
+                {
+                    expect('"');
+                    std::size_t begin = m_pos - 1;
+                    skip_string();
+                    std::string key = parse_value(begin).get<std::string>();
+                    expect(':');
+                    peek_token();
+                    bool skipped = key == "files" || key == "paths_data";
+                    if (skipped && header.contains("name") && header.contains("version")
+                        && header.contains("build"))
+                    {
+                        return header;
+                    }
+                    begin = m_pos;
+                    skip_value();
+                    if (!skipped)
+                    {
+                        header[key] = parse_value(begin);
+                    }
+                    char c = peek_token();
+                    ++m_pos;
+                    if (c == '}')
+                    {
+                        return header;
+                    }
+                    if (c != ',')
+                    {
+                        error();
+                    }
+                }
+            }
 
-                if (p.path_type != PathType::SOFTLINK)
+        private:
+            // the value from `begin` to the current position, the strings
+            // without escapes are taken as they are
+            nlohmann::json parse_value(std::size_t begin)
+            {
+                auto first = m_buf.begin() + begin, last = m_buf.begin() + m_pos;
+                if (*first == '"' && std::find(first, last, '\\') == last)
                 {
-                    assign_or(jpath, "sha256", p.sha256, std::string(""));
+                    return m_buf.substr(begin + 1, m_pos - begin - 2);
                 }
+                return nlohmann::json::parse(first, last);
+            }
+
+            // reads more of the file, false at its end
+            bool fill()
+            {
+                char chunk[65536];
+                m_in.read(chunk, sizeof(chunk));
+                m_buf.append(chunk, m_in.gcount());
+                return m_in.gcount() > 0;
+            }
 
-                if (jpath.find("no_link") != jpath.end())
+            char peek()
+            {
+                while (m_pos >= m_buf.size())
                 {
-                    if (jpath["no_link"] == true)
+                    if (!fill())
                     {
-                        p.no_link = true;
+                        error();
                     }
                 }
+                return m_buf[m_pos];
+            }
+
+            char peek_token()
+            {
+                while (std::isspace(static_cast<unsigned char>(peek())))
+                {
+                    ++m_pos;
+                }
+                return m_buf[m_pos];
+            }
 
-                if (jpath.find("prefix_placeholder") != jpath.end())
+            void expect(char c)
+            {
+                if (peek_token() != c)
                 {
-                    p.prefix_placeholder = jpath["prefix_placeholder"];
+                    error();
                 }
+                ++m_pos;
+            }
 
-                res.push_back(std::move(p));
+            // after the opening quote, up to after the closing one
+            void skip_string()
+            {
+                while (true)
+                {
+                    std::size_t end = m_buf.find_first_of("\\\"", m_pos);
+                    if (end == std::string::npos)
+                    {
+                        m_pos = m_buf.size();
+                        peek();
+                        continue;
+                    }
+                    m_pos = end + 1;
+                    if (m_buf[end] == '"')
+                    {
+                        return;
+                    }
+                    // the escaped character
+                    peek();
+                    ++m_pos;
+                }
+            }
+
+            void skip_value()
+            {
+                std::size_t depth = 0;
+                do
+                {
+                    char c = peek();
+                    ++m_pos;
+                    if (c == '"')
+                    {
+                        skip_string();
+                    }
+                    else if (c == '{' || c == '[')
+                    {
+                        ++depth;
+                    }
+                    else if (c == '}' || c == ']')
+                    {
+                        if (depth == 0)
+                        {
+                            error();
+                        }
+                        --depth;
+                    }
+                    else if (depth == 0)
+                    {
+                        // a number or a literal
+                        while (m_pos < m_buf.size() || fill())
+                        {
+                            char next = m_buf[m_pos];
+                            if (next == ',' || next == '}' || next == ']'
+                                || std::isspace(static_cast<unsigned char>(next)))
+                            {
+                                break;
+                            }
+                            ++m_pos;
+                        }
+                    }
+                } while (depth > 0);
+            }
+
+            [[noreturn]] void error()
+            {
+                throw std::runtime_error("Could not parse " + m_path.string());
+            }
+
+            fs::path m_path;
+            std::ifstream m_in;
+            std::string m_buf;
+            std::size_t m_pos = 0;
+        };
+
+        void parse_paths_json(const fs::path& path, PathsJsonHandler& handler)
+        {
+            std::ifstream in(path, std::ios::in | std::ios::binary);
+            if (!in)
+            {
+                throw std::runtime_error("Could not open " + path.string());
+            }
+            if (!nlohmann::json::sax_parse(in, &handler))
+            {
+                throw std::runtime_error("Could not parse " + path.string() + ": "
+                                         + handler.error);
+            }
+        }
+
+        void write_json_string(std::ostream& out, const std::string& str)
+        {
+            out << nlohmann::json(str).dump();
+        }
+    }  // namespace
+
+    PathType path_type_from_string(const std::string& str)
+    {
+        if (str == "hardlink")
+            return PathType::HARDLINK;
+        if (str == "softlink")
+            return PathType::SOFTLINK;
+        if (str == "directory")
+            return PathType::DIRECTORY;
+        if (str == "linked_package_record")
+            return PathType::LINKED_PACKAGE_RECORD;
+        if (str == "pyc_file")
+            return PathType::PYC_FILE;
+        if (str == "unix_python_entry_point")
+            return PathType::UNIX_PYTHON_ENTRY_POINT;
+        if (str == "windows_python_entry_point_script")
+            return PathType::WINDOWS_PYTHON_ENTRY_POINT_SCRIPT;
+        if (str == "windows_python_entry_point_exe")
+            return PathType::WINDOWS_PYTHON_ENTRY_POINT_EXE;
+        return PathType::UNDEFINED;
+    }
+
+    std::string path_type_to_string(PathType type)
+    {
+        switch (type)
+        {
+            case PathType::HARDLINK:
+                return "hardlink";
+            case PathType::SOFTLINK:
+                return "softlink";
+            case PathType::DIRECTORY:
+                return "directory";
+            case PathType::LINKED_PACKAGE_RECORD:
+                return "linked_package_record";
+            case PathType::PYC_FILE:
+                return "pyc_file";
+            case PathType::UNIX_PYTHON_ENTRY_POINT:
+                return "unix_python_entry_point";
+            case PathType::WINDOWS_PYTHON_ENTRY_POINT_SCRIPT:
+                return "windows_python_entry_point_script";
+            case PathType::WINDOWS_PYTHON_ENTRY_POINT_EXE:
+                return "windows_python_entry_point_exe";
+            default:
+                return "";
+        }
+    }
+
+    std::vector<PathData> read_prefix_record_paths(const fs::path& record_path)
+    {
+        PathsJsonHandler handler("/paths_data/paths");
+        parse_paths_json(record_path, handler);
+        if (handler.paths.empty())
+        {
+            for (auto& f : handler.files)
+            {
+                PathData p;
+                p.path = std::move(f);
+                handler.paths.push_back(std::move(p));
+            }
+        }
+        return std::move(handler.paths);
+    }
+
+    nlohmann::json read_prefix_record_header(const fs::path& record_path)
+    {
+        try
+        {
+            return RecordHeaderReader(record_path).read();
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            throw std::runtime_error("Could not parse " + record_path.string() + ": " + e.what());
+        }
+    }
+
+    void write_prefix_record(std::ostream& out,
+                             const nlohmann::json& record,
+                             const std::vector<PathData>& paths)
+    {
+        out << "{\n";
+        for (auto it = record.begin(); it != record.end(); ++it)
+        {
+            if (it.key() == "files" || it.key() == "paths_data")
+            {
+                continue;
+            }
+            out << "    ";
+            write_json_string(out, it.key());
+            out << ": " << it.value().dump() << ",\n";
+        }
+
+        out << "    \"files\": [";
+        for (std::size_t i = 0; i < paths.size(); ++i)
+        {
+            out << (i ? ",\n        " : "\n        ");
+            write_json_string(out, paths[i].path);
+        }
+        out << "\n    ],\n";
+
+        out << "    \"paths_data\": {\n        \"paths\": [";
+        for (std::size_t i = 0; i < paths.size(); ++i)
+        {
+            const PathData& p = paths[i];
+            out << (i ? ",\n            " : "\n            ");
+            out << "{\"_path\": ";
+            write_json_string(out, p.path);
+            if (p.no_link)
+            {
+                out << ", \"no_link\": true";
+            }
+            if (p.path_type != PathType::UNDEFINED)
+            {
+                out << ", \"path_type\": \"" << path_type_to_string(p.path_type) << '"';
+            }
+            if (!p.prefix_placeholder.empty())
+            {
+                out << ", \"prefix_placeholder\": ";
+                write_json_string(out, p.prefix_placeholder);
+                out << ", \"file_mode\": \""
+                    << (p.file_mode == FileMode::BINARY ? "binary" : "text") << '"';
+            }
+            if (!p.sha256.empty())
+            {
+                out << ", \"sha256\": \"" << p.sha256 << '"';
+            }
+            if (!p.sha256_in_prefix.empty())
+            {
+                out << ", \"sha256_in_prefix\": \"" << p.sha256_in_prefix << '"';
+            }
+            if (p.size_in_bytes != 0)
+            {
+                out << ", \"size_in_bytes\": " << p.size_in_bytes;
+            }
+            out << "}";
+        }
+        out << "\n        ],\n        \"paths_version\": 1\n    }\n}\n";
+    }
+
+    std::vector<PathData> read_paths(const fs::path& directory)
+    {
+        auto info_dir = directory / "info";
+        auto paths_json_path = info_dir / "paths.json";
+
+        std::vector<PathData> res;
+        if (fs::exists(paths_json_path))
+        {
+            PathsJsonHandler handler("/paths");
+            parse_paths_json(paths_json_path, handler);
+            if (handler.paths_version != 1)
+            {
+                throw std::runtime_error("Package version (paths.json file) too new for mamba.");
+            }
+            res = std::move(handler.paths);
+            for (auto& p : res)
+            {
+                if (p.path_type == PathType::SOFTLINK)
+                {
+                    p.sha256.clear();
+                }
             }
         }
         else
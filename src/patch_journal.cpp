@@ -0,0 +1,151 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include "mamba/output.hpp"
+#include "mamba/patch_journal.hpp"
+#include "mamba/util.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        const std::string journal_suffix = ".patches.jsonl";
+
+        // records a path of a patch operation, e.g. /packages/<fn>/depends/0;
+        // false for the parts of the repodata that are not records
+        bool add_record_fn(const std::string& path, std::set<std::string>& fns)
+        {
+            auto tokens = split(path, "/", 3);
+            if (tokens.size() < 2 || !tokens[0].empty())
+            {
+                return false;
+            }
+            if (tokens[1] == "removed")
+            {
+                return true;
+            }
+            if ((tokens[1] != "packages" && tokens[1] != "packages.conda") || tokens.size() < 3)
+            {
+                return false;
+            }
+            // JSON pointer escapes
+            std::string fn = tokens[2];
+            replace_all(fn, "~1", "/");
+            replace_all(fn, "~0", "~");
+            fns.insert(fn);
+            return true;
+        }
+    }  // namespace
+
+    PatchJournal::PatchJournal(const fs::path& journal_file, const std::string& from)
+    {
+        std::ifstream in(journal_file);
+        std::map<std::string, nlohmann::json> by_from;
+        std::string line;
+        try
+        {
+            while (std::getline(in, line))
+            {
+                if (strip(line).empty())
+                {
+                    continue;
+                }
+                auto entry = nlohmann::json::parse(line);
+                if (entry.contains("latest"))
+                {
+                    m_latest = entry["latest"].get<std::string>();
+                }
+                else
+                {
+                    m_latest = entry.at("to").get<std::string>();
+                    std::string from_hash = entry.at("from").get<std::string>();
+                    by_from[from_hash] = std::move(entry);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Invalid patch journal " << journal_file << ": " << e.what();
+            return;
+        }
+
+        if (from.empty() || m_latest.empty())
+        {
+            return;
+        }
+        std::string current = from;
+        while (current != m_latest)
+        {
+            auto it = by_from.find(current);
+            // every step is used once at most, the journal could loop
+            if (it == by_from.end() || m_patches.size() == by_from.size())
+            {
+                LOG_INFO << "Patch journal " << journal_file << " does not apply to " << from;
+                m_patches.clear();
+                return;
+            }
+            m_patches.push_back(it->second["patch"]);
+            current = it->second["to"].get<std::string>();
+        }
+        m_applies = true;
+    }
+
+    std::string PatchJournal::url(const std::string& repodata_url)
+    {
+        std::string res = repodata_url;
+        if (ends_with(res, ".json"))
+        {
+            res.resize(res.size() - strlen(".json"));
+        }
+        return res + journal_suffix;
+    }
+
+    bool PatchJournal::is_journal_url(const std::string& url)
+    {
+        return ends_with(url, journal_suffix);
+    }
+
+    bool PatchJournal::applies() const
+    {
+        return m_applies;
+    }
+
+    bool PatchJournal::up_to_date() const
+    {
+        return m_applies && m_patches.empty();
+    }
+
+    const std::string& PatchJournal::latest() const
+    {
+        return m_latest;
+    }
+
+    bool PatchJournal::apply(nlohmann::json& repodata, std::set<std::string>& changed_fns) const
+    {
+        bool records_only = true;
+        for (const auto& patch : m_patches)
+        {
+            for (const auto& op : patch)
+            {
+                if (!add_record_fn(op.at("path").get<std::string>(), changed_fns))
+                {
+                    records_only = false;
+                }
+                if (op.contains("from")
+                    && !add_record_fn(op["from"].get<std::string>(), changed_fns))
+                {
+                    records_only = false;
+                }
+            }
+            repodata.patch_inplace(patch);
+        }
+        return records_only;
+    }
+}  // namespace mamba
@@ -4,8 +4,19 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <climits>
+
 #include "mamba/pool.hpp"
+#include "mamba/channel.hpp"
 #include "mamba/output.hpp"
+#include "mamba/util.hpp"
+
+extern "C"
+{
+#include "solv/conda.h"
+#include "solv/repo.h"
+}
 
 namespace mamba
 {
@@ -14,12 +25,17 @@ namespace mamba
         m_pool = pool_create();
         pool_setdisttype(m_pool, DISTTYPE_CONDA);
         set_debuglevel();
+        map_init(&m_considered, 0);
     }
 
     MPool::~MPool()
     {
-        LOG_INFO << "Freeing pool.";
+        LOG_INFO << "Freeing pool, matchspec memo: " << m_matchspec_hits << " hits, "
+                 << m_matchspec_misses << " misses";
+        // owned by the MPool
+        m_pool->considered = nullptr;
         pool_free(m_pool);
+        map_free(&m_considered);
     }
 
     void MPool::set_debuglevel()
@@ -32,7 +48,188 @@ namespace mamba
 
     void MPool::create_whatprovides()
     {
+        // the number of solvables of every repo, adding or freeing solvables
+        // invalidates the index
+        Pool* pool = m_pool;
+        std::vector<int> layout = { pool->nsolvables, m_considered_generation };
+        Id repoid;
+        Repo* repo;
+        FOR_REPOS(repoid, repo)
+        {
+            layout.push_back(repoid);
+            layout.push_back(repo->nsolvables);
+        }
+
+        if (m_pool->whatprovides && layout == m_whatprovides_layout)
+        {
+            LOG_INFO << "Reusing whatprovides index";
+            return;
+        }
         pool_createwhatprovides(m_pool);
+        m_whatprovides_layout = std::move(layout);
+    }
+
+    Id MPool::matchspec(const std::string& spec)
+    {
+        auto it = m_matchspec_ids.find(spec);
+        if (it != m_matchspec_ids.end())
+        {
+            ++m_matchspec_hits;
+            return it->second;
+        }
+        ++m_matchspec_misses;
+        Id id = pool_conda_matchspec(m_pool, spec.c_str());
+        m_matchspec_ids.emplace(spec, id);
+        return id;
+    }
+
+    std::size_t MPool::matchspec_hits() const
+    {
+        return m_matchspec_hits;
+    }
+
+    std::size_t MPool::matchspec_misses() const
+    {
+        return m_matchspec_misses;
+    }
+
+    void MPool::set_repo_state(Repo* repo, const std::string& state)
+    {
+        m_repo_states[repo] = state;
+    }
+
+    std::string MPool::repo_state(Repo* repo) const
+    {
+        auto it = m_repo_states.find(repo);
+        return it != m_repo_states.end() ? it->second : std::string();
+    }
+
+    int MPool::channel_id(const std::string& channel_url)
+    {
+        const Channel& channel = make_channel(channel_url);
+        for (std::size_t i = 0; i < m_channels.size(); ++i)
+        {
+            if (m_channels[i].canonical_name == channel.canonical_name())
+            {
+                return i;
+            }
+        }
+        m_channels.push_back({ channel.canonical_name(), channel.name() });
+        return m_channels.size() - 1;
+    }
+
+    void MPool::set_repo_channel(Repo* repo, const std::string& channel_url)
+    {
+        if (static_cast<std::size_t>(repo->repoid) >= m_repo_channels.size())
+        {
+            m_repo_channels.resize(repo->repoid + 1, -1);
+        }
+        m_repo_channels[repo->repoid] = channel_id(channel_url);
+    }
+
+    void MPool::select_channel_repos(const std::string& channel, Map* repos)
+    {
+        Pool* pool = m_pool;
+        Id repoid;
+        Repo* repo;
+        FOR_REPOS(repoid, repo)
+        {
+            // e.g. repos restored from a pool snapshot, named after their url
+            bool registered = static_cast<std::size_t>(repoid) < m_repo_channels.size()
+                              && m_repo_channels[repoid] >= 0;
+            if (!registered && repo != pool->installed && repo->name)
+            {
+                set_repo_channel(repo, repo->name);
+            }
+        }
+
+        const Channel& selected = make_channel(channel);
+        // a plain name also selects the mirrors of a channel
+        bool plain_name = channel.find_first_of("/:") == std::string::npos;
+        std::vector<bool> matches;
+        for (const auto& identity : m_channels)
+        {
+            matches.push_back(identity.canonical_name == selected.canonical_name()
+                              || (plain_name && identity.name == channel));
+        }
+
+        FOR_REPOS(repoid, repo)
+        {
+            if (repo == pool->installed
+                || static_cast<std::size_t>(repoid) >= m_repo_channels.size())
+            {
+                continue;
+            }
+            int id = m_repo_channels[repoid];
+            if (id >= 0 && matches[id])
+            {
+                MAPSET(repos, repoid);
+            }
+        }
+    }
+
+    int MPool::select_higher_priority(const std::set<std::string>& keep_names,
+                                      Map* considered) const
+    {
+        Pool* pool = m_pool;
+        std::vector<Id> keep;
+        for (const auto& name : keep_names)
+        {
+            if (Id id = pool_str2id(pool, name.c_str(), 0))
+            {
+                keep.push_back(id);
+            }
+        }
+
+        // the highest priority providing every name
+        std::vector<int> best(pool->ss.nstrings, INT_MIN);
+        Id p;
+        Solvable* s;
+        FOR_POOL_SOLVABLES(p)
+        {
+            s = pool_id2solvable(pool, p);
+            if (s->repo == pool->installed || s->repo->disabled || s->name >= pool->ss.nstrings)
+            {
+                continue;
+            }
+            best[s->name] = std::max(best[s->name], s->repo->priority);
+        }
+
+        map_setall(considered);
+        int pruned = 0;
+        FOR_POOL_SOLVABLES(p)
+        {
+            s = pool_id2solvable(pool, p);
+            if (s->repo == pool->installed || s->name >= pool->ss.nstrings
+                || s->repo->priority >= best[s->name]
+                || std::find(keep.begin(), keep.end(), s->name) != keep.end())
+            {
+                continue;
+            }
+            MAPCLR(considered, p);
+            ++pruned;
+        }
+        return pruned;
+    }
+
+    int MPool::prune_lower_priority(const std::set<std::string>& keep_names)
+    {
+        map_free(&m_considered);
+        map_init(&m_considered, m_pool->nsolvables);
+        int pruned = select_higher_priority(keep_names, &m_considered);
+        m_pool->considered = &m_considered;
+
+        std::vector<std::string> kept(keep_names.begin(), keep_names.end());
+        m_considered_state = concat("strict-priority ", join(" ", kept));
+        // the whatprovides index only holds the considered solvables
+        ++m_considered_generation;
+        LOG_INFO << "Strict channel priority: pruned " << pruned << " lower priority solvables";
+        return pruned;
+    }
+
+    std::string MPool::considered_state() const
+    {
+        return m_pool->considered ? m_considered_state : std::string();
     }
 
     MPool::operator Pool*()
@@ -0,0 +1,262 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#include "mamba/context.hpp"
+#include "mamba/mapped_file.hpp"
+#include "mamba/output.hpp"
+#include "mamba/pool_snapshot.hpp"
+#include "mamba/util.hpp"
+
+extern "C"
+{
+#include "solv/repo_solv.h"
+#include "solv/repo_write.h"
+#include "solv/solv_xfopen.h"
+}
+
+namespace mamba
+{
+    namespace
+    {
+        // Text header followed by the .solv data of every repo:
+        //
+        //   mamba-pool-snapshot 1
+        //   <mamba and libsolv version>
+        //   pip <add_pip_as_python_dependency>
+        //   <number of repos>
+        //   <size>\t<url>\t<priority>\t<subpriority>\t<state>
+        //   ...
+        //   <solv data>
+        const std::string snapshot_header = "mamba-pool-snapshot 1";
+
+        std::string pip_line()
+        {
+            return concat("pip ", Context::instance().add_pip_as_python_dependency ? "1" : "0");
+        }
+    }  // namespace
+
+    PoolSnapshot::PoolSnapshot(const fs::path& cache_dir)
+        : m_cache_dir(cache_dir)
+    {
+    }
+
+    void PoolSnapshot::add_repo(const RepoMetadata& metadata,
+                                const std::string& state,
+                                int priority,
+                                int subpriority)
+    {
+        // same url as MRepo
+        m_repos.push_back({ rsplit(metadata.url, "/", 1)[0], state, priority, subpriority });
+    }
+
+    fs::path PoolSnapshot::path() const
+    {
+        // one snapshot per channel list, the states are checked on load
+        std::stringstream channels;
+        for (const auto& entry : m_repos)
+        {
+            channels << entry.url << " " << entry.priority << " " << entry.subpriority << "\n";
+        }
+        std::stringstream name;
+        name << std::hex << std::hash<std::string>{}(channels.str()) << ".solvpool";
+        return m_cache_dir / "pools" / name.str();
+    }
+
+    bool PoolSnapshot::load(MPool& pool, std::vector<MRepo>& repos) const
+    {
+        fs::path snapshot_path = path();
+        if (m_repos.empty() || !fs::exists(snapshot_path))
+        {
+            return false;
+        }
+
+        MappedFile file(snapshot_path);
+        if (!file.data())
+        {
+            LOG_WARNING << "Could not map pool snapshot " << snapshot_path;
+            return false;
+        }
+
+        std::size_t pos = 0;
+        auto next_line = [&](std::string& line) {
+            std::size_t end
+                = std::string_view(file.data(), file.size()).find('\n', pos);
+            if (end == std::string_view::npos)
+            {
+                return false;
+            }
+            line.assign(file.data() + pos, end - pos);
+            pos = end + 1;
+            return true;
+        };
+
+        std::string line;
+        if (!next_line(line) || line != snapshot_header || !next_line(line)
+            || line != mamba_tool_version() || !next_line(line) || line != pip_line()
+            || !next_line(line) || line != std::to_string(m_repos.size()))
+        {
+            LOG_INFO << "Pool snapshot " << snapshot_path << " is outdated";
+            return false;
+        }
+
+        std::vector<std::size_t> sizes;
+        for (const auto& entry : m_repos)
+        {
+            std::string expected = concat(entry.url,
+                                          "\t",
+                                          std::to_string(entry.priority),
+                                          "\t",
+                                          std::to_string(entry.subpriority),
+                                          "\t",
+                                          entry.state);
+            if (!next_line(line))
+            {
+                return false;
+            }
+            auto sep = line.find('\t');
+            if (sep == std::string::npos || line.compare(sep + 1, std::string::npos, expected) != 0)
+            {
+                LOG_INFO << "Pool snapshot " << snapshot_path << " is outdated";
+                return false;
+            }
+            try
+            {
+                sizes.push_back(std::stoul(line.substr(0, sep)));
+            }
+            catch (const std::logic_error&)
+            {
+                return false;
+            }
+        }
+
+        std::vector<Repo*> loaded;
+        for (std::size_t i = 0; i < m_repos.size(); ++i)
+        {
+            const auto& entry = m_repos[i];
+            Repo* repo = repo_create(pool, entry.url.c_str());
+            loaded.push_back(repo);
+
+            int ret = -1;
+            if (pos + sizes[i] <= file.size())
+            {
+                FILE* fp = solv_fmemopen(file.data() + pos, sizes[i], "r");
+                ret = fp ? repo_add_solv(repo, fp, 0) : -1;
+                if (fp)
+                {
+                    fclose(fp);
+                }
+            }
+            if (ret != 0)
+            {
+                LOG_WARNING << "Could not read pool snapshot " << snapshot_path << ": "
+                            << pool_errstr(pool);
+                for (auto* r : loaded)
+                {
+                    repo_free(r, /*reuse_ids*/ 1);
+                }
+                return false;
+            }
+            pos += sizes[i];
+
+            repo_internalize(repo);
+            repo->priority = entry.priority;
+            repo->subpriority = entry.subpriority;
+            pool.set_repo_state(repo, entry.state);
+        }
+
+        LOG_INFO << "Loaded " << loaded.size() << " repos from pool snapshot " << snapshot_path;
+        for (std::size_t i = 0; i < loaded.size(); ++i)
+        {
+            pool.set_repo_channel(loaded[i], m_repos[i].url);
+            repos.push_back(MRepo(loaded[i], m_repos[i].url));
+        }
+        return true;
+    }
+
+    bool PoolSnapshot::save(MPool& pool, const std::vector<MRepo*>& repos) const
+    {
+        if (m_repos.empty() || repos.size() != m_repos.size())
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < repos.size(); ++i)
+        {
+            const auto& entry = m_repos[i];
+            auto [priority, subpriority] = repos[i]->priority();
+            if (repos[i]->url() != entry.url || priority != entry.priority
+                || subpriority != entry.subpriority
+                || pool.repo_state(repos[i]->repo()) != entry.state
+                || entry.state.find('\n') != std::string::npos)
+            {
+                LOG_INFO << "Not writing pool snapshot, repo " << repos[i]->url()
+                         << " does not match the snapshot description";
+                return false;
+            }
+        }
+
+        fs::path snapshot_path = path();
+        LOG_INFO << "Writing pool snapshot " << snapshot_path;
+
+        FILE* data = std::tmpfile();
+        if (!data)
+        {
+            return false;
+        }
+        std::vector<long> sizes;
+        long start = 0;
+        for (auto* repo : repos)
+        {
+            if (repo_write(repo->repo(), data) != 0)
+            {
+                LOG_WARNING << "Could not write pool snapshot: " << pool_errstr(pool);
+                fclose(data);
+                return false;
+            }
+            long end = ftell(data);
+            sizes.push_back(end - start);
+            start = end;
+        }
+        rewind(data);
+
+        fs::create_directories(snapshot_path.parent_path());
+        fs::path tmp_path = snapshot_path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::out | std::ios::binary);
+            out << snapshot_header << '\n'
+                << mamba_tool_version() << '\n'
+                << pip_line() << '\n'
+                << m_repos.size() << '\n';
+            for (std::size_t i = 0; i < m_repos.size(); ++i)
+            {
+                const auto& entry = m_repos[i];
+                out << sizes[i] << '\t' << entry.url << '\t' << entry.priority << '\t'
+                    << entry.subpriority << '\t' << entry.state << '\n';
+            }
+
+            char buffer[1 << 16];
+            std::size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), data)) > 0)
+            {
+                out.write(buffer, n);
+            }
+            fclose(data);
+
+            if (!out)
+            {
+                LOG_WARNING << "Could not write pool snapshot " << tmp_path;
+                return false;
+            }
+        }
+        fs::rename(tmp_path, snapshot_path);
+        return true;
+    }
+}  // namespace mamba
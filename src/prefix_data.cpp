@@ -4,11 +4,268 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
 #include "mamba/prefix_data.hpp"
+#include "mamba/mapped_file.hpp"
 #include "mamba/output.hpp"
+#include "mamba/package_paths.hpp"
+#include "mamba/thread_utils.hpp"
 
 namespace mamba
 {
+    namespace
+    {
+        // Binary index of the package records of conda-meta, in native byte
+        // order:
+        //
+        //   index_header
+        //   index_entry[entry_count]
+        //   uint32[id_count]            depends and constrains of the entries
+        //   uint32[string_count + 1]    offsets of the strings
+        //   char[strings_size]          interned strings
+        //
+        // The fields of the entries are ids of strings. Each entry keeps the
+        // size and mtime of its record, it is used as long as they match.
+        const char index_magic[16] = "mamba-records 1";
+        const std::uint32_t index_byte_order = 0x01020304;
+
+        struct index_header
+        {
+            char magic[16];
+            std::uint32_t byte_order;
+            std::uint32_t entry_count;
+            std::uint32_t id_count;
+            std::uint32_t string_count;
+            std::uint64_t strings_size;
+        };
+
+        struct index_entry
+        {
+            // the size and mtime of the JSON record
+            std::int64_t record_size;
+            std::int64_t record_mtime;
+            std::uint64_t build_number;
+            std::uint64_t size;
+            std::uint64_t timestamp;
+            std::uint32_t record_file;
+            std::uint32_t name;
+            std::uint32_t version;
+            std::uint32_t build_string;
+            std::uint32_t channel;
+            std::uint32_t url;
+            std::uint32_t subdir;
+            std::uint32_t fn;
+            std::uint32_t license;
+            std::uint32_t md5;
+            std::uint32_t sha256;
+            std::uint32_t depends;
+            std::uint32_t depends_count;
+            std::uint32_t constrains;
+            std::uint32_t constrains_count;
+            std::uint32_t reserved;
+        };
+
+        struct index_record
+        {
+            std::string file;
+            std::int64_t size = -1;
+            std::int64_t mtime = 0;
+            PackageInfo info{ std::string() };
+        };
+
+        void set_record_stamp(const fs::path& path, index_record& record)
+        {
+            std::error_code ec;
+            auto size = fs::file_size(path, ec);
+            auto mtime = fs::last_write_time(path, ec);
+            if (!ec)
+            {
+                record.size = static_cast<std::int64_t>(size);
+                record.mtime = static_cast<std::int64_t>(mtime.time_since_epoch().count());
+            }
+        }
+
+        bool read_index(const fs::path& path, std::vector<index_record>& records)
+        {
+            MappedFile file(path);
+            index_header header;
+            if (!file.data() || file.size() < sizeof(header))
+            {
+                return false;
+            }
+            std::memcpy(&header, file.data(), sizeof(header));
+            if (std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0
+                || header.byte_order != index_byte_order)
+            {
+                return false;
+            }
+            std::size_t ids_offset
+                = sizeof(header) + std::size_t(header.entry_count) * sizeof(index_entry);
+            std::size_t offsets_offset = ids_offset + std::size_t(header.id_count) * 4;
+            std::size_t strings_offset
+                = offsets_offset + (std::size_t(header.string_count) + 1) * 4;
+            if (strings_offset > file.size()
+                || header.strings_size != file.size() - strings_offset)
+            {
+                return false;
+            }
+
+            bool valid = true;
+            auto read_id = [&](std::size_t offset) {
+                std::uint32_t id;
+                std::memcpy(&id, file.data() + offset, sizeof(id));
+                return id;
+            };
+            auto str = [&](std::uint32_t id) {
+                std::uint32_t begin = 0, end = 0;
+                if (id < header.string_count)
+                {
+                    begin = read_id(offsets_offset + std::size_t(id) * 4);
+                    end = read_id(offsets_offset + std::size_t(id + 1) * 4);
+                }
+                valid = valid && id < header.string_count && begin <= end
+                        && end <= header.strings_size;
+                return valid ? std::string(file.data() + strings_offset + begin, end - begin)
+                             : std::string();
+            };
+            auto strs = [&](std::uint32_t first, std::uint32_t count) {
+                std::vector<std::string> res;
+                valid = valid && first <= header.id_count && count <= header.id_count - first;
+                for (std::uint32_t i = 0; valid && i < count; ++i)
+                {
+                    res.push_back(str(read_id(ids_offset + std::size_t(first + i) * 4)));
+                }
+                return res;
+            };
+
+            records.resize(header.entry_count);
+            for (std::size_t i = 0; valid && i < records.size(); ++i)
+            {
+                index_entry entry;
+                std::memcpy(
+                    &entry, file.data() + sizeof(header) + i * sizeof(entry), sizeof(entry));
+                auto& record = records[i];
+                record.file = str(entry.record_file);
+                record.size = entry.record_size;
+                record.mtime = entry.record_mtime;
+                PackageInfo& info = record.info;
+                info.name = str(entry.name);
+                info.version = str(entry.version);
+                info.build_string = str(entry.build_string);
+                info.build_number = entry.build_number;
+                info.channel = str(entry.channel);
+                info.url = str(entry.url);
+                info.subdir = str(entry.subdir);
+                info.fn = str(entry.fn);
+                info.license = str(entry.license);
+                info.size = entry.size;
+                info.timestamp = entry.timestamp;
+                info.md5 = str(entry.md5);
+                info.sha256 = str(entry.sha256);
+                info.depends = strs(entry.depends, entry.depends_count);
+                info.constrains = strs(entry.constrains, entry.constrains_count);
+            }
+            if (!valid)
+            {
+                LOG_WARNING << "Ignoring invalid package record index " << path;
+                records.clear();
+            }
+            return valid;
+        }
+
+        // written atomically
+        bool write_index(const fs::path& path, const std::vector<index_record>& records)
+        {
+            std::vector<index_entry> entries;
+            std::vector<std::uint32_t> ids;
+            std::vector<std::uint32_t> offsets = { 0 };
+            std::string strings;
+            std::unordered_map<std::string, std::uint32_t> interned;
+            auto intern = [&](const std::string& s) {
+                auto [it, inserted] = interned.emplace(s, offsets.size() - 1);
+                if (inserted)
+                {
+                    strings += s;
+                    offsets.push_back(strings.size());
+                }
+                return it->second;
+            };
+            auto intern_all = [&](const std::vector<std::string>& v) {
+                std::uint32_t first = ids.size();
+                for (const auto& s : v)
+                {
+                    ids.push_back(intern(s));
+                }
+                return first;
+            };
+
+            for (const auto& record : records)
+            {
+                const PackageInfo& info = record.info;
+                index_entry entry{};
+                entry.record_size = record.size;
+                entry.record_mtime = record.mtime;
+                entry.build_number = info.build_number;
+                entry.size = info.size;
+                entry.timestamp = info.timestamp;
+                entry.record_file = intern(record.file);
+                entry.name = intern(info.name);
+                entry.version = intern(info.version);
+                entry.build_string = intern(info.build_string);
+                entry.channel = intern(info.channel);
+                entry.url = intern(info.url);
+                entry.subdir = intern(info.subdir);
+                entry.fn = intern(info.fn);
+                entry.license = intern(info.license);
+                entry.md5 = intern(info.md5);
+                entry.sha256 = intern(info.sha256);
+                entry.depends = intern_all(info.depends);
+                entry.depends_count = info.depends.size();
+                entry.constrains = intern_all(info.constrains);
+                entry.constrains_count = info.constrains.size();
+                entries.push_back(entry);
+            }
+
+            index_header header{};
+            std::memcpy(header.magic, index_magic, sizeof(index_magic));
+            header.byte_order = index_byte_order;
+            header.entry_count = entries.size();
+            header.id_count = ids.size();
+            header.string_count = offsets.size() - 1;
+            header.strings_size = strings.size();
+
+            fs::path tmp_path = path;
+            tmp_path += ".tmp";
+            std::error_code ec;
+            {
+                std::ofstream out(tmp_path, std::ios::out | std::ios::binary);
+                out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                out.write(reinterpret_cast<const char*>(entries.data()),
+                          entries.size() * sizeof(index_entry));
+                out.write(reinterpret_cast<const char*>(ids.data()), ids.size() * 4);
+                out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * 4);
+                out.write(strings.data(), strings.size());
+                if (!out)
+                {
+                    out.close();
+                    fs::remove(tmp_path, ec);
+                    return false;
+                }
+            }
+            fs::rename(tmp_path, path, ec);
+            if (ec)
+            {
+                fs::remove(tmp_path, ec);
+                return false;
+            }
+            return true;
+        }
+    }  // namespace
+
     PrefixData::PrefixData(const std::string& prefix_path)
         : m_history(prefix_path)
         , m_prefix_path(fs::path(prefix_path))
@@ -17,16 +274,124 @@ namespace mamba
 
     void PrefixData::load()
     {
+        load_records();
+    }
+
+    void PrefixData::update_index()
+    {
+        load_records();
+    }
+
+    fs::path PrefixData::index_path(const fs::path& prefix)
+    {
+        return prefix / "conda-meta" / ".mamba-record-index";
+    }
+
+    void PrefixData::load_records()
+    {
+        m_package_records.clear();
+        m_record_paths.clear();
         auto conda_meta_dir = m_prefix_path / "conda-meta";
-        if (lexists(conda_meta_dir))
+        if (!lexists(conda_meta_dir))
         {
-            for (auto& p : fs::directory_iterator(conda_meta_dir))
+            return;
+        }
+
+        fs::path index_file = index_path(m_prefix_path);
+        std::vector<index_record> indexed;
+        read_index(index_file, indexed);
+
+        // the entries of the index whose record did not change (same size and
+        // mtime) are kept: the mtime of conda-meta alone misses the records
+        // rewritten in place, or written in the same tick as the index
+        std::unordered_map<std::string, index_record*> indexed_by_file;
+        for (auto& record : indexed)
+        {
+            indexed_by_file[record.file] = &record;
+        }
+        std::vector<index_record> records;
+        std::vector<std::size_t> to_read;
+        for (auto& p : fs::directory_iterator(conda_meta_dir))
+        {
+            if (!ends_with(p.path().c_str(), ".json"))
+            {
+                continue;
+            }
+            index_record record;
+            record.file = p.path().filename().string();
+            set_record_stamp(p.path(), record);
+            auto it = indexed_by_file.find(record.file);
+            if (it != indexed_by_file.end() && record.size >= 0
+                && it->second->size == record.size && it->second->mtime == record.mtime)
+            {
+                record.info = std::move(it->second->info);
+            }
+            else
+            {
+                to_read.push_back(records.size());
+            }
+            records.push_back(std::move(record));
+        }
+
+        // the records are parsed in parallel by this thread and tasks of the
+        // global pool, each one taking the next record
+        std::vector<nlohmann::json> headers(to_read.size());
+        std::vector<std::string> errors(to_read.size());
+        std::atomic<std::size_t> next{ 0 };
+        auto parse = [&]() {
+            for (std::size_t i = next++; i < to_read.size(); i = next++)
             {
-                if (ends_with(p.path().c_str(), ".json"))
+                try
                 {
-                    load_single_record(p.path());
+                    headers[i]
+                        = read_prefix_record_header(conda_meta_dir / records[to_read[i]].file);
                 }
+                catch (const std::exception& e)
+                {
+                    errors[i] = e.what();
+                }
+            }
+        };
+        // a task of the pool parses everything itself, it must not wait for
+        // the other tasks
+        thread_pool& tasks = thread_pool::global();
+        std::size_t ntasks = tasks.in_worker()
+                                 ? 0
+                                 : std::min(tasks.size(), (to_read.size() + 15) / 16);
+        std::vector<std::future<void>> workers;
+        for (std::size_t i = 1; i < ntasks; ++i)
+        {
+            workers.push_back(tasks.submit(parse));
+        }
+        parse();
+        // every record is parsed by now, the tasks that did not start (on
+        // interruption) have nothing left to do
+        for (auto& worker : workers)
+        {
+            worker.wait();
+        }
+
+        for (std::size_t i = 0; i < to_read.size(); ++i)
+        {
+            if (!errors[i].empty())
+            {
+                throw std::runtime_error(errors[i]);
             }
+            auto& record = records[to_read[i]];
+            LOG_INFO << "Loaded package record header: " << conda_meta_dir / record.file;
+            record.info = PackageInfo(std::move(headers[i]));
+        }
+        LOG_INFO << "Package records: " << records.size() - to_read.size() << " from "
+                 << index_file << ", " << to_read.size() << " from conda-meta";
+
+        bool changed = !to_read.empty() || records.size() != indexed.size();
+        if (changed && !write_index(index_file, records))
+        {
+            LOG_INFO << "Could not write " << index_file;
+        }
+        for (auto& record : records)
+        {
+            add_record(std::move(record.info), conda_meta_dir / record.file);
         }
     }
 
@@ -51,7 +416,25 @@ namespace mamba
         std::ifstream infile(path);
         nlohmann::json j;
         infile >> j;
-        auto prec = PackageInfo(std::move(j));
+        add_record(PackageInfo(std::move(j)), path);
+    }
+
+    nlohmann::json PrefixData::full_record(const std::string& name) const
+    {
+        auto it = m_record_paths.find(name);
+        if (it == m_record_paths.end())
+        {
+            throw std::runtime_error("No record of " + name + " in " + m_prefix_path.string());
+        }
+        std::ifstream infile(it->second);
+        nlohmann::json j;
+        infile >> j;
+        return j;
+    }
+
+    void PrefixData::add_record(PackageInfo&& prec, const fs::path& path)
+    {
+        m_record_paths.insert({ prec.name, path });
         m_package_records.insert({ prec.name, std::move(prec) });
     }
 }  // namespace mamba
@@ -0,0 +1,385 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+
+#include "mamba/output.hpp"
+#include "mamba/package_paths.hpp"
+#include "mamba/prefix_file_index.hpp"
+#include "mamba/util.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        // Text format, one package record per block:
+        //
+        //   mamba-file-index 3
+        //   <name-version-build>\t<mtime of the conda-meta record>\t<install sequence>
+        //   \t<path>
+        //   \t<path>
+        //   ...
+        //
+        // Backslashes, tabs and newlines of the paths are escaped.
+        const std::string index_header = "mamba-file-index 3";
+
+        std::string normalize(const std::string& path)
+        {
+            return fs::path(path).generic_string();
+        }
+
+        std::string escape(const std::string& path)
+        {
+            std::string res;
+            res.reserve(path.size());
+            for (char c : path)
+            {
+                switch (c)
+                {
+                    case '\\':
+                        res += "\\\\";
+                        break;
+                    case '\t':
+                        res += "\\t";
+                        break;
+                    case '\n':
+                        res += "\\n";
+                        break;
+                    default:
+                        res += c;
+                }
+            }
+            return res;
+        }
+
+        std::string unescape(const std::string& path)
+        {
+            std::string res;
+            res.reserve(path.size());
+            for (std::size_t i = 0; i < path.size(); ++i)
+            {
+                if (path[i] != '\\' || i + 1 == path.size())
+                {
+                    res += path[i];
+                    continue;
+                }
+                char c = path[++i];
+                res += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+            }
+            return res;
+        }
+    }  // namespace
+
+    PrefixFileIndex::PrefixFileIndex(const fs::path& prefix)
+        : m_prefix(prefix)
+    {
+    }
+
+    fs::path PrefixFileIndex::index_path(const fs::path& prefix)
+    {
+        return prefix / "conda-meta" / ".mamba-file-index";
+    }
+
+    std::string PrefixFileIndex::owner(const fs::path& rel_path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        auto it = m_owners.find(rel_path.generic_string());
+        return it != m_owners.end() ? it->second.back()->first : std::string();
+    }
+
+    bool PrefixFileIndex::contains(const std::string& pkg)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        return m_packages.find(pkg) != m_packages.end();
+    }
+
+    std::vector<std::string> PrefixFileIndex::files(const std::string& pkg)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        auto it = m_packages.find(pkg);
+        return it != m_packages.end() ? it->second.files : std::vector<std::string>();
+    }
+
+    std::vector<std::string> PrefixFileIndex::owned_files(const std::string& pkg)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        std::vector<std::string> res;
+        auto it = m_packages.find(pkg);
+        if (it != m_packages.end())
+        {
+            for (const auto& f : it->second.files)
+            {
+                auto owner_it = m_owners.find(f);
+                if (owner_it != m_owners.end() && owner_it->second.back() == &*it)
+                {
+                    res.push_back(f);
+                }
+            }
+        }
+        return res;
+    }
+
+    void PrefixFileIndex::add(const std::string& pkg, const std::vector<std::string>& paths)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        package_entry entry;
+        entry.mtime = record_mtime(pkg);
+        entry.sequence = ++m_last_sequence;
+        entry.files.reserve(paths.size());
+        for (const auto& p : paths)
+        {
+            entry.files.push_back(normalize(p));
+        }
+        add_entry(pkg, std::move(entry));
+        m_dirty = true;
+    }
+
+    void PrefixFileIndex::remove(const std::string& pkg)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        load();
+        if (m_packages.find(pkg) != m_packages.end())
+        {
+            remove_entry(pkg);
+            m_dirty = true;
+        }
+    }
+
+    void PrefixFileIndex::save()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty)
+        {
+            return;
+        }
+
+        fs::path path = index_path(m_prefix);
+        if (!fs::exists(path.parent_path()))
+        {
+            return;
+        }
+        fs::path tmp_path = path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::out | std::ios::binary);
+            out << index_header << '\n';
+            for (const auto& [pkg, entry] : m_packages)
+            {
+                out << pkg << '\t' << entry.mtime << '\t' << entry.sequence << '\n';
+                for (const auto& f : entry.files)
+                {
+                    out << '\t' << escape(f) << '\n';
+                }
+            }
+            if (!out)
+            {
+                out.close();
+                LOG_WARNING << "Could not write file index " << tmp_path;
+                std::error_code ec;
+                fs::remove(tmp_path, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, path, ec);
+        if (ec)
+        {
+            LOG_WARNING << "Could not write file index " << path << ": " << ec.message();
+            fs::remove(tmp_path, ec);
+            return;
+        }
+        m_dirty = false;
+    }
+
+    std::string PrefixFileIndex::record_mtime(const std::string& pkg) const
+    {
+        std::error_code ec;
+        auto t = fs::last_write_time(m_prefix / "conda-meta" / (pkg + ".json"), ec);
+        return ec ? std::string() : std::to_string(t.time_since_epoch().count());
+    }
+
+    void PrefixFileIndex::add_entry(const std::string& pkg, package_entry entry)
+    {
+        if (m_packages.find(pkg) != m_packages.end())
+        {
+            remove_entry(pkg);
+        }
+        m_last_sequence = std::max(m_last_sequence, entry.sequence);
+        auto it = m_packages.emplace(pkg, std::move(entry)).first;
+        for (const auto& f : it->second.files)
+        {
+            // ordered by sequence, the owner is the last one
+            auto& owners = m_owners[f];
+            auto pos = std::find_if(owners.begin(), owners.end(), [&](const auto* other) {
+                return other->second.sequence > it->second.sequence;
+            });
+            owners.insert(pos, &*it);
+        }
+    }
+
+    void PrefixFileIndex::remove_entry(const std::string& pkg)
+    {
+        auto it = m_packages.find(pkg);
+        for (const auto& f : it->second.files)
+        {
+            // the ownership goes back to the previous package having the file
+            auto owner_it = m_owners.find(f);
+            if (owner_it != m_owners.end())
+            {
+                auto& owners = owner_it->second;
+                owners.erase(std::remove(owners.begin(), owners.end(), &*it), owners.end());
+                if (owners.empty())
+                {
+                    m_owners.erase(owner_it);
+                }
+            }
+        }
+        m_packages.erase(it);
+    }
+
+    bool PrefixFileIndex::read_index()
+    {
+        std::ifstream in(index_path(m_prefix), std::ios::in | std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+
+        std::string line;
+        if (!std::getline(in, line) || line != index_header)
+        {
+            LOG_INFO << "Ignoring file index with unknown format";
+            return false;
+        }
+
+        std::string pkg;
+        package_entry entry;
+        auto flush = [&]() {
+            if (!pkg.empty())
+            {
+                add_entry(pkg, std::move(entry));
+            }
+            entry = package_entry();
+        };
+
+        while (std::getline(in, line))
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+            if (line[0] == '\t')
+            {
+                entry.files.push_back(unescape(line.substr(1)));
+                continue;
+            }
+            flush();
+            auto fields = split(line, "\t");
+            if (fields.size() != 3)
+            {
+                LOG_INFO << "Ignoring corrupted file index";
+                m_packages.clear();
+                m_owners.clear();
+                m_last_sequence = 0;
+                return false;
+            }
+            pkg = fields[0];
+            entry.mtime = fields[1];
+            entry.sequence = std::strtoull(fields[2].c_str(), nullptr, 10);
+        }
+        flush();
+        return true;
+    }
+
+    void PrefixFileIndex::load()
+    {
+        if (m_loaded)
+        {
+            return;
+        }
+        m_loaded = true;
+
+        if (!read_index())
+        {
+            m_dirty = true;
+        }
+
+        // reconcile the index with the package records actually present
+        fs::path conda_meta = m_prefix / "conda-meta";
+        std::set<std::string> records;
+        if (fs::exists(conda_meta))
+        {
+            for (auto& p : fs::directory_iterator(conda_meta))
+            {
+                if (ends_with(p.path().c_str(), ".json"))
+                {
+                    records.insert(p.path().stem().string());
+                }
+            }
+        }
+
+        std::vector<std::string> outdated;
+        for (const auto& [pkg, entry] : m_packages)
+        {
+            if (records.find(pkg) == records.end())
+            {
+                outdated.push_back(pkg);
+            }
+        }
+        for (const auto& pkg : outdated)
+        {
+            remove_entry(pkg);
+            m_dirty = true;
+        }
+
+        // records (re)written since the index was saved were installed last,
+        // in the order of their mtimes
+        std::vector<std::pair<std::string, std::string>> changed;
+        for (const auto& pkg : records)
+        {
+            std::string mtime = record_mtime(pkg);
+            auto it = m_packages.find(pkg);
+            if (it == m_packages.end() || it->second.mtime != mtime)
+            {
+                changed.emplace_back(std::move(mtime), pkg);
+            }
+        }
+        std::sort(changed.begin(), changed.end(), [](const auto& lhs, const auto& rhs) {
+            long long lt = std::strtoll(lhs.first.c_str(), nullptr, 10);
+            long long rt = std::strtoll(rhs.first.c_str(), nullptr, 10);
+            return lt != rt ? lt < rt : lhs.second < rhs.second;
+        });
+
+        for (auto& [mtime, pkg] : changed)
+        {
+            LOG_INFO << "Indexing files of " << pkg;
+            package_entry entry;
+            entry.mtime = mtime;
+            entry.sequence = ++m_last_sequence;
+            try
+            {
+                for (auto& p : read_prefix_record_paths(conda_meta / (pkg + ".json")))
+                {
+                    entry.files.push_back(normalize(p.path));
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not read package record " << pkg << ": " << e.what();
+                continue;
+            }
+            add_entry(pkg, std::move(entry));
+            m_dirty = true;
+        }
+    }
+}  // namespace mamba
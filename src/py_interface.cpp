@@ -11,6 +11,7 @@
 #include "mamba/context.hpp"
 #include "mamba/package_handling.hpp"
 #include "mamba/pool.hpp"
+#include "mamba/pool_snapshot.hpp"
 #include "mamba/prefix_data.hpp"
 #include "mamba/query.hpp"
 #include "mamba/repo.hpp"
@@ -48,7 +49,9 @@ PYBIND11_MODULE(mamba_api, m)
     py::class_<MPool>(m, "Pool")
         .def(py::init<>())
         .def("set_debuglevel", &MPool::set_debuglevel)
-        .def("create_whatprovides", &MPool::create_whatprovides);
+        .def("create_whatprovides", &MPool::create_whatprovides)
+        .def("matchspec_hits", &MPool::matchspec_hits)
+        .def("matchspec_misses", &MPool::matchspec_misses);
 
     py::class_<MultiPackageCache>(m, "MultiPackageCache")
         .def(py::init<std::vector<fs::path>>())
@@ -57,6 +60,7 @@ PYBIND11_MODULE(mamba_api, m)
     py::class_<MRepo>(m, "Repo")
         .def(py::init<MPool&, const std::string&, const std::string&, const std::string&>())
         .def(py::init<MPool&, const PrefixData&>())
+        .def_static("from_conda_meta", &MRepo::from_conda_meta)
         .def("set_installed", &MRepo::set_installed)
         .def("set_priority", &MRepo::set_priority)
         .def("name", &MRepo::name)
@@ -70,7 +74,8 @@ PYBIND11_MODULE(mamba_api, m)
         .def("log_json", &MTransaction::log_json)
         .def("print", &MTransaction::print)
         .def("fetch_extract_packages", &MTransaction::fetch_extract_packages)
-        .def("prompt", &MTransaction::prompt)
+        .def("prompt",
+             py::overload_cast<const std::string&, std::vector<MRepo*>&>(&MTransaction::prompt))
         .def("execute",
              [](MTransaction& self, PrefixData& target_prefix, const std::string& cache_dir)
                  -> bool { return self.execute(target_prefix, cache_dir); });
@@ -85,6 +90,14 @@ PYBIND11_MODULE(mamba_api, m)
         .def("set_postsolve_flags", &MSolver::set_postsolve_flags)
         .def("is_solved", &MSolver::is_solved)
         .def("problems_to_str", &MSolver::problems_to_str)
+        .def("set_solution_cache", &MSolver::set_solution_cache)
+        .def("solution_from_cache", &MSolver::solution_from_cache)
+        .def("set_portfolio", &MSolver::set_portfolio)
+        .def("portfolio_winner", &MSolver::portfolio_winner)
+        .def_static("solve_batch",
+                    &MSolver::solve_batch,
+                    py::arg("solvers"),
+                    py::arg("threads") = 0)
         .def("solve", &MSolver::solve);
 
     /*py::class_<Query>(m, "Query")
@@ -163,11 +176,25 @@ PYBIND11_MODULE(mamba_api, m)
 
     py::class_<MSubdirData>(m, "SubdirData")
         .def(py::init<const std::string&, const std::string&, const std::string&>())
-        .def("create_repo", &MSubdirData::create_repo)
+        .def("create_repo", py::overload_cast<MPool&>(&MSubdirData::create_repo))
         .def("load", &MSubdirData::load)
         .def("loaded", &MSubdirData::loaded)
         .def("cache_path", &MSubdirData::cache_path);
 
+    py::class_<PoolSnapshot>(m, "PoolSnapshot")
+        .def(py::init([](const std::string& cache_dir) { return PoolSnapshot(cache_dir); }))
+        .def("add_repo",
+             [](PoolSnapshot& self, MSubdirData& subdir, int priority, int subpriority) {
+                 self.add_repo(subdir.repo_metadata(), subdir.repo_state(), priority, subpriority);
+             })
+        .def("load",
+             [](const PoolSnapshot& self, MPool& pool) {
+                 std::vector<MRepo> repos;
+                 self.load(pool, repos);
+                 return repos;
+             })
+        .def("save", &PoolSnapshot::save);
+
     m.def("cache_fn_url", &cache_fn_url);
     m.def("create_cache_dir", &create_cache_dir);
 
@@ -187,6 +214,7 @@ PYBIND11_MODULE(mamba_api, m)
         .def_readwrite("local_repodata_ttl", &Context::local_repodata_ttl)
         .def_readwrite("use_index_cache", &Context::use_index_cache)
         .def_readwrite("max_parallel_downloads", &Context::max_parallel_downloads)
+        .def_readwrite("max_parallel_tasks", &Context::max_parallel_tasks)
         .def_readwrite("always_yes", &Context::always_yes)
         .def_readwrite("dry_run", &Context::dry_run)
         .def_readwrite("ssl_verify", &Context::ssl_verify)
@@ -294,4 +322,5 @@ PYBIND11_MODULE(mamba_api, m)
     m.attr("MAMBA_NO_DEPS") = MAMBA_NO_DEPS;
     m.attr("MAMBA_ONLY_DEPS") = MAMBA_ONLY_DEPS;
     m.attr("MAMBA_FORCE_REINSTALL") = MAMBA_FORCE_REINSTALL;
+    m.attr("MAMBA_FREEZE_INSTALLED") = MAMBA_FREEZE_INSTALLED;
 }
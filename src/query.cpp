@@ -153,7 +153,7 @@ namespace mamba
         queue_init(&job);
         queue_init(&solvables);
 
-        Id id = pool_conda_matchspec(m_pool.get(), query.c_str());
+        Id id = m_pool.get().matchspec(query);
         if (id)
         {
             queue_push2(&job, SOLVER_SOLVABLE_PROVIDES, id);
@@ -193,7 +193,7 @@ namespace mamba
         queue_init(&job);
         queue_init(&solvables);
 
-        Id id = pool_conda_matchspec(m_pool.get(), query.c_str());
+        Id id = m_pool.get().matchspec(query);
         if (id)
         {
             queue_push2(&job, SOLVER_SOLVABLE_PROVIDES, id);
@@ -234,7 +234,7 @@ namespace mamba
         queue_init(&job);
         queue_init(&solvables);
 
-        Id id = pool_conda_matchspec(m_pool.get(), query.c_str());
+        Id id = m_pool.get().matchspec(query);
         if (id)
         {
             queue_push2(&job, SOLVER_SOLVABLE_PROVIDES, id);
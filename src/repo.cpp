@@ -4,9 +4,16 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <cstdio>
+#include <map>
+#include <sstream>
+
 #include "mamba/repo.hpp"
 #include "mamba/output.hpp"
+#include "mamba/package_handling.hpp"
 #include "mamba/package_info.hpp"
+#include "mamba/package_paths.hpp"
+#include "mamba/util.hpp"
 
 extern "C"
 {
@@ -28,6 +35,46 @@ namespace mamba
         return MTV;
     }
 
+    namespace
+    {
+        std::string file_state(const fs::path& path)
+        {
+            std::error_code ec;
+            auto size = fs::file_size(path, ec);
+            if (ec)
+            {
+                return "";
+            }
+            auto mtime = fs::last_write_time(path, ec);
+            if (ec)
+            {
+                return "";
+            }
+            return concat("file ",
+                          fs::absolute(path).string(),
+                          " ",
+                          std::to_string(size),
+                          " ",
+                          std::to_string(mtime.time_since_epoch().count()));
+        }
+    }  // namespace
+
+    std::string repodata_state(const RepoMetadata& metadata, const fs::path& json_file)
+    {
+        if (metadata.etag.empty() && metadata.mod.empty() && metadata.sha256.empty())
+        {
+            return file_state(json_file);
+        }
+        return concat("repodata ",
+                      metadata.url,
+                      " ",
+                      metadata.etag,
+                      " ",
+                      metadata.mod,
+                      metadata.sha256.empty() ? "" : " " + metadata.sha256,
+                      metadata.pip_added ? " pip" : "");
+    }
+
     MRepo::MRepo(MPool& pool,
                  const std::string& name,
                  const fs::path& filename,
@@ -36,7 +83,59 @@ namespace mamba
     {
         m_url = rsplit(metadata.url, "/", 1)[0];
         m_repo = repo_create(pool, m_url.c_str());
+        m_repoid = m_repo->repoid;
+        pool.set_repo_channel(m_repo, m_url);
         read_file(filename);
+
+        pool.set_repo_state(m_repo, repodata_state(metadata, m_json_file));
+    }
+
+    MRepo::MRepo(MPool& pool,
+                 const RepodataIndex& index,
+                 const std::set<std::string>& names,
+                 const RepoMetadata& metadata)
+        : m_metadata(metadata)
+    {
+        m_url = rsplit(metadata.url, "/", 1)[0];
+        m_repo = repo_create(pool, m_url.c_str());
+        m_repoid = m_repo->repoid;
+        pool.set_repo_channel(m_repo, m_url);
+        LOG_INFO << m_url << ": sparse loading of " << names.size() << " package names";
+
+        add_repodata(index.repodata(names));
+        add_pip_as_python_dependency();
+        repo_internalize(m_repo);
+
+        // never written to the .solv cache, which holds the full repodata
+        std::vector<std::string> loaded_names(names.begin(), names.end());
+        pool.set_repo_state(m_repo,
+                            concat(repodata_state(metadata, index.json_file()),
+                                   " sparse ",
+                                   join(" ", loaded_names)));
+    }
+
+    MRepo::MRepo(MPool& pool,
+                 const ShardedRepodata& shards,
+                 const std::set<std::string>& names,
+                 const RepoMetadata& metadata)
+        : m_metadata(metadata)
+    {
+        m_url = rsplit(metadata.url, "/", 1)[0];
+        m_repo = repo_create(pool, m_url.c_str());
+        m_repoid = m_repo->repoid;
+        pool.set_repo_channel(m_repo, m_url);
+        LOG_INFO << m_url << ": loading " << names.size() << " package names from shards";
+
+        add_repodata(shards.repodata(names));
+        add_pip_as_python_dependency();
+        repo_internalize(m_repo);
+
+        // the index identifies the shards
+        std::vector<std::string> loaded_names(names.begin(), names.end());
+        pool.set_repo_state(m_repo,
+                            concat(repodata_state(metadata, shards.index_file()),
+                                   " shards ",
+                                   join(" ", loaded_names)));
     }
 
     MRepo::MRepo(MPool& pool,
@@ -46,71 +145,107 @@ namespace mamba
         : m_url(url)
     {
         m_repo = repo_create(pool, name.c_str());
+        m_repoid = m_repo->repoid;
+        pool.set_repo_channel(m_repo, url);
         read_file(filename);
+        pool.set_repo_state(m_repo, file_state(filename));
     }
 
     MRepo::MRepo(MPool& pool, const PrefixData& prefix_data)
     {
         m_repo = repo_create(pool, "installed");
+        m_repoid = m_repo->repoid;
+
         int flags = 0;
         Repodata* data;
         data = repo_add_repodata(m_repo, flags);
 
+        // the records are the whole input of this repo
+        std::stringstream state;
+        state << "prefix";
+
         for (auto& [name, record] : prefix_data.records())
         {
-            LOG_INFO << "Adding package record to repo " << name;
-            Id handle = repo_add_solvable(m_repo);
-            Solvable* s;
-            s = pool_id2solvable(pool, handle);
-            repodata_set_str(
-                data, handle, SOLVABLE_BUILDVERSION, std::to_string(record.build_number).c_str());
-            repodata_add_poolstr_array(
-                data, handle, SOLVABLE_BUILDFLAVOR, record.build_string.c_str());
-            s->name = pool_str2id(pool, record.name.c_str(), 1);
-            s->evr = pool_str2id(pool, record.version.c_str(), 1);
-
-            repodata_set_location(data, handle, 0, record.subdir.c_str(), record.fn.c_str());
-
-            if (!record.depends.empty())
+            state << "\n"
+                  << record.name << " " << record.version << " " << record.build_string << " "
+                  << record.build_number << " " << record.subdir << "/" << record.fn << " "
+                  << record.channel;
+            for (const auto& dep : record.depends)
             {
-                for (std::string dep : record.depends)
-                {
-                    Id dep_id = pool_conda_matchspec(pool, dep.c_str());
-                    if (dep_id)
-                    {
-                        s->requires = repo_addid_dep(m_repo, s->requires, dep_id, 0);
-                    }
-                }
+                state << " " << dep;
             }
-
-            if (!record.constrains.empty())
+            state << " |";
+            for (const auto& cst : record.constrains)
             {
-                for (std::string cst : record.constrains)
-                {
-                    Id constrains_id = pool_conda_matchspec(pool, cst.c_str());
-                    if (constrains_id)
-                    {
-                        repodata_add_idarray(data, handle, SOLVABLE_CONSTRAINS, constrains_id);
-                    }
-                }
+                state << " " << cst;
             }
 
-            s->provides = repo_addid_dep(
-                m_repo, s->provides, pool_rel2id(pool, s->name, s->evr, REL_EQ, 1), 0);
+            add_package_info(pool, data, record);
         }
         LOG_INFO << "Internalizing";
         repodata_internalize(data);
+        pool.set_repo_state(m_repo, state.str());
         set_installed();
     }
 
+    MRepo MRepo::from_conda_meta(MPool& pool, const fs::path& prefix)
+    {
+        MRepo repo(repo_create(pool, "installed"), "");
+        repo.read_conda_meta(pool, prefix / "conda-meta");
+        repo.set_installed();
+        return repo;
+    }
+
+    MRepo::MRepo(MPool& pool,
+                 const std::string& name,
+                 const std::vector<PackageInfo>& package_infos)
+    {
+        m_repo = repo_create(pool, name.c_str());
+        m_repoid = m_repo->repoid;
+        // the packages carry their own urls
+        m_url = name;
+        Repodata* data = repo_add_repodata(m_repo, 0);
+        Id real_repo_key = pool_str2id(pool, "solvable:real_repo_url", 1);
+
+        std::stringstream state;
+        state << "packages";
+
+        for (auto& info : package_infos)
+        {
+            state << "\n" << info.url << " " << info.md5 << " " << info.sha256;
+
+            Id handle = add_package_info(pool, data, info);
+            std::string repo_url = rsplit(info.url, "/", 1)[0];
+            repodata_set_str(data, handle, real_repo_key, repo_url.c_str());
+            repodata_set_num(data, handle, SOLVABLE_DOWNLOADSIZE, info.size);
+            if (!info.md5.empty())
+            {
+                repodata_set_checksum(
+                    data, handle, SOLVABLE_PKGID, REPOKEY_TYPE_MD5, info.md5.c_str());
+            }
+            if (!info.sha256.empty())
+            {
+                repodata_set_checksum(
+                    data, handle, SOLVABLE_CHECKSUM, REPOKEY_TYPE_SHA256, info.sha256.c_str());
+            }
+        }
+        repodata_internalize(data);
+        pool.set_repo_state(m_repo, state.str());
+    }
+
+    MRepo::MRepo(Repo* repo, const std::string& url)
+        : m_url(url)
+        , m_repoid(repo->repoid)
+        , m_repo(repo)
+    {
+    }
+
     MRepo::~MRepo()
     {
-        // not sure if reuse_ids is useful here
-        // repo will be freed with pool as well though
-        // maybe explicitly free pool for faster repo deletion as well
-        // TODO this is actually freed with the pool, and calling it here will cause
-        // segfaults. need to find a more clever way to do this. repo_free(m_repo,
-        // /*reuse_ids*/1);
+        // The repo is freed with its pool, which may be freed first (e.g. once a
+        // transaction is planned): the MRepo is then only a handle, whose url()
+        // and id() can still be used, but not repo() or anything reading the
+        // repo. Calling repo_free(m_repo, 1) here would free it twice.
     }
 
     void MRepo::set_installed()
@@ -139,6 +274,11 @@ namespace mamba
         return m_repo;
     }
 
+    Id MRepo::id() const
+    {
+        return m_repoid;
+    }
+
     std::tuple<int, int> MRepo::priority() const
     {
         return std::make_tuple(m_repo->priority, m_repo->subpriority);
@@ -149,6 +289,148 @@ namespace mamba
         return m_repo->nsolvables;
     }
 
+    Id MRepo::add_package_info(MPool& pool, Repodata* data, const PackageInfo& info)
+    {
+        LOG_INFO << "Adding package record to repo " << info.name;
+        Id handle = repo_add_solvable(m_repo);
+        Solvable* s;
+        s = pool_id2solvable(pool, handle);
+        repodata_set_str(
+            data, handle, SOLVABLE_BUILDVERSION, std::to_string(info.build_number).c_str());
+        repodata_add_poolstr_array(data, handle, SOLVABLE_BUILDFLAVOR, info.build_string.c_str());
+        s->name = pool_str2id(pool, info.name.c_str(), 1);
+        s->evr = pool_str2id(pool, info.version.c_str(), 1);
+
+        repodata_set_location(data, handle, 0, info.subdir.c_str(), info.fn.c_str());
+
+        for (const std::string& dep : info.depends)
+        {
+            Id dep_id = pool.matchspec(dep);
+            if (dep_id)
+            {
+                s->requires = repo_addid_dep(m_repo, s->requires, dep_id, 0);
+            }
+        }
+
+        for (const std::string& cst : info.constrains)
+        {
+            Id constrains_id = pool.matchspec(cst);
+            if (constrains_id)
+            {
+                repodata_add_idarray(data, handle, SOLVABLE_CONSTRAINS, constrains_id);
+            }
+        }
+
+        s->provides = repo_addid_dep(
+            m_repo, s->provides, pool_rel2id(pool, s->name, s->evr, REL_EQ, 1), 0);
+        return handle;
+    }
+
+    void MRepo::read_conda_meta(MPool& pool, const fs::path& conda_meta_dir)
+    {
+        // the size and mtime of every record, by file name
+        std::map<std::string, std::string> files;
+        if (lexists(conda_meta_dir))
+        {
+            for (auto& p : fs::directory_iterator(conda_meta_dir))
+            {
+                if (ends_with(p.path().c_str(), ".json"))
+                {
+                    std::error_code ec;
+                    auto size = fs::file_size(p.path(), ec);
+                    auto mtime = fs::last_write_time(p.path(), ec);
+                    files[p.path().filename().string()]
+                        = ec ? "" : concat(std::to_string(size),
+                                           " ",
+                                           std::to_string(mtime.time_since_epoch().count()));
+                }
+            }
+        }
+        std::stringstream state;
+        state << "conda-meta " << conda_meta_dir.string();
+        for (const auto& [fn, stamp] : files)
+        {
+            state << "\n" << fn << " " << stamp;
+        }
+        m_conda_meta_state = state.str();
+        m_solv_file = (conda_meta_dir / "installed.solv").string();
+
+        // the records of the cache that did not change are kept
+        Id file_key = pool_str2id(pool, "mamba:conda_meta_file", 1);
+        Id stamp_key = pool_str2id(pool, "mamba:conda_meta_stamp", 1);
+        std::set<std::string> cached;
+        bool changed = true;
+        FILE* fp = fopen(m_solv_file.c_str(), "rb");
+        if (fp && repo_add_solv(m_repo, fp, 0) == 0)
+        {
+            Repodata* meta = repo_last_repodata(m_repo);
+            const char* tool_version
+                = meta ? repodata_lookup_str(meta, SOLVID_META, REPOSITORY_TOOLVERSION) : nullptr;
+            if (tool_version && std::strcmp(tool_version, mamba_tool_version()) == 0)
+            {
+                Id pkg_id;
+                Solvable* pkg_s;
+                std::vector<Id> outdated;
+                FOR_REPO_SOLVABLES(m_repo, pkg_id, pkg_s)
+                {
+                    const char* fn = solvable_lookup_str(pkg_s, file_key);
+                    if (fn && files.count(fn) && !files[fn].empty()
+                        && check_char(solvable_lookup_str(pkg_s, stamp_key)) == files[fn])
+                    {
+                        cached.insert(fn);
+                    }
+                    else
+                    {
+                        outdated.push_back(pkg_id);
+                    }
+                }
+                for (Id id : outdated)
+                {
+                    repo_free_solvable(m_repo, id, /*reuseids*/ 0);
+                }
+                changed = !outdated.empty() || cached.size() != files.size();
+            }
+            else
+            {
+                LOG_INFO << "Rebuilding " << m_solv_file << " written by another version";
+                repo_empty(m_repo, /*reuseids*/ 0);
+            }
+        }
+        else
+        {
+            repo_empty(m_repo, /*reuseids*/ 0);
+        }
+        if (fp)
+        {
+            fclose(fp);
+        }
+
+        Repodata* data = repo_add_repodata(m_repo, 0);
+        for (const auto& [fn, stamp] : files)
+        {
+            if (cached.count(fn))
+            {
+                continue;
+            }
+            fs::path path = conda_meta_dir / fn;
+            LOG_INFO << "Loading package record header: " << path;
+            Id handle
+                = add_package_info(pool, data, PackageInfo(read_prefix_record_header(path)));
+            repodata_set_str(data, handle, file_key, fn.c_str());
+            repodata_set_str(data, handle, stamp_key, stamp.c_str());
+        }
+        repodata_internalize(data);
+        repo_internalize(m_repo);
+        LOG_INFO << "Installed packages: " << cached.size() << " from " << m_solv_file << ", "
+                 << files.size() - cached.size() << " from conda-meta";
+
+        if (changed && lexists(conda_meta_dir))
+        {
+            write();
+        }
+        pool.set_repo_state(m_repo, m_conda_meta_state);
+    }
+
     bool MRepo::read_file(const std::string& filename)
     {
         LOG_INFO << m_repo->name << ": reading repo file " << filename;
@@ -195,11 +477,13 @@ namespace mamba
                     Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
                     Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
                     Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
+                    Id sha256_id = pool_str2id(m_repo->pool, "mamba:sha256", 1);
 
                     const char* url = repodata_lookup_str(repodata, SOLVID_META, url_id);
                     int pip_added = repodata_lookup_num(repodata, SOLVID_META, pip_added_id, -1);
                     const char* etag = repodata_lookup_str(repodata, SOLVID_META, etag_id);
                     const char* mod = repodata_lookup_str(repodata, SOLVID_META, mod_id);
+                    const char* sha256 = repodata_lookup_str(repodata, SOLVID_META, sha256_id);
                     const char* tool_version
                         = repodata_lookup_str(repodata, SOLVID_META, REPOSITORY_TOOLVERSION);
                     bool metadata_valid
@@ -207,7 +491,9 @@ namespace mamba
 
                     if (metadata_valid)
                     {
-                        RepoMetadata read_metadata{ url, pip_added == 1, etag, mod };
+                        RepoMetadata read_metadata{
+                            url, pip_added == 1, etag, mod, sha256 ? sha256 : ""
+                        };
                         metadata_valid = (read_metadata == m_metadata)
                                          && (std::strcmp(tool_version, mamba_tool_version()) == 0);
                     }
@@ -237,7 +523,7 @@ namespace mamba
             fclose(fp);
         }
 
-        auto fp = fopen(m_json_file.c_str(), "r");
+        auto fp = open_decompressed(m_json_file);
         if (!fp)
         {
             throw std::runtime_error("Could not open repository file " + m_json_file);
@@ -245,40 +531,14 @@ namespace mamba
 
         LOG_INFO << "loading from json " << m_json_file;
         int ret = repo_add_conda(m_repo, fp, 0);
+        fclose(fp);
         if (ret != 0)
         {
             throw std::runtime_error("Could not read JSON repodata file (" + m_json_file + ") "
                                      + std::string(pool_errstr(m_repo->pool)));
         }
 
-        // TODO move this to a more structured approach for repodata patching?
-        if (Context::instance().add_pip_as_python_dependency)
-        {
-            Id pkg_id;
-            Solvable* pkg_s;
-            Id python = pool_str2id(m_repo->pool, "python", 0);
-            Id pip_dep = pool_conda_matchspec(m_repo->pool, "pip");
-            Id pip = pool_str2id(m_repo->pool, "pip", 0);
-            Id python_dep = pool_conda_matchspec(m_repo->pool, "python");
-
-            FOR_REPO_SOLVABLES(m_repo, pkg_id, pkg_s)
-            {
-                if (pkg_s->name == python)
-                {
-                    const char* version = pool_id2str(m_repo->pool, pkg_s->evr);
-                    if (version && version[0] >= '2')
-                    {
-                        pkg_s->requires = repo_addid_dep(m_repo, pkg_s->requires, pip_dep, 0);
-                    }
-                }
-                if (pkg_s->name == pip)
-                {
-                    pkg_s->requires = repo_addid_dep(
-                        m_repo, pkg_s->requires, python_dep, SOLVABLE_PREREQMARKER);
-                }
-            }
-        }
-
+        add_pip_as_python_dependency();
         repo_internalize(m_repo);
 
         if (name() != "installed")
@@ -289,6 +549,64 @@ namespace mamba
         return true;
     }
 
+    void MRepo::add_repodata(const std::string& repodata)
+    {
+        FILE* fp = std::tmpfile();
+        if (!fp || fwrite(repodata.data(), 1, repodata.size(), fp) != repodata.size())
+        {
+            if (fp)
+            {
+                fclose(fp);
+            }
+            throw std::runtime_error("Could not write repodata for " + m_url);
+        }
+        rewind(fp);
+        int ret = repo_add_conda(m_repo, fp, 0);
+        fclose(fp);
+        if (ret != 0)
+        {
+            throw std::runtime_error("Could not read repodata for " + m_url + " "
+                                     + std::string(pool_errstr(m_repo->pool)));
+        }
+    }
+
+    void MRepo::add_pip_as_python_dependency(Id start)
+    {
+        // TODO move this to a more structured approach for repodata patching?
+        if (!Context::instance().add_pip_as_python_dependency)
+        {
+            return;
+        }
+
+        Id pkg_id;
+        Solvable* pkg_s;
+        Id python = pool_str2id(m_repo->pool, "python", 0);
+        Id pip_dep = pool_conda_matchspec(m_repo->pool, "pip");
+        Id pip = pool_str2id(m_repo->pool, "pip", 0);
+        Id python_dep = pool_conda_matchspec(m_repo->pool, "python");
+
+        FOR_REPO_SOLVABLES(m_repo, pkg_id, pkg_s)
+        {
+            if (pkg_id < start)
+            {
+                continue;
+            }
+            if (pkg_s->name == python)
+            {
+                const char* version = pool_id2str(m_repo->pool, pkg_s->evr);
+                if (version && version[0] >= '2')
+                {
+                    pkg_s->requires = repo_addid_dep(m_repo, pkg_s->requires, pip_dep, 0);
+                }
+            }
+            if (pkg_s->name == pip)
+            {
+                pkg_s->requires = repo_addid_dep(
+                    m_repo, pkg_s->requires, python_dep, SOLVABLE_PREREQMARKER);
+            }
+        }
+    }
+
     bool MRepo::write() const
     {
         Repodata* info;
@@ -298,22 +616,47 @@ namespace mamba
         info = repo_add_repodata(m_repo, 0);  // add new repodata for our meta info
         repodata_set_str(info, SOLVID_META, REPOSITORY_TOOLVERSION, mamba_tool_version());
 
-        Id url_id = pool_str2id(m_repo->pool, "mamba:url", 1);
-        Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
-        Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
-        Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
-
-        repodata_set_str(info, SOLVID_META, url_id, m_metadata.url.c_str());
-        repodata_set_num(info, SOLVID_META, pip_added_id, m_metadata.pip_added);
-        repodata_set_str(info, SOLVID_META, etag_id, m_metadata.etag.c_str());
-        repodata_set_str(info, SOLVID_META, mod_id, m_metadata.mod.c_str());
+        if (!m_conda_meta_state.empty())
+        {
+            // the installed packages, see read_conda_meta
+            Id conda_meta_id = pool_str2id(m_repo->pool, "mamba:conda_meta", 1);
+            repodata_set_str(info, SOLVID_META, conda_meta_id, m_conda_meta_state.c_str());
+        }
+        else
+        {
+            Id url_id = pool_str2id(m_repo->pool, "mamba:url", 1);
+            Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
+            Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
+            Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
+            Id sha256_id = pool_str2id(m_repo->pool, "mamba:sha256", 1);
+
+            repodata_set_str(info, SOLVID_META, url_id, m_metadata.url.c_str());
+            repodata_set_num(info, SOLVID_META, pip_added_id, m_metadata.pip_added);
+            repodata_set_str(info, SOLVID_META, etag_id, m_metadata.etag.c_str());
+            repodata_set_str(info, SOLVID_META, mod_id, m_metadata.mod.c_str());
+            if (!m_metadata.sha256.empty())
+            {
+                repodata_set_str(info, SOLVID_META, sha256_id, m_metadata.sha256.c_str());
+            }
+        }
 
-        auto solv_f = fopen(m_solv_file.c_str(), "wb");
+        // written next to the target and renamed, other processes may be
+        // reading it (e.g. the installed packages of a prefix)
+        std::string tmp_file = m_solv_file + ".tmp";
+        auto solv_f = fopen(tmp_file.c_str(), "wb");
         repodata_internalize(info);
+        if (!solv_f)
+        {
+            LOG_WARNING << "Could not write " << m_solv_file;
+            repodata_free(info);
+            return false;
+        }
 
         if (repo_write(m_repo, solv_f) != 0)
         {
             LOG_ERROR << "Failed to write .solv:" << pool_errstr(m_repo->pool);
+            fclose(solv_f);
+            repodata_free(info);
             return false;
         }
 
@@ -321,18 +664,61 @@ namespace mamba
         {
             LOG_ERROR << "Failed to flush .solv file.";
             fclose(solv_f);
+            repodata_free(info);
             return false;
         }
 
         fclose(solv_f);
         repodata_free(info);  // delete meta info repodata again
+
+        std::error_code ec;
+        fs::rename(tmp_file, m_solv_file, ec);
+        if (ec)
+        {
+            LOG_WARNING << "Could not write " << m_solv_file << ": " << ec.message();
+            fs::remove(tmp_file, ec);
+            return false;
+        }
         return true;
     }
 
+    void MRepo::update_records(const std::set<std::string>& fns,
+                               const std::string& repodata,
+                               const RepoMetadata& metadata)
+    {
+        Id pkg_id;
+        Solvable* pkg_s;
+        std::vector<Id> outdated;
+        FOR_REPO_SOLVABLES(m_repo, pkg_id, pkg_s)
+        {
+            const char* fn = solvable_lookup_str(pkg_s, SOLVABLE_MEDIAFILE);
+            if (fn && fns.find(fn) != fns.end())
+            {
+                outdated.push_back(pkg_id);
+            }
+        }
+        for (Id id : outdated)
+        {
+            repo_free_solvable(m_repo, id, /*reuseids*/ 0);
+        }
+
+        // the new solvables are added at the end of the pool
+        Id start = m_repo->pool->nsolvables;
+        add_repodata(repodata);
+        add_pip_as_python_dependency(start);
+        repo_internalize(m_repo);
+
+        LOG_INFO << m_url << ": " << outdated.size() << " records removed, "
+                 << m_repo->pool->nsolvables - start << " added";
+        m_metadata = metadata;
+        write();
+    }
+
     bool MRepo::clear(bool reuse_ids = 1)
     {
         repo_free(m_repo, static_cast<int>(reuse_ids));
         m_repo = nullptr;
+        m_repoid = 0;
         return true;
     }
 }  // namespace mamba
@@ -0,0 +1,320 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <fstream>
+
+#include "mamba/context.hpp"
+#include "mamba/output.hpp"
+#include "mamba/package_handling.hpp"
+#include "mamba/repodata_index.hpp"
+#include "mamba/util.hpp"
+
+#include "nlohmann/json.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        // Text index followed by the records, grouped by package name:
+        //
+        //   mamba-repodata-index 1
+        //   <state of the repodata>
+        //   <info section of the repodata, as JSON>
+        //   <number of names>
+        //   <name>\t<offset>\t<size>\t<offset>\t<size>\t<dependency names>
+        //   ...
+        //   <records>
+        //
+        // The two ranges (relative to the start of the records) hold the
+        // `"fn": {record}` entries of "packages" and "packages.conda".
+        const std::string index_header = "mamba-repodata-index 1";
+
+        const std::vector<std::string> no_dependencies;
+    }  // namespace
+
+    std::string dependency_name(const std::string& dep)
+    {
+        std::string name(strip(dep));
+        return name.substr(0, name.find_first_of(" =<>!~["));
+    }
+
+    RepodataIndex::RepodataIndex(const fs::path& json_file, const std::string& state)
+        : m_json_file(json_file)
+        , m_index_file(index_path(json_file))
+        , m_state(state)
+    {
+    }
+
+    const fs::path& RepodataIndex::json_file() const
+    {
+        return m_json_file;
+    }
+
+    fs::path RepodataIndex::index_path(const fs::path& json_file)
+    {
+        fs::path res = json_file;
+        res.replace_extension(".names");
+        return res;
+    }
+
+    void RepodataIndex::load()
+    {
+        if (read_index())
+        {
+            return;
+        }
+        LOG_INFO << "Building repodata index " << m_index_file;
+        build();
+        if (!read_index())
+        {
+            throw std::runtime_error("Could not read repodata index " + m_index_file.string());
+        }
+    }
+
+    bool RepodataIndex::contains(const std::string& name) const
+    {
+        return m_names.find(name) != m_names.end();
+    }
+
+    const std::vector<std::string>& RepodataIndex::dependencies(const std::string& name) const
+    {
+        auto it = m_names.find(name);
+        return it != m_names.end() ? it->second.dependencies : no_dependencies;
+    }
+
+    std::string RepodataIndex::repodata(const std::set<std::string>& names) const
+    {
+        std::ifstream in(m_index_file, std::ios::in | std::ios::binary);
+        if (!in)
+        {
+            throw std::runtime_error("Could not open repodata index " + m_index_file.string());
+        }
+
+        auto read = [&](std::size_t offset, std::size_t size, std::string& out) {
+            if (size == 0)
+            {
+                return;
+            }
+            if (out.back() != '{')
+            {
+                out += ',';
+            }
+            std::size_t start = out.size();
+            out.resize(start + size);
+            in.seekg(m_data_offset + offset);
+            in.read(&out[start], size);
+        };
+
+        std::string packages = "{", conda_packages = "{";
+        for (const auto& name : names)
+        {
+            auto it = m_names.find(name);
+            if (it == m_names.end())
+            {
+                continue;
+            }
+            read(it->second.packages_offset, it->second.packages_size, packages);
+            read(it->second.conda_offset, it->second.conda_size, conda_packages);
+        }
+        if (!in)
+        {
+            throw std::runtime_error("Could not read repodata index " + m_index_file.string());
+        }
+
+        return concat("{\"info\":",
+                      m_info,
+                      ",\"packages\":",
+                      packages,
+                      "},\"packages.conda\":",
+                      conda_packages,
+                      "}}");
+    }
+
+    std::set<std::string> RepodataIndex::reachable(const std::vector<RepodataIndex*>& indexes,
+                                                   const std::vector<std::string>& roots)
+    {
+        bool add_pip = Context::instance().add_pip_as_python_dependency;
+        std::set<std::string> res;
+        std::vector<std::string> todo(roots.begin(), roots.end());
+        while (!todo.empty())
+        {
+            std::string name = std::move(todo.back());
+            todo.pop_back();
+            if (!res.insert(name).second)
+            {
+                continue;
+            }
+            for (auto* index : indexes)
+            {
+                for (const auto& dep : index->dependencies(name))
+                {
+                    if (res.find(dep) == res.end())
+                    {
+                        todo.push_back(dep);
+                    }
+                }
+            }
+            // see MRepo, python gets a dependency on pip
+            if (add_pip && name == "python")
+            {
+                todo.push_back("pip");
+            }
+        }
+        return res;
+    }
+
+    bool RepodataIndex::read_index()
+    {
+        m_names.clear();
+        std::ifstream in(m_index_file, std::ios::in | std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+
+        std::string line, state;
+        std::size_t count = 0;
+        if (!std::getline(in, line) || line != index_header || !std::getline(in, state)
+            || state != m_state || !std::getline(in, m_info) || !std::getline(in, line))
+        {
+            LOG_INFO << "Repodata index " << m_index_file << " is outdated";
+            return false;
+        }
+
+        try
+        {
+            count = std::stoul(line);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (!std::getline(in, line))
+                {
+                    return false;
+                }
+                auto fields = split(line, "\t");
+                if (fields.size() != 6)
+                {
+                    return false;
+                }
+                name_entry entry;
+                entry.packages_offset = std::stoul(fields[1]);
+                entry.packages_size = std::stoul(fields[2]);
+                entry.conda_offset = std::stoul(fields[3]);
+                entry.conda_size = std::stoul(fields[4]);
+                if (!fields[5].empty())
+                {
+                    entry.dependencies = split(fields[5], " ");
+                }
+                m_names.emplace(fields[0], std::move(entry));
+            }
+        }
+        catch (const std::logic_error&)
+        {
+            LOG_INFO << "Ignoring invalid repodata index " << m_index_file;
+            m_names.clear();
+            return false;
+        }
+
+        m_data_offset = static_cast<std::size_t>(in.tellg());
+        return true;
+    }
+
+    void RepodataIndex::build()
+    {
+        nlohmann::json j;
+        FILE* fp = open_decompressed(m_json_file);
+        if (!fp)
+        {
+            throw std::runtime_error("Could not open repository file " + m_json_file.string());
+        }
+        try
+        {
+            j = nlohmann::json::parse(fp);
+            fclose(fp);
+        }
+        catch (const std::exception& e)
+        {
+            fclose(fp);
+            throw std::runtime_error("Could not read JSON repodata file ("
+                                     + m_json_file.string() + ") " + e.what());
+        }
+
+        struct name_group
+        {
+            std::string packages, conda_packages;
+            std::set<std::string> dependencies;
+        };
+        std::map<std::string, name_group> groups;
+
+        for (const std::string section : { "packages", "packages.conda" })
+        {
+            if (!j.contains(section))
+            {
+                continue;
+            }
+            for (auto& [fn, record] : j[section].items())
+            {
+                std::string name = record.value("name", "");
+                if (name.empty())
+                {
+                    continue;
+                }
+                auto& group = groups[name];
+                std::string& out
+                    = section == "packages" ? group.packages : group.conda_packages;
+                if (!out.empty())
+                {
+                    out += ',';
+                }
+                out += nlohmann::json(fn).dump();
+                out += ':';
+                out += record.dump();
+
+                if (record.contains("depends"))
+                {
+                    for (const auto& dep : record["depends"])
+                    {
+                        group.dependencies.insert(dependency_name(dep.get<std::string>()));
+                    }
+                }
+            }
+        }
+
+        fs::path tmp_path = m_index_file;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::out | std::ios::binary);
+            out << index_header << '\n'
+                << m_state << '\n'
+                << j.value("info", nlohmann::json::object()).dump() << '\n'
+                << groups.size() << '\n';
+
+            std::size_t offset = 0;
+            for (const auto& [name, group] : groups)
+            {
+                out << name << '\t' << offset << '\t' << group.packages.size() << '\t'
+                    << offset + group.packages.size() << '\t' << group.conda_packages.size()
+                    << '\t';
+                std::string sep;
+                for (const auto& dep : group.dependencies)
+                {
+                    out << sep << dep;
+                    sep = " ";
+                }
+                out << '\n';
+                offset += group.packages.size() + group.conda_packages.size();
+            }
+            for (const auto& [name, group] : groups)
+            {
+                out << group.packages << group.conda_packages;
+            }
+            if (!out)
+            {
+                throw std::runtime_error("Could not write repodata index " + tmp_path.string());
+            }
+        }
+        fs::rename(tmp_path, m_index_file);
+    }
+}  // namespace mamba
@@ -0,0 +1,306 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <memory>
+#include <regex>
+
+#include "mamba/context.hpp"
+#include "mamba/fetch.hpp"
+#include "mamba/output.hpp"
+#include "mamba/package_handling.hpp"
+#include "mamba/repodata_index.hpp"
+#include "mamba/sharded_repodata.hpp"
+#include "mamba/util.hpp"
+
+#include "nlohmann/json.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        const std::vector<std::string> no_dependencies;
+
+        nlohmann::json read_json(const fs::path& file)
+        {
+            FILE* fp = open_decompressed(file);
+            if (!fp)
+            {
+                throw std::runtime_error("Could not open " + file.string());
+            }
+            try
+            {
+                auto j = nlohmann::json::parse(fp);
+                fclose(fp);
+                return j;
+            }
+            catch (const std::exception& e)
+            {
+                fclose(fp);
+                throw std::runtime_error("Could not read " + file.string() + ": " + e.what());
+            }
+        }
+
+        // the hashes end up in file names
+        bool is_sha256(const std::string& hash)
+        {
+            return hash.size() == 64
+                   && hash.find_first_not_of("0123456789abcdef") == std::string::npos;
+        }
+    }  // namespace
+
+    ShardedRepodata::ShardedRepodata(const fs::path& index_file,
+                                     const std::string& subdir_url,
+                                     const fs::path& shards_dir)
+        : m_index_file(index_file)
+        , m_shards_dir(shards_dir)
+    {
+        auto index = read_json(index_file);
+        auto info = index.value("info", nlohmann::json::object());
+        m_info = info.dump();
+
+        std::string base_url = info.value("shards_base_url", std::string("shards/"));
+        m_shards_url = base_url.find("://") != std::string::npos
+                           ? base_url
+                           : concat(subdir_url, "/", base_url);
+
+        auto shards = index.value("shards", nlohmann::json::object());
+        for (auto& [name, hash] : shards.items())
+        {
+            std::string hex = hash.get<std::string>();
+            if (!is_sha256(hex))
+            {
+                throw std::runtime_error("Invalid shard hash for " + name + " in "
+                                         + index_file.string());
+            }
+            m_hashes[name] = hex;
+        }
+    }
+
+    bool ShardedRepodata::is_index_url(const std::string& url)
+    {
+        return ends_with(url, "/repodata_shards.json");
+    }
+
+    bool ShardedRepodata::contains(const std::string& name) const
+    {
+        return m_hashes.find(name) != m_hashes.end();
+    }
+
+    const std::vector<std::string>& ShardedRepodata::dependencies(const std::string& name) const
+    {
+        auto it = m_shards.find(name);
+        return it != m_shards.end() ? it->second.dependencies : no_dependencies;
+    }
+
+    const fs::path& ShardedRepodata::index_file() const
+    {
+        return m_index_file;
+    }
+
+    fs::path ShardedRepodata::shard_path(const std::string& name) const
+    {
+        return m_shards_dir / (m_hashes.at(name) + ".json");
+    }
+
+    std::string ShardedRepodata::shard_url(const std::string& name) const
+    {
+        return concat(m_shards_url, m_hashes.at(name), ".json");
+    }
+
+    void ShardedRepodata::load_shard(const std::string& name)
+    {
+        auto j = read_json(shard_path(name));
+        shard& res = m_shards[name];
+        std::set<std::string> dependencies;
+        for (const std::string section : { "packages", "packages.conda" })
+        {
+            if (!j.contains(section))
+            {
+                continue;
+            }
+            std::string& out = section == "packages" ? res.packages : res.conda_packages;
+            for (auto& [fn, record] : j[section].items())
+            {
+                if (!out.empty())
+                {
+                    out += ',';
+                }
+                out += nlohmann::json(fn).dump();
+                out += ':';
+                out += record.dump();
+
+                if (record.contains("depends"))
+                {
+                    for (const auto& dep : record["depends"])
+                    {
+                        dependencies.insert(dependency_name(dep.get<std::string>()));
+                    }
+                }
+            }
+        }
+        res.dependencies.assign(dependencies.begin(), dependencies.end());
+    }
+
+    std::string ShardedRepodata::repodata(const std::set<std::string>& names) const
+    {
+        std::string packages, conda_packages;
+        auto append = [](std::string& out, const std::string& records) {
+            if (records.empty())
+            {
+                return;
+            }
+            if (!out.empty())
+            {
+                out += ',';
+            }
+            out += records;
+        };
+        for (const auto& name : names)
+        {
+            auto it = m_shards.find(name);
+            if (it == m_shards.end())
+            {
+                continue;
+            }
+            append(packages, it->second.packages);
+            append(conda_packages, it->second.conda_packages);
+        }
+        return concat("{\"info\":",
+                      m_info,
+                      ",\"packages\":{",
+                      packages,
+                      "},\"packages.conda\":{",
+                      conda_packages,
+                      "}}");
+    }
+
+    std::set<std::string> ShardedRepodata::fetch(const std::vector<ShardedRepodata*>& subdirs,
+                                                 const std::vector<std::string>& roots)
+    {
+        bool add_pip = Context::instance().add_pip_as_python_dependency;
+        std::vector<std::string> todo;
+        for (const auto& root : roots)
+        {
+            if (root.find('*') == std::string::npos)
+            {
+                todo.push_back(root);
+                continue;
+            }
+            // names with wildcards match the names of the index
+            std::string pattern;
+            for (char c : root)
+            {
+                if (c == '*')
+                {
+                    pattern += ".*";
+                    continue;
+                }
+                if (std::string("\\^$.|?+()[]{}").find(c) != std::string::npos)
+                {
+                    pattern += '\\';
+                }
+                pattern += c;
+            }
+            std::regex re(pattern);
+            for (auto* subdir : subdirs)
+            {
+                for (const auto& [name, hash] : subdir->m_hashes)
+                {
+                    if (std::regex_match(name, re))
+                    {
+                        todo.push_back(name);
+                    }
+                }
+            }
+        }
+
+        std::set<std::string> res;
+        while (!todo.empty())
+        {
+            std::set<std::string> level;
+            for (auto& name : todo)
+            {
+                if (res.insert(name).second)
+                {
+                    level.insert(name);
+                }
+            }
+            todo.clear();
+
+            // the shards of this level that are not cached yet
+            MultiDownloadTarget multi_dl;
+            std::vector<std::unique_ptr<DownloadTarget>> targets;
+            std::vector<fs::path> paths;
+            for (auto* subdir : subdirs)
+            {
+                for (const auto& name : level)
+                {
+                    if (!subdir->contains(name) || fs::exists(subdir->shard_path(name)))
+                    {
+                        continue;
+                    }
+                    fs::create_directories(subdir->m_shards_dir);
+                    fs::path path = subdir->shard_path(name);
+                    paths.push_back(path);
+                    targets.push_back(std::make_unique<DownloadTarget>(
+                        name, subdir->shard_url(name), path.string() + ".part"));
+                    targets.back()->set_ignore_failure(true);
+                    multi_dl.add(targets.back().get());
+                }
+            }
+            if (!targets.empty())
+            {
+                LOG_INFO << "Fetching " << targets.size() << " repodata shards";
+                multi_dl.download(false);
+            }
+            for (std::size_t i = 0; i < targets.size(); ++i)
+            {
+                auto& target = targets[i];
+                fs::path part = paths[i].string() + ".part";
+                bool ok = target->result == 0
+                          && (target->http_status == 200 || target->http_status == 0);
+                // content-addressed, the file name is the hash
+                if (ok && validate::sha256sum(part.string()) != paths[i].stem().string())
+                {
+                    LOG_WARNING << "Invalid repodata shard " << target->url();
+                    ok = false;
+                }
+                if (!ok)
+                {
+                    fs::remove(part);
+                    throw std::runtime_error("Could not fetch the repodata shard of "
+                                             + target->name() + " from " + target->url());
+                }
+                fs::rename(part, paths[i]);
+            }
+
+            for (auto* subdir : subdirs)
+            {
+                for (const auto& name : level)
+                {
+                    if (!subdir->contains(name))
+                    {
+                        continue;
+                    }
+                    subdir->load_shard(name);
+                    for (const auto& dep : subdir->dependencies(name))
+                    {
+                        if (res.find(dep) == res.end())
+                        {
+                            todo.push_back(dep);
+                        }
+                    }
+                }
+            }
+            // see MRepo, python gets a dependency on pip
+            if (add_pip && level.find("python") != level.end())
+            {
+                todo.push_back("pip");
+            }
+        }
+        return res;
+    }
+}  // namespace mamba
@@ -4,25 +4,572 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+
 #include "mamba/solver.hpp"
-#include "mamba/channel.hpp"
 #include "mamba/output.hpp"
 #include "mamba/package_info.hpp"
+#include "mamba/thread_utils.hpp"
 #include "mamba/util.hpp"
+#include "mamba/validate.hpp"
+
+#include "nlohmann/json.hpp"
+
+extern "C"
+{
+#include "solv/repo_solv.h"
+#include "solv/repo_write.h"
+#include "solv/solv_xfopen.h"
+}
 
 namespace mamba
 {
+    namespace
+    {
+        // bump when the cache key or the stored solution changes
+        const std::string solution_cache_version = "1";
+
+        std::string solvable_build(Solvable* s)
+        {
+            return check_char(solvable_lookup_str(s, SOLVABLE_BUILDFLAVOR));
+        }
+
+        std::string solvable_build_number(Solvable* s)
+        {
+            return check_char(solvable_lookup_str(s, SOLVABLE_BUILDVERSION));
+        }
+
+        // repo ids are part of the identity, the cache key pins the order of
+        // the repos in the pool
+        std::string solvable_identity(Pool* pool, Id p)
+        {
+            Solvable* s = pool_id2solvable(pool, p);
+            return concat(std::to_string(s->repo ? s->repo->repoid : 0),
+                          ":",
+                          pool_id2str(pool, s->name),
+                          "-",
+                          pool_id2str(pool, s->evr),
+                          "-",
+                          solvable_build(s),
+                          "-",
+                          solvable_build_number(s));
+        }
+
+        template <class F>
+        void for_each_job_solvable(Pool* pool, Id how, Id what, F&& func)
+        {
+            switch (how & SOLVER_SELECTMASK)
+            {
+                case SOLVER_SOLVABLE:
+                    func(what);
+                    break;
+                case SOLVER_SOLVABLE_NAME:
+                case SOLVER_SOLVABLE_PROVIDES:
+                    for (Id* wp = pool_whatprovides_ptr(pool, what); *wp; wp++)
+                    {
+                        func(*wp);
+                    }
+                    break;
+                case SOLVER_SOLVABLE_ONE_OF:
+                    for (Id* wp = pool->whatprovidesdata + what; *wp; wp++)
+                    {
+                        func(*wp);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // a dependency, independent of the pool it comes from
+        struct dep_tree
+        {
+            std::string str;
+            // the relation of a reldep, with the trees of its name and evr
+            int flags = 0;
+            std::vector<dep_tree> args;
+        };
+
+        dep_tree to_dep_tree(Pool* pool, Id dep)
+        {
+            dep_tree res;
+            if (ISRELDEP(dep))
+            {
+                Reldep* rd = GETRELDEP(pool, dep);
+                res.flags = rd->flags;
+                res.args.push_back(to_dep_tree(pool, rd->name));
+                res.args.push_back(to_dep_tree(pool, rd->evr));
+            }
+            else
+            {
+                res.str = pool_id2str(pool, dep);
+            }
+            return res;
+        }
+
+        Id from_dep_tree(Pool* pool, const dep_tree& dep)
+        {
+            if (dep.args.empty())
+            {
+                return pool_str2id(pool, dep.str.c_str(), 1);
+            }
+            return pool_rel2id(pool,
+                               from_dep_tree(pool, dep.args[0]),
+                               from_dep_tree(pool, dep.args[1]),
+                               dep.flags,
+                               1);
+        }
+
+        // a job, with the solvables numbered as in the clones of the pool
+        struct clone_job
+        {
+            Id how = 0;
+            dep_tree dep;
+            std::vector<Id> solvables;
+            Id what = 0;
+        };
+
+        // the repos of a pool as .solv data, from which clones of the pool are
+        // created in other threads (which only use plain libsolv)
+        struct pool_clone
+        {
+            struct repo_entry
+            {
+                std::string name;
+                long offset, size;
+                int priority, subpriority;
+                bool installed;
+                Id start;
+                int nsolvables;
+            };
+
+            std::string solv_data;
+            std::vector<repo_entry> repos;
+            std::size_t nsolvables = 0;
+            // by solvable of the clones, empty if all are considered
+            std::vector<char> considered;
+            // the solvables of the clones are numbered in the order of the repos
+            std::vector<Id> to_clone;
+            std::vector<Id> from_clone;
+        };
+
+        // restricts `considered` (by solvable of the clones) to a map of the pool
+        void add_considered(const pool_clone& clone, std::vector<char>& considered, const Map* map)
+        {
+            considered.resize(clone.nsolvables, 1);
+            for (std::size_t i = 2; i < clone.from_clone.size(); ++i)
+            {
+                considered[i] = considered[i] && MAPTST(map, clone.from_clone[i]);
+            }
+        }
+
+        bool write_pool_clone(Pool* pool, pool_clone& clone)
+        {
+            FILE* data = std::tmpfile();
+            if (!data)
+            {
+                return false;
+            }
+            clone.to_clone.assign(pool->nsolvables, 0);
+            clone.from_clone = { 0, SYSTEMSOLVABLE };
+            Id repoid;
+            Repo* repo;
+            FOR_REPOS(repoid, repo)
+            {
+                long start = ftell(data);
+                if (repo_write(repo, data) != 0)
+                {
+                    LOG_WARNING << "Could not clone the pool: " << pool_errstr(pool);
+                    fclose(data);
+                    return false;
+                }
+                pool_clone::repo_entry entry;
+                entry.name = repo->name ? repo->name : "";
+                entry.offset = start;
+                entry.size = ftell(data) - start;
+                entry.priority = repo->priority;
+                entry.subpriority = repo->subpriority;
+                entry.installed = repo == pool->installed;
+                entry.start = clone.from_clone.size();
+                entry.nsolvables = repo->nsolvables;
+                clone.repos.push_back(entry);
+
+                Id p;
+                Solvable* s;
+                FOR_REPO_SOLVABLES(repo, p, s)
+                {
+                    clone.to_clone[p] = clone.from_clone.size();
+                    clone.from_clone.push_back(p);
+                }
+            }
+            clone.nsolvables = clone.from_clone.size();
+
+            clone.solv_data.resize(ftell(data));
+            rewind(data);
+            std::size_t read = fread(&clone.solv_data[0], 1, clone.solv_data.size(), data);
+            fclose(data);
+            if (read != clone.solv_data.size())
+            {
+                return false;
+            }
+            if (pool->considered)
+            {
+                add_considered(clone, clone.considered, pool->considered);
+            }
+            return true;
+        }
+
+        // the clone considers the solvables of `considered` through the given
+        // map, see free_pool_clone
+        Pool* create_pool_clone(const pool_clone& clone,
+                                const std::vector<char>& considered,
+                                Map* considered_map)
+        {
+            Pool* pool = pool_create();
+            pool_setdisttype(pool, DISTTYPE_CONDA);
+            bool cloned = true;
+            for (const auto& entry : clone.repos)
+            {
+                Repo* repo = repo_create(pool, entry.name.c_str());
+                FILE* fp = solv_fmemopen(clone.solv_data.data() + entry.offset, entry.size, "r");
+                cloned = cloned && fp && repo_add_solv(repo, fp, 0) == 0;
+                if (fp)
+                {
+                    fclose(fp);
+                }
+                cloned = cloned && repo->nsolvables == entry.nsolvables
+                         && (entry.nsolvables == 0 || repo->start == entry.start);
+                repo_internalize(repo);
+                repo->priority = entry.priority;
+                repo->subpriority = entry.subpriority;
+                if (entry.installed)
+                {
+                    pool_set_installed(pool, repo);
+                }
+            }
+            map_init(considered_map, pool->nsolvables);
+            if (!cloned || static_cast<std::size_t>(pool->nsolvables) != clone.nsolvables)
+            {
+                map_free(considered_map);
+                pool_free(pool);
+                return nullptr;
+            }
+
+            if (!considered.empty())
+            {
+                for (std::size_t p = 0; p < considered.size(); ++p)
+                {
+                    if (considered[p])
+                    {
+                        MAPSET(considered_map, p);
+                    }
+                }
+                pool->considered = considered_map;
+            }
+            pool_createwhatprovides(pool);
+            return pool;
+        }
+
+        void free_pool_clone(Pool* pool, Map* considered_map)
+        {
+            pool->considered = nullptr;
+            map_free(considered_map);
+            pool_free(pool);
+        }
+
+        std::vector<clone_job> export_jobs(Pool* pool, const Queue& jobs, const pool_clone& clone)
+        {
+            std::vector<clone_job> res;
+            for (int i = 0; i < jobs.count; i += 2)
+            {
+                clone_job job;
+                job.how = jobs.elements[i];
+                Id what = jobs.elements[i + 1];
+                switch (job.how & SOLVER_SELECTMASK)
+                {
+                    case SOLVER_SOLVABLE_NAME:
+                    case SOLVER_SOLVABLE_PROVIDES:
+                        job.dep = to_dep_tree(pool, what);
+                        break;
+                    case SOLVER_SOLVABLE:
+                    case SOLVER_SOLVABLE_ONE_OF:
+                        for_each_job_solvable(pool, job.how, what, [&](Id p) {
+                            job.solvables.push_back(clone.to_clone[p]);
+                        });
+                        break;
+                    case SOLVER_SOLVABLE_REPO:
+                    {
+                        // the repo ids of the clones follow the order of the repos
+                        Id clone_repoid = 1;
+                        Id repoid;
+                        Repo* repo;
+                        FOR_REPOS(repoid, repo)
+                        {
+                            if (repoid == what)
+                            {
+                                job.what = clone_repoid;
+                            }
+                            ++clone_repoid;
+                        }
+                        break;
+                    }
+                    default:
+                        job.what = what;
+                        break;
+                }
+                res.push_back(std::move(job));
+            }
+            return res;
+        }
+
+        void import_jobs(Pool* pool, const std::vector<clone_job>& jobs, bool reversed, Queue* res)
+        {
+            Queue selected;
+            queue_init(&selected);
+            for (std::size_t i = 0; i < jobs.size(); ++i)
+            {
+                const auto& job = jobs[reversed ? jobs.size() - 1 - i : i];
+                Id what = job.what;
+                switch (job.how & SOLVER_SELECTMASK)
+                {
+                    case SOLVER_SOLVABLE_NAME:
+                    case SOLVER_SOLVABLE_PROVIDES:
+                        what = from_dep_tree(pool, job.dep);
+                        break;
+                    case SOLVER_SOLVABLE:
+                        what = job.solvables.empty() ? 0 : job.solvables.front();
+                        break;
+                    case SOLVER_SOLVABLE_ONE_OF:
+                        queue_empty(&selected);
+                        for (Id p : job.solvables)
+                        {
+                            queue_push(&selected, p);
+                        }
+                        what = pool_queuetowhatprovides(pool, &selected);
+                        break;
+                    default:
+                        break;
+                }
+                queue_push2(res, job.how, what);
+            }
+            queue_free(&selected);
+        }
+
+        // installed packages that are removed are negative in the decisions
+        bool solve_clone(Pool* pool,
+                         const std::vector<clone_job>& clone_jobs,
+                         const std::vector<std::pair<int, int>>& flags,
+                         bool reversed_jobs,
+                         int focus,
+                         std::vector<Id>& decisions)
+        {
+            Queue jobs;
+            queue_init(&jobs);
+            import_jobs(pool, clone_jobs, reversed_jobs, &jobs);
+
+            Solver* solver = solver_create(pool);
+            for (const auto& [flag, value] : flags)
+            {
+                solver_set_flag(solver, flag, value);
+            }
+            if (focus)
+            {
+                solver_set_flag(solver, focus, 1);
+            }
+            solver_solve(solver, &jobs);
+            bool success = solver_problem_count(solver) == 0;
+            if (success)
+            {
+                Queue q;
+                queue_init(&q);
+                solver_get_decisionqueue(solver, &q);
+                Map chosen;
+                map_init(&chosen, pool->nsolvables);
+                for (int i = 0; i < q.count; ++i)
+                {
+                    Id p = q.elements[i];
+                    if (p > SYSTEMSOLVABLE && pool->solvables[p].repo)
+                    {
+                        decisions.push_back(p);
+                        MAPSET(&chosen, p);
+                    }
+                }
+                queue_free(&q);
+                if (pool->installed)
+                {
+                    Id p;
+                    Solvable* s;
+                    FOR_REPO_SOLVABLES(pool->installed, p, s)
+                    {
+                        if (!MAPTST(&chosen, p))
+                        {
+                            decisions.push_back(-p);
+                        }
+                    }
+                }
+                map_free(&chosen);
+            }
+            solver_free(solver);
+            queue_free(&jobs);
+            return success;
+        }
+
+        void from_clone_decisions(const pool_clone& clone,
+                                  const std::vector<Id>& decisions,
+                                  Queue* res)
+        {
+            queue_empty(res);
+            for (Id p : decisions)
+            {
+                queue_push(res, p > 0 ? clone.from_clone[p] : -clone.from_clone[-p]);
+            }
+        }
+
+        struct solver_config
+        {
+            std::string name;
+            bool reversed_jobs;
+            // a SOLVER_FLAG_FOCUS_* flag, 0 for the default focus
+            int focus;
+            bool strict_priority;
+        };
+
+        // the first ones win the ties
+        const std::vector<solver_config> portfolio_configs
+            = { { "default", false, 0, false },
+                { "strict-priority", false, 0, true },
+                { "focus-best", false, SOLVER_FLAG_FOCUS_BEST, false },
+                { "reversed-jobs", true, 0, false },
+                { "focus-installed", false, SOLVER_FLAG_FOCUS_INSTALLED, false },
+                { "focus-new", false, SOLVER_FLAG_FOCUS_NEW, false },
+                { "strict-priority-focus-best", false, SOLVER_FLAG_FOCUS_BEST, true },
+                { "reversed-jobs-focus-best", true, SOLVER_FLAG_FOCUS_BEST, false } };
+
+        // shared with the portfolio threads: the ones that are not taken may
+        // outlive the solver
+        // a solution waits at least this long for the configurations before it
+        constexpr std::chrono::milliseconds portfolio_min_grace(10);
+
+        struct portfolio
+        {
+            enum status_type
+            {
+                running,
+                solved,
+                failed
+            };
+
+            pool_clone clone;
+            std::vector<clone_job> jobs;
+            std::vector<std::pair<int, int>> flags;
+            std::vector<char> strict_considered;
+
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::atomic<bool> cancelled{ false };
+            std::vector<status_type> status;
+            std::vector<std::vector<Id>> decisions;
+        };
+
+        void run_portfolio_config(std::shared_ptr<portfolio> state,
+                                  std::size_t index,
+                                  const solver_config& config)
+        {
+            std::vector<Id> decisions;
+            bool success = false;
+            if (!state->cancelled)
+            {
+                Map considered;
+                Pool* pool = create_pool_clone(
+                    state->clone,
+                    config.strict_priority ? state->strict_considered : state->clone.considered,
+                    &considered);
+                // building the clone is a good part of the work, the solve
+                // itself cannot be interrupted
+                if (pool && !state->cancelled)
+                {
+                    success = solve_clone(pool,
+                                          state->jobs,
+                                          state->flags,
+                                          config.reversed_jobs,
+                                          config.focus,
+                                          decisions);
+                }
+                if (pool)
+                {
+                    free_pool_clone(pool, &considered);
+                }
+            }
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->status[index] = success ? portfolio::solved : portfolio::failed;
+            state->decisions[index] = std::move(decisions);
+            state->cv.notify_all();
+        }
+
+        // the job sets of a batch, taken in turn by the threads
+        struct batch
+        {
+            pool_clone clone;
+            std::vector<std::vector<clone_job>> jobs;
+            std::vector<std::vector<std::pair<int, int>>> flags;
+
+            std::atomic<std::size_t> next{ 0 };
+            std::vector<char> solved;
+            std::vector<std::vector<Id>> decisions;
+        };
+
+        void run_batch(batch& state)
+        {
+            // the whatprovides of the clone serve all the job sets of the thread
+            auto start = std::chrono::steady_clock::now();
+            Map considered;
+            Pool* pool = create_pool_clone(state.clone, state.clone.considered, &considered);
+            if (!pool)
+            {
+                return;
+            }
+            LOG_INFO << "Pool clone created in "
+                     << std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count()
+                     << " ms";
+            for (std::size_t i = state.next++; i < state.jobs.size(); i = state.next++)
+            {
+                state.solved[i] = solve_clone(
+                    pool, state.jobs[i], state.flags[i], false, 0, state.decisions[i]);
+            }
+            free_pool_clone(pool, &considered);
+        }
+
+        // the repos of a channel are selected once, the solvables are then
+        // matched by repo id
+        bool channel_match(const Map* repos, Solvable* s)
+        {
+            return s->repo && MAPTST(repos, s->repo->repoid);
+        }
+    }  // namespace
+
     MSolver::MSolver(MPool& pool,
                      const std::vector<std::pair<int, int>>& flags,
                      const PrefixData* prefix_data)
         : m_flags(flags)
         , m_is_solved(false)
         , m_solver(nullptr)
+        , m_mpool(pool)
         , m_pool(pool)
         , m_prefix_data(prefix_data)
     {
         queue_init(&m_jobs);
-        pool_createwhatprovides(pool);
+        queue_init(&m_decisions);
+        queue_init(&m_batch_decisions);
+        pool.create_whatprovides();
     }
 
     MSolver::~MSolver()
@@ -32,17 +579,8 @@ namespace mamba
         {
             solver_free(m_solver);
         }
-    }
-
-    inline bool channel_match(Solvable* s, const std::string& channel)
-    {
-        // TODO this could should be a lot better.
-        // TODO this might match too much (e.g. bioconda would also match
-        // bioconda-experimental etc) Note: s->repo->name is the URL of the repo
-        // TODO maybe better to check all repos, select pointers, and compare the
-        // pointer (s->repo == ptr?)
-        Channel& chan = make_channel(s->repo->name);
-        return chan.url(false).find(channel) != std::string::npos;
+        queue_free(&m_decisions);
+        queue_free(&m_batch_decisions);
     }
 
     void MSolver::add_channel_specific_job(const MatchSpec& ms, int job_flag)
@@ -51,16 +589,21 @@ namespace mamba
         Queue selected_pkgs;
         queue_init(&selected_pkgs);
 
+        Map repos;
+        map_init(&repos, pool->nrepos);
+        m_mpool.select_channel_repos(ms.channel, &repos);
+
         // conda_build_form does **NOT** contain the channel info
-        Id match = pool_conda_matchspec(pool, ms.conda_build_form().c_str());
+        Id match = m_mpool.matchspec(ms.conda_build_form());
 
         for (Id* wp = pool_whatprovides_ptr(pool, match); *wp; wp++)
         {
-            if (channel_match(pool_id2solvable(pool, *wp), ms.channel))
+            if (channel_match(&repos, pool_id2solvable(pool, *wp)))
             {
                 queue_push(&selected_pkgs, *wp);
             }
         }
+        map_free(&repos);
         if (selected_pkgs.count == 0)
         {
             LOG_ERROR << "Selected channel specific (or force-reinstall) job, but "
@@ -123,8 +666,7 @@ namespace mamba
                 }
             }
         }
-        Id inst_id
-            = pool_conda_matchspec(reinterpret_cast<Pool*>(m_pool), ms.conda_build_form().c_str());
+        Id inst_id = m_mpool.matchspec(ms.conda_build_form());
         queue_push2(&m_jobs, job_flag | SOLVER_SOLVABLE_PROVIDES, inst_id);
     }
 
@@ -164,8 +706,7 @@ namespace mamba
             {
                 // Todo remove double parsing?
                 LOG_INFO << "Adding job: " << ms.conda_build_form() << std::endl;
-                Id inst_id = pool_conda_matchspec(reinterpret_cast<Pool*>(m_pool),
-                                                  ms.conda_build_form().c_str());
+                Id inst_id = m_mpool.matchspec(ms.conda_build_form());
                 queue_push2(&m_jobs, job_flag | SOLVER_SOLVABLE_PROVIDES, inst_id);
             }
         }
@@ -174,8 +715,7 @@ namespace mamba
     void MSolver::add_constraint(const std::string& job)
     {
         MatchSpec ms(job);
-        Id inst_id
-            = pool_conda_matchspec(reinterpret_cast<Pool*>(m_pool), ms.conda_build_form().c_str());
+        Id inst_id = m_mpool.matchspec(ms.conda_build_form());
         queue_push2(&m_jobs, SOLVER_INSTALL | SOLVER_SOLVABLE_PROVIDES, inst_id);
     }
 
@@ -209,46 +749,52 @@ namespace mamba
         //     }
         // }
 
-        Id match = pool_conda_matchspec(pool, ms.conda_build_form().c_str());
+        Id match = m_mpool.matchspec(ms.conda_build_form());
 
-        std::set<Id> matching_solvables;
-        for (Id* wp = pool_whatprovides_ptr(pool, match); *wp; wp++)
+        Map repos;
+        map_init(&repos, pool->nrepos);
+        if (!ms.channel.empty())
         {
-            if (!ms.channel.empty())
-            {
-                if (!channel_match(pool_id2solvable(pool, *wp), ms.channel))
-                {
-                    continue;
-                }
-            }
-            matching_solvables.insert(*wp);
+            m_mpool.select_channel_repos(ms.channel, &repos);
         }
 
-        std::set<Id> all_solvables;
-        Id name_id = pool_str2id(pool, ms.name.c_str(), 1);
-        for (Id* wp = pool_whatprovides_ptr(pool, name_id); *wp; wp++)
-        {
-            all_solvables.insert(*wp);
-        }
-
-        if (all_solvables.size() != 0 && matching_solvables.size() == 0)
+        Map matching_solvables;
+        map_init(&matching_solvables, pool->nsolvables);
+        bool any_match = false;
+        for (Id* wp = pool_whatprovides_ptr(pool, match); *wp; wp++)
         {
-            LOG_ERROR << "No package can be installed for pin: " << job;
-            exit(1);
+            if (!ms.channel.empty() && !channel_match(&repos, pool_id2solvable(pool, *wp)))
+            {
+                continue;
+            }
+            MAPSET(&matching_solvables, *wp);
+            any_match = true;
         }
+        map_free(&repos);
 
         Queue selected_pkgs;
         queue_init(&selected_pkgs);
 
-        for (auto& id : all_solvables)
+        bool any_solvable = false;
+        Id name_id = pool_str2id(pool, ms.name.c_str(), 1);
+        for (Id* wp = pool_whatprovides_ptr(pool, name_id); *wp; wp++)
         {
-            if (matching_solvables.find(id) == matching_solvables.end())
+            any_solvable = true;
+            if (!MAPTST(&matching_solvables, *wp))
             {
                 // the solvable is _NOT_ matched by our pinning expression! So we have to
                 // lock it to make it un-installable
-                queue_push(&selected_pkgs, id);
+                queue_push(&selected_pkgs, *wp);
             }
         }
+        map_free(&matching_solvables);
+
+        if (any_solvable && !any_match)
+        {
+            queue_free(&selected_pkgs);
+            LOG_ERROR << "No package can be installed for pin: " << job;
+            exit(1);
+        }
 
         Id d = pool_queuetowhatprovides(pool, &selected_pkgs);
         queue_push2(&m_jobs, SOLVER_LOCK | SOLVER_SOLVABLE_ONE_OF, d);
@@ -270,6 +816,9 @@ namespace mamba
                 case MAMBA_FORCE_REINSTALL:
                     force_reinstall = option.second;
                     break;
+                case MAMBA_FREEZE_INSTALLED:
+                    freeze_installed = option.second;
+                    break;
             }
         }
     }
@@ -297,20 +846,694 @@ namespace mamba
         return m_remove_specs;
     }
 
+    void MSolver::set_solution_cache(const fs::path& cache_dir)
+    {
+        m_solution_cache_dir = cache_dir / "solutions";
+    }
+
+    bool MSolver::solution_from_cache() const
+    {
+        return m_from_cache;
+    }
+
     bool MSolver::solve()
     {
         bool success;
-        m_solver = solver_create(m_pool);
-        set_flags(m_flags);
+        std::string cache_key;
+        if (!m_solution_cache_dir.empty())
+        {
+            cache_key = solution_cache_key();
+            if (!cache_key.empty() && load_cached_solution(cache_key))
+            {
+                LOG_INFO << "Using cached solution " << cache_key;
+                m_from_cache = true;
+                m_is_solved = true;
+                JsonLogger::instance().json_write({ { "success", true } });
+                return true;
+            }
+        }
 
-        solver_solve(m_solver, &m_jobs);
+        int unlocked_jobs = m_jobs.count;
+        bool locked = freeze_installed && add_freeze_installed_job();
+        success = solve_jobs();
+        if (!success && locked)
+        {
+            LOG_INFO << "Could not solve with the installed packages locked, retrying";
+            queue_truncate(&m_jobs, unlocked_jobs);
+            success = solve_jobs();
+        }
+        if (!success && m_solver == nullptr)
+        {
+            // the problems are reported by a solver of the pool itself
+            run_solver();
+        }
         m_is_solved = true;
-        LOG_INFO << "Problem count: " << solver_problem_count(m_solver) << std::endl;
-        success = solver_problem_count(m_solver) == 0;
+        LOG_INFO << "Problem count: " << (m_solver ? solver_problem_count(m_solver) : 0)
+                 << std::endl;
         JsonLogger::instance().json_write({ { "success", success } });
+
+        if (success && !cache_key.empty())
+        {
+            Queue decisions;
+            if (m_solver)
+            {
+                queue_init(&decisions);
+                solver_get_decisionqueue(m_solver, &decisions);
+            }
+            else
+            {
+                queue_init_clone(&decisions, &m_decisions);
+            }
+            store_solution(cache_key, decisions);
+            queue_free(&decisions);
+        }
         return success;
     }
 
+    bool MSolver::solve_jobs()
+    {
+        if (m_solver != nullptr)
+        {
+            solver_free(m_solver);
+            m_solver = nullptr;
+        }
+        m_portfolio_winner.clear();
+        if (!m_batch_jobs.empty() && m_batch_jobs == jobs_key())
+        {
+            queue_empty(&m_decisions);
+            queue_insertn(&m_decisions, 0, m_batch_decisions.count, m_batch_decisions.elements);
+            return true;
+        }
+        if (m_portfolio_size > 1)
+        {
+            return solve_portfolio();
+        }
+        run_solver();
+        return solver_problem_count(m_solver) == 0;
+    }
+
+    void MSolver::run_solver()
+    {
+        m_solver = solver_create(m_pool);
+        set_flags(m_flags);
+        solver_solve(m_solver, &m_jobs);
+    }
+
+    void MSolver::set_portfolio(std::size_t size)
+    {
+        m_portfolio_size = std::min(size, portfolio_configs.size());
+    }
+
+    const std::string& MSolver::portfolio_winner() const
+    {
+        return m_portfolio_winner;
+    }
+
+    bool MSolver::solve_portfolio()
+    {
+        Pool* pool = m_pool;
+        thread_pool& tasks = thread_pool::global();
+        auto state = std::make_shared<portfolio>();
+        // a task of the pool waiting for the configurations could hold the
+        // worker one of them needs
+        if (tasks.in_worker() || !write_pool_clone(pool, state->clone))
+        {
+            LOG_WARNING << "Solving without portfolio";
+            run_solver();
+            return solver_problem_count(m_solver) == 0;
+        }
+        state->jobs = export_jobs(pool, m_jobs, state->clone);
+        state->flags = m_flags;
+
+        // see MPool::prune_lower_priority
+        std::set<std::string> channel_specific;
+        for (const auto& ms : m_install_specs)
+        {
+            if (!ms.channel.empty())
+            {
+                channel_specific.insert(ms.name);
+            }
+        }
+        Map higher_priority;
+        map_init(&higher_priority, pool->nsolvables);
+        m_mpool.select_higher_priority(channel_specific, &higher_priority);
+        state->strict_considered = state->clone.considered;
+        add_considered(state->clone, state->strict_considered, &higher_priority);
+        map_free(&higher_priority);
+
+        LOG_INFO << "Solving with a portfolio of " << m_portfolio_size << " configurations";
+        state->status.assign(m_portfolio_size, portfolio::running);
+        state->decisions.resize(m_portfolio_size);
+        for (std::size_t i = 0; i < m_portfolio_size; ++i)
+        {
+            // the tasks share the state. The ones that have not started when
+            // the solution is taken return at once, the running ones finish
+            // on their own since libsolv cannot be interrupted.
+            tasks.submit(run_portfolio_config, state, i, portfolio_configs[i]);
+        }
+
+        // the lowest configuration that has solved wins once the ones before
+        // it have failed, or after the grace period of the first solution
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        auto deadline = clock::time_point::max();
+        std::size_t winner = m_portfolio_size;
+        auto decided = [&]() {
+            winner = m_portfolio_size;
+            bool before_failed = true;
+            for (std::size_t i = 0; i < m_portfolio_size; ++i)
+            {
+                if (state->status[i] == portfolio::solved)
+                {
+                    winner = i;
+                    return before_failed;
+                }
+                before_failed = before_failed && state->status[i] == portfolio::failed;
+            }
+            return before_failed;
+        };
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            while (!decided())
+            {
+                auto now = clock::now();
+                if (winner < m_portfolio_size && deadline == clock::time_point::max())
+                {
+                    clock::duration grace = (now - start) / 5;
+                    deadline = now + std::max<clock::duration>(grace, portfolio_min_grace);
+                }
+                if (now >= deadline)
+                {
+                    break;
+                }
+                if (is_sig_interrupted())
+                {
+                    // the tasks that have not started do not report anymore
+                    state->cancelled = true;
+                    throw thread_interrupted();
+                }
+                auto poll = now + std::chrono::milliseconds(100);
+                state->cv.wait_until(lock, std::min(deadline, poll));
+            }
+            state->cancelled = true;
+        }
+        if (winner == m_portfolio_size)
+        {
+            LOG_INFO << "No configuration of the portfolio found a solution";
+            return false;
+        }
+
+        m_portfolio_winner = portfolio_configs[winner].name;
+        LOG_INFO << "Solution found by the " << m_portfolio_winner << " configuration";
+        from_clone_decisions(state->clone, state->decisions[winner], &m_decisions);
+        return true;
+    }
+
+    std::vector<bool> MSolver::solve_batch(const std::vector<MSolver*>& solvers,
+                                           std::size_t threads)
+    {
+        std::vector<bool> res;
+        if (solvers.empty())
+        {
+            return res;
+        }
+        Pool* pool = solvers.front()->m_pool;
+        for (auto* solver : solvers)
+        {
+            if (solver->m_pool != pool)
+            {
+                throw std::runtime_error("The solvers of a batch must share their pool.");
+            }
+        }
+
+        // a clone (written, read back and its whatprovides created) costs more
+        // than many small solves, a single thread solves the job sets in the
+        // pool itself. So does a task of the thread pool, which must not wait
+        // for the other tasks.
+        thread_pool& tasks = thread_pool::global();
+        if (threads == 0 || threads > tasks.size())
+        {
+            threads = tasks.size();
+        }
+        threads = tasks.in_worker() ? 1 : std::min(threads, solvers.size());
+
+        batch state;
+        if (threads > 1 && write_pool_clone(pool, state.clone))
+        {
+            for (auto* solver : solvers)
+            {
+                // the jobs as solved by solve(), see solve_jobs
+                int unlocked_jobs = solver->m_jobs.count;
+                if (solver->freeze_installed)
+                {
+                    solver->add_freeze_installed_job();
+                }
+                solver->m_batch_jobs = solver->jobs_key();
+                state.jobs.push_back(export_jobs(pool, solver->m_jobs, state.clone));
+                state.flags.push_back(solver->m_flags);
+                queue_truncate(&solver->m_jobs, unlocked_jobs);
+            }
+            state.solved.assign(solvers.size(), false);
+            state.decisions.resize(solvers.size());
+
+            LOG_INFO << "Solving " << solvers.size() << " job sets in " << threads << " threads";
+            std::vector<std::future<void>> workers;
+            for (std::size_t i = 0; i < threads; ++i)
+            {
+                workers.push_back(tasks.submit(run_batch, std::ref(state)));
+            }
+            // the state is used until every task is done, an interrupted one
+            // is only rethrown afterwards
+            for (auto& worker : workers)
+            {
+                worker.wait();
+            }
+            for (auto& worker : workers)
+            {
+                worker.get();
+            }
+
+            for (std::size_t i = 0; i < solvers.size(); ++i)
+            {
+                if (state.solved[i])
+                {
+                    from_clone_decisions(
+                        state.clone, state.decisions[i], &solvers[i]->m_batch_decisions);
+                }
+                else
+                {
+                    // solved again by solve(), which reports the problems
+                    solvers[i]->m_batch_jobs.clear();
+                }
+            }
+        }
+
+        for (auto* solver : solvers)
+        {
+            res.push_back(solver->solve());
+            solver->m_batch_jobs.clear();
+        }
+        return res;
+    }
+
+    bool MSolver::add_freeze_installed_job()
+    {
+        Pool* pool = m_pool;
+        Repo* installed = pool->installed;
+        if (!installed || installed->nsolvables == 0)
+        {
+            return false;
+        }
+
+        // the names reachable from the jobs over the requires of every candidate
+        Map names;
+        map_init(&names, pool->ss.nstrings);
+        Queue todo;
+        queue_init(&todo);
+        auto add_name = [&](Id name) {
+            if (name < pool->ss.nstrings && !MAPTST(&names, name))
+            {
+                MAPSET(&names, name);
+                queue_push(&todo, name);
+            }
+        };
+        for (int i = 0; i < m_jobs.count; i += 2)
+        {
+            // e.g. the locks of the pins
+            if ((m_jobs.elements[i] & SOLVER_JOBMASK) == SOLVER_LOCK)
+            {
+                continue;
+            }
+            for_each_job_solvable(pool, m_jobs.elements[i], m_jobs.elements[i + 1], [&](Id p) {
+                add_name(pool_id2solvable(pool, p)->name);
+            });
+        }
+        while (todo.count)
+        {
+            Id name = queue_shift(&todo);
+            for (Id* wp = pool_whatprovides_ptr(pool, name); *wp; wp++)
+            {
+                Solvable* s = pool_id2solvable(pool, *wp);
+                if (!s->requires)
+                {
+                    continue;
+                }
+                for (Id* dp = s->repo->idarraydata + s->requires; *dp; dp++)
+                {
+                    for (Id* pp = pool_whatprovides_ptr(pool, *dp); *pp; pp++)
+                    {
+                        add_name(pool_id2solvable(pool, *pp)->name);
+                    }
+                }
+            }
+        }
+        queue_free(&todo);
+
+        Queue locked;
+        queue_init(&locked);
+        Id p;
+        Solvable* s;
+        FOR_REPO_SOLVABLES(installed, p, s)
+        {
+            if (s->name >= pool->ss.nstrings || !MAPTST(&names, s->name))
+            {
+                queue_push(&locked, p);
+            }
+        }
+        map_free(&names);
+
+        bool res = locked.count != 0;
+        if (res)
+        {
+            LOG_INFO << "Locking " << locked.count << " installed packages";
+            Id d = pool_queuetowhatprovides(pool, &locked);
+            queue_push2(&m_jobs, SOLVER_LOCK | SOLVER_SOLVABLE_ONE_OF, d);
+        }
+        queue_free(&locked);
+        return res;
+    }
+
+    Transaction* MSolver::create_transaction()
+    {
+        if (m_solver == nullptr)
+        {
+            return transaction_create_decisionq(m_pool, &m_decisions, nullptr);
+        }
+        return solver_create_transaction(m_solver);
+    }
+
+    std::string MSolver::jobs_key() const
+    {
+        Pool* pool = m_pool;
+        std::stringstream key;
+        for (int i = 0; i < m_jobs.count; i += 2)
+        {
+            Id how = m_jobs.elements[i];
+            Id what = m_jobs.elements[i + 1];
+            key << "job " << how << " ";
+            switch (how & SOLVER_SELECTMASK)
+            {
+                case SOLVER_SOLVABLE_NAME:
+                case SOLVER_SOLVABLE_PROVIDES:
+                    key << pool_dep2str(pool, what);
+                    break;
+                default:
+                    for_each_job_solvable(
+                        pool, how, what, [&](Id p) { key << solvable_identity(pool, p) << " "; });
+                    break;
+            }
+            key << "\n";
+        }
+        return key.str();
+    }
+
+    std::string MSolver::solution_cache_key() const
+    {
+        Pool* pool = m_pool;
+        std::stringstream key;
+        key << "mamba-solution " << solution_cache_version << " " << LIBSOLV_VERSION_STRING
+            << "\n";
+
+        Id repoid;
+        Repo* repo;
+        FOR_REPOS(repoid, repo)
+        {
+            std::string state = m_mpool.repo_state(repo);
+            if (state.empty())
+            {
+                LOG_INFO << "Solution cache disabled, unknown state of repo " << repo->name;
+                return "";
+            }
+            key << "repo " << repoid << " " << repo->name << " " << repo->priority << " "
+                << repo->subpriority << (repo == pool->installed ? " installed\n" : "\n")
+                << state << "\n";
+        }
+
+        key << jobs_key();
+
+        for (const auto& [flag, value] : m_flags)
+        {
+            key << "flag " << flag << " " << value << "\n";
+        }
+        if (freeze_installed)
+        {
+            key << "freeze-installed\n";
+        }
+        if (m_portfolio_size > 1)
+        {
+            key << "portfolio " << m_portfolio_size << "\n";
+        }
+        if (!m_mpool.considered_state().empty())
+        {
+            key << m_mpool.considered_state() << "\n";
+        }
+
+        return validate::sha256sum_string(key.str());
+    }
+
+    bool MSolver::load_cached_solution(const std::string& key)
+    {
+        fs::path path = m_solution_cache_dir / (key + ".json");
+        if (!fs::exists(path))
+        {
+            return false;
+        }
+
+        nlohmann::json j;
+        try
+        {
+            std::ifstream in(path);
+            in >> j;
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Ignoring invalid cached solution " << path << ": " << e.what();
+            return false;
+        }
+
+        Pool* pool = m_pool;
+        Map chosen;
+        map_init(&chosen, pool->nsolvables);
+        queue_empty(&m_decisions);
+
+        // map the stored solvables back to the pool, every one of them must
+        // still be there
+        bool valid = j.value("key", "") == key && j.contains("solution");
+        if (valid)
+        {
+            for (const auto& entry : j["solution"])
+            {
+                Id name = pool_str2id(pool, entry.value("name", "").c_str(), 0);
+                Id found = 0;
+                if (name)
+                {
+                    for (Id* wp = pool_whatprovides_ptr(pool, name); *wp; wp++)
+                    {
+                        Solvable* s = pool_id2solvable(pool, *wp);
+                        if (s->name == name && s->repo
+                            && s->repo->repoid == entry.value("repo", 0)
+                            && entry.value("version", "") == pool_id2str(pool, s->evr)
+                            && entry.value("build", "") == solvable_build(s)
+                            && entry.value("build_number", "") == solvable_build_number(s))
+                        {
+                            found = *wp;
+                            break;
+                        }
+                    }
+                }
+                if (!found)
+                {
+                    LOG_INFO << "Cached solution does not match the pool: " << entry.dump();
+                    valid = false;
+                    break;
+                }
+                MAPSET(&chosen, found);
+                queue_push(&m_decisions, found);
+            }
+        }
+
+        if (valid)
+        {
+            valid = check_cached_solution(chosen);
+        }
+
+        if (valid && pool->installed)
+        {
+            Id p;
+            Solvable* s;
+            FOR_REPO_SOLVABLES(pool->installed, p, s)
+            {
+                if (!MAPTST(&chosen, p))
+                {
+                    queue_push(&m_decisions, -p);
+                }
+            }
+        }
+
+        map_free(&chosen);
+        if (!valid)
+        {
+            queue_empty(&m_decisions);
+        }
+        return valid;
+    }
+
+    bool MSolver::check_cached_solution(const Map& chosen) const
+    {
+        Pool* pool = m_pool;
+
+        // every job has to be fulfilled
+        for (int i = 0; i < m_jobs.count; i += 2)
+        {
+            Id how = m_jobs.elements[i];
+            bool any_chosen = false;
+            bool lock_broken = false;
+            for_each_job_solvable(pool, how, m_jobs.elements[i + 1], [&](Id p) {
+                bool is_chosen = MAPTST(&chosen, p);
+                any_chosen = any_chosen || is_chosen;
+                bool is_installed = pool->installed
+                                    && pool_id2solvable(pool, p)->repo == pool->installed;
+                lock_broken = lock_broken || (is_chosen != is_installed);
+            });
+
+            int action = how & SOLVER_JOBMASK;
+            if ((action == SOLVER_INSTALL && !any_chosen) || (action == SOLVER_ERASE && any_chosen)
+                || (action == SOLVER_LOCK && lock_broken))
+            {
+                LOG_INFO << "Cached solution does not fulfill job "
+                         << pool_job2str(pool, how, m_jobs.elements[i + 1], 0);
+                return false;
+            }
+        }
+
+        // and the dependencies, constrains and conflicts of every package are
+        // satisfied
+        Queue constrains;
+        queue_init(&constrains);
+        bool valid = true;
+        for (Id p = 2; p < pool->nsolvables && valid; p++)
+        {
+            if (!MAPTST(&chosen, p))
+            {
+                continue;
+            }
+            Solvable* s = pool_id2solvable(pool, p);
+            for (Id* reqp = s->requires ? s->repo->idarraydata + s->requires : nullptr;
+                 reqp && *reqp && valid;
+                 reqp++)
+            {
+                Id dep = *reqp;
+                if (dep == SOLVABLE_PREREQMARKER)
+                {
+                    continue;
+                }
+                bool satisfied = false;
+                for (Id* wp = pool_whatprovides_ptr(pool, dep); *wp && !satisfied; wp++)
+                {
+                    satisfied = MAPTST(&chosen, *wp);
+                }
+                if (!satisfied)
+                {
+                    LOG_INFO << "Cached solution does not satisfy " << pool_dep2str(pool, dep)
+                             << " of " << solvable_identity(pool, p);
+                    valid = false;
+                }
+            }
+
+            // no other chosen package may provide a conflict
+            for (Id* conp = s->conflicts ? s->repo->idarraydata + s->conflicts : nullptr;
+                 conp && *conp && valid;
+                 conp++)
+            {
+                for (Id* wp = pool_whatprovides_ptr(pool, *conp); *wp && valid; wp++)
+                {
+                    if (*wp != p && MAPTST(&chosen, *wp))
+                    {
+                        LOG_INFO << "Cached solution conflicts with " << pool_dep2str(pool, *conp)
+                                 << " of " << solvable_identity(pool, p);
+                        valid = false;
+                    }
+                }
+            }
+
+            // the chosen packages named by a constraint have to match it
+            solvable_lookup_idarray(s, SOLVABLE_CONSTRAINS, &constrains);
+            for (int i = 0; i < constrains.count && valid; ++i)
+            {
+                Id dep = constrains.elements[i];
+                Id name = ISRELDEP(dep) ? GETRELDEP(pool, dep)->name : dep;
+                for (Id* wp = pool_whatprovides_ptr(pool, name); *wp && valid; wp++)
+                {
+                    if (!MAPTST(&chosen, *wp) || pool_id2solvable(pool, *wp)->name != name)
+                    {
+                        continue;
+                    }
+                    bool matches = false;
+                    for (Id* mp = pool_whatprovides_ptr(pool, dep); *mp && !matches; mp++)
+                    {
+                        matches = *mp == *wp;
+                    }
+                    if (!matches)
+                    {
+                        LOG_INFO << "Cached solution does not satisfy the constraint "
+                                 << pool_dep2str(pool, dep) << " of "
+                                 << solvable_identity(pool, p);
+                        valid = false;
+                    }
+                }
+            }
+        }
+        queue_free(&constrains);
+        return valid;
+    }
+
+    void MSolver::store_solution(const std::string& key, const Queue& decisions) const
+    {
+        Pool* pool = m_pool;
+        nlohmann::json solution = nlohmann::json::array();
+        for (int i = 0; i < decisions.count; ++i)
+        {
+            Id p = decisions.elements[i];
+            if (p <= SYSTEMSOLVABLE)
+            {
+                continue;
+            }
+            Solvable* s = pool_id2solvable(pool, p);
+            if (!s->repo)
+            {
+                continue;
+            }
+            solution.push_back({ { "repo", s->repo->repoid },
+                                 { "name", pool_id2str(pool, s->name) },
+                                 { "version", pool_id2str(pool, s->evr) },
+                                 { "build", solvable_build(s) },
+                                 { "build_number", solvable_build_number(s) } });
+        }
+
+        try
+        {
+            fs::create_directories(m_solution_cache_dir);
+            fs::path path = m_solution_cache_dir / (key + ".json");
+            fs::path tmp_path = path;
+            tmp_path += ".tmp";
+            {
+                std::ofstream out(tmp_path);
+                out << nlohmann::json({ { "key", key }, { "solution", solution } }).dump();
+                if (!out)
+                {
+                    LOG_WARNING << "Could not write cached solution " << tmp_path;
+                    return;
+                }
+            }
+            fs::rename(tmp_path, path);
+            LOG_INFO << "Stored solution " << key;
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not store solution: " << e.what();
+        }
+    }
+
     std::string MSolver::problems_to_str()
     {
         Queue problem_queue;
@@ -325,9 +1548,4 @@ namespace mamba
         queue_free(&problem_queue);
         return "Encountered problems while solving.\n" + problems.str();
     }
-
-    MSolver::operator Solver*()
-    {
-        return m_solver;
-    }
 }  // namespace mamba
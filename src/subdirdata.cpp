@@ -9,6 +9,7 @@
 #include "mamba/mamba_fs.hpp"
 #include "mamba/output.hpp"
 #include "mamba/package_cache.hpp"
+#include "mamba/package_handling.hpp"
 #include "mamba/subdirdata.hpp"
 
 namespace decompress
@@ -22,6 +23,7 @@ namespace decompress
 
         struct archive* a = archive_read_new();
         archive_read_support_filter_bzip2(a);
+        archive_read_support_filter_zstd(a);
         archive_read_support_format_raw(a);
         // TODO figure out good value for this
         const std::size_t BLOCKSIZE = 16384;
@@ -63,6 +65,12 @@ namespace decompress
 
 namespace mamba
 {
+    namespace
+    {
+        // fast to decompress, most of the size gain of the higher levels
+        const int repodata_cache_compression_level = 3;
+    }  // namespace
+
     MSubdirData::MSubdirData(const std::string& name,
                              const std::string& url,
                              const std::string& repodata_fn)
@@ -136,17 +144,22 @@ namespace mamba
 
                     m_loaded = true;
                     m_json_cache_valid = true;
+                    check_solv_cache(now, cache_age);
+                    return true;
+                }
 
-                    // check solv cache
-                    auto solv_age = check_cache(m_solv_fn, now);
-                    LOG_INFO << "Solv cache age in seconds: "
-                             << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count();
-                    if (solv_age != fs::file_time_type::duration::max()
-                        && solv_age.count() <= cache_age.count())
-                    {
-                        LOG_INFO << "Also using .solv cache file";
-                        m_solv_cache_valid = true;
-                    }
+                if (Context::instance().stale_while_revalidate)
+                {
+                    LOG_INFO << "Using stale cache " << m_url
+                             << " age in seconds: " << cache_age_seconds << " / " << max_age;
+                    std::string prefix = m_name;
+                    prefix.resize(PREFIX_LENGTH - 1, ' ');
+                    Console::stream() << prefix << " Using stale cache";
+
+                    m_loaded = true;
+                    m_json_cache_valid = true;
+                    m_stale = true;
+                    check_solv_cache(now, cache_age);
                     return true;
                 }
             }
@@ -167,6 +180,20 @@ namespace mamba
         return true;
     }
 
+    void MSubdirData::check_solv_cache(const fs::file_time_type::clock::time_point& now,
+                                       fs::file_time_type::duration cache_age)
+    {
+        auto solv_age = check_cache(m_solv_fn, now);
+        LOG_INFO << "Solv cache age in seconds: "
+                 << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count();
+        if (solv_age != fs::file_time_type::duration::max()
+            && solv_age.count() <= cache_age.count())
+        {
+            LOG_INFO << "Also using .solv cache file";
+            m_solv_cache_valid = true;
+        }
+    }
+
     std::string MSubdirData::cache_path() const
     {
         // TODO invalidate solv cache on version updates!!
@@ -218,7 +245,12 @@ namespace mamba
                                      + std::to_string(m_target->http_status));
         }
 
-        if (m_target->http_status == 304)
+        if (!check_patch_journal())
+        {
+            return false;
+        }
+
+        if (m_target->http_status == 304 || (m_patch_journal && m_patch_journal->up_to_date()))
         {
             // cache still valid
             auto now = fs::file_time_type::clock::now();
@@ -244,11 +276,33 @@ namespace mamba
             m_json_cache_valid = true;
             m_loaded = true;
             m_temp_file.reset(nullptr);
+            m_patch_journal.reset();
             return true;
         }
 
         LOG_INFO << "Finalized transfer: " << m_url;
 
+        // the patch journal is applied to the cached repodata, and to the
+        // .solv cache if it is up to date
+        RepoMetadata previous_metadata;
+        std::set<std::string> changed_fns;
+        nlohmann::json changes;
+        bool patch_solv = false;
+        std::string sha256;
+        if (m_patch_journal)
+        {
+            auto now = fs::file_time_type::clock::now();
+            auto solv_age = check_cache(m_solv_fn, now);
+            patch_solv = solv_age != fs::file_time_type::duration::max()
+                         && solv_age.count() <= check_cache(m_json_fn, now).count();
+            previous_metadata = repo_metadata();
+            if (!apply_patch_journal(changed_fns, changes))
+            {
+                return false;
+            }
+            sha256 = m_patch_journal->latest();
+        }
+
         m_mod_etag.clear();
         m_mod_etag["_url"] = m_url;
         m_mod_etag["_etag"] = m_target->etag;
@@ -264,12 +318,22 @@ namespace mamba
             exit(1);
         }
 
-        if (ends_with(m_url, ".bz2"))
+        if (ends_with(m_url, ".bz2") || ends_with(m_target->url(), ".zst"))
         {
             m_progress_bar.set_postfix("Decomp...");
             decompress();
         }
 
+        // identifies the repodata in its patch journal
+        if (sha256.empty() && Context::instance().repodata_patches)
+        {
+            sha256 = validate::sha256sum(m_temp_file->path().string());
+        }
+        if (!sha256.empty())
+        {
+            m_mod_etag["_sha256"] = sha256;
+        }
+
         m_progress_bar.set_postfix("Finalizing...");
 
         std::ifstream temp_file(m_temp_file->path());
@@ -304,11 +368,149 @@ namespace mamba
         m_temp_file.reset(nullptr);
         final_file.close();
 
+        if (Context::instance().compress_repodata_cache)
+        {
+            fs::path zst_fn = m_json_fn + ".zst.tmp";
+            try
+            {
+                compress_zstd_file(m_json_fn, zst_fn, repodata_cache_compression_level);
+                fs::rename(zst_fn, m_json_fn);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not compress repodata cache " << m_json_fn << ": "
+                            << e.what();
+                fs::remove(zst_fn);
+            }
+        }
+
         fs::last_write_time(m_json_fn, fs::file_time_type::clock::now());
 
+        if (m_patch_journal)
+        {
+            if (patch_solv)
+            {
+                update_solv_cache(previous_metadata, changed_fns, changes);
+            }
+            m_patch_journal.reset();
+        }
+        return true;
+    }
+
+    bool MSubdirData::check_patch_journal()
+    {
+        if (!PatchJournal::is_journal_url(m_target->url()) || m_target->http_status == 304)
+        {
+            return true;
+        }
+        if (!m_patch_journal)
+        {
+            m_patch_journal = std::make_unique<PatchJournal>(
+                m_temp_file->path(), m_mod_etag.value("_sha256", std::string("")));
+        }
+        if (m_patch_journal->applies())
+        {
+            return true;
+        }
+        LOG_INFO << "Patch journal of " << m_name << " does not apply, downloading "
+                 << m_url;
+        m_patch_journal.reset();
+        // the transfer is retried with the full repodata
+        m_target->try_fallback();
+        return false;
+    }
+
+    bool MSubdirData::apply_patch_journal(std::set<std::string>& changed_fns,
+                                          nlohmann::json& changes)
+    {
+        m_progress_bar.set_postfix("Patching...");
+        nlohmann::json repodata;
+        bool records_only = false;
+        FILE* fp = open_decompressed(m_json_fn);
+        try
+        {
+            if (!fp)
+            {
+                throw std::runtime_error("could not open " + m_json_fn);
+            }
+            repodata = nlohmann::json::parse(fp);
+            fclose(fp);
+            fp = nullptr;
+
+            // the cache header is written again
+            for (auto it = repodata.begin(); it != repodata.end();)
+            {
+                it = starts_with(it.key(), "_") ? repodata.erase(it) : std::next(it);
+            }
+            records_only = m_patch_journal->apply(repodata, changed_fns);
+
+            // then written to the cache as a downloaded repodata
+            std::ofstream out(m_temp_file->path(), std::ios::out | std::ios::trunc);
+            out << repodata.dump();
+            if (!out)
+            {
+                throw std::runtime_error("could not write " + m_temp_file->path().string());
+            }
+        }
+        catch (const std::exception& e)
+        {
+            if (fp)
+            {
+                fclose(fp);
+            }
+            LOG_WARNING << "Could not patch repodata " << m_json_fn << ": " << e.what();
+            m_patch_journal.reset();
+            m_target->try_fallback();
+            return false;
+        }
+        LOG_INFO << "Patched " << m_json_fn << ", " << changed_fns.size() << " records changed";
+
+        // only the changed records are given to the .solv cache
+        if (records_only)
+        {
+            changes["info"] = repodata.value("info", nlohmann::json::object());
+            for (const std::string section : { "packages", "packages.conda" })
+            {
+                changes[section] = nlohmann::json::object();
+                if (!repodata.contains(section))
+                {
+                    continue;
+                }
+                for (const auto& fn : changed_fns)
+                {
+                    auto it = repodata[section].find(fn);
+                    if (it != repodata[section].end())
+                    {
+                        changes[section][fn] = *it;
+                    }
+                }
+            }
+        }
         return true;
     }
 
+    void MSubdirData::update_solv_cache(const RepoMetadata& previous,
+                                        const std::set<std::string>& changed_fns,
+                                        const nlohmann::json& changes)
+    {
+        // other changes than records: rebuilt from the JSON when loaded
+        if (changes.is_null())
+        {
+            return;
+        }
+        try
+        {
+            MPool pool;
+            MRepo repo(pool, m_name, m_solv_fn, previous);
+            repo.update_records(changed_fns, changes.dump(), repo_metadata());
+            m_solv_cache_valid = true;
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not update " << m_solv_fn << ": " << e.what();
+        }
+    }
+
     bool MSubdirData::decompress()
     {
         LOG_INFO << "Decompressing metadata";
@@ -326,11 +528,31 @@ namespace mamba
     {
         m_temp_file = std::make_unique<TemporaryFile>();
         m_progress_bar = Console::instance().add_progress_bar(m_name);
-        m_target = std::make_unique<DownloadTarget>(m_name, m_url, m_temp_file->path());
+        // the patch journal when the cached repodata is known, then
+        // repodata.json.zst if the server has it
+        std::vector<std::string> urls;
+        if (ends_with(m_url, ".json"))
+        {
+            if (Context::instance().repodata_patches && mod_etag.is_object()
+                && !mod_etag.value("_sha256", std::string("")).empty())
+            {
+                urls.push_back(PatchJournal::url(m_url));
+            }
+            if (Context::instance().repodata_zst)
+            {
+                urls.push_back(m_url + ".zst");
+            }
+        }
+        urls.push_back(m_url);
+        m_target = std::make_unique<DownloadTarget>(m_name, urls[0], m_temp_file->path());
+        for (std::size_t i = 1; i < urls.size(); ++i)
+        {
+            m_target->add_fallback_url(urls[i]);
+        }
         m_target->set_progress_bar(m_progress_bar);
         // if we get something _other_ than the noarch, we DO NOT throw if the file
-        // can't be retrieved
-        if (!ends_with(m_name, "/noarch"))
+        // can't be retrieved (nor for a partial repodata, see use_full_repodata)
+        if (!ends_with(m_name, "/noarch") || !m_full_url.empty())
         {
             m_target->set_ignore_failure(true);
         }
@@ -355,41 +577,65 @@ namespace mamba
         // "_etag": "W/\"6092e6a2b6cec6ea5aade4e177c3edda-8\"",
         // "_mod": "Sat, 04 Apr 2020 03:29:49 GMT",
         // "_cache_control": "public, max-age=1200"
-
-        auto extract_subjson = [](std::ifstream& s) {
+        // (and "_sha256" with patch journals): all the keys starting with `_`
+        auto extract_subjson = [](std::istream& s) {
             char next;
             std::string result;
             bool escaped = false;
-            int i = 0, N = 4;
+            int i = 0;
             while (s.get(next))
             {
-                if (next == '"')
+                if (next == '"' && !escaped)
                 {
-                    if (!escaped)
+                    i++;
+                    // end of a value, is the next key part of the header?
+                    if (i % 4 == 0)
                     {
+                        std::string separator;
+                        char c;
+                        while (s.get(c) && c != '"')
+                        {
+                            separator.push_back(c);
+                        }
+                        if (!s.get(c))
+                        {
+                            return std::string();
+                        }
+                        if (c != '_')
+                        {
+                            return result + "\"}";
+                        }
+                        result += '"' + separator + '"' + c;
                         i++;
+                        continue;
                     }
-                    else
-                    {
-                        escaped = false;
-                    }
-                    // 4 keys == 4 ticks
-                    if (i == 4 * N)
-                    {
-                        return result + "\"}";
-                    }
-                }
-                else if (next == '\\')
-                {
-                    escaped = true;
                 }
+                escaped = next == '\\' && !escaped;
                 result.push_back(next);
             }
             return std::string();
         };
 
-        std::ifstream in_file(m_json_fn);
-        auto json = extract_subjson(in_file);
+        std::string json;
+        if (is_zstd_file(m_json_fn))
+        {
+            // the header is at the very beginning of the repodata
+            std::array<char, 16384> buffer;
+            std::size_t size = 0;
+            FILE* fp = open_decompressed(m_json_fn);
+            if (fp)
+            {
+                size = fread(buffer.data(), 1, buffer.size(), fp);
+                fclose(fp);
+            }
+            std::istringstream in_stream(std::string(buffer.data(), size));
+            json = extract_subjson(in_stream);
+        }
+        else
+        {
+            std::ifstream in_file(m_json_fn);
+            json = extract_subjson(in_file);
+        }
         nlohmann::json result;
         try
         {
@@ -426,14 +672,67 @@ namespace mamba
         return cache_dir;
     }
 
+    RepoMetadata MSubdirData::repo_metadata()
+    {
+        return RepoMetadata{ m_url,
+                             Context::instance().add_pip_as_python_dependency,
+                             m_mod_etag["_etag"],
+                             m_mod_etag["_mod"],
+                             m_mod_etag.value("_sha256", std::string("")) };
+    }
+
+    std::string MSubdirData::repo_state()
+    {
+        return repodata_state(repo_metadata(), m_json_fn);
+    }
+
     MRepo MSubdirData::create_repo(MPool& pool)
     {
-        RepoMetadata meta{ m_url,
-                           Context::instance().add_pip_as_python_dependency,
-                           m_mod_etag["_etag"],
-                           m_mod_etag["_mod"] };
+        return MRepo(pool, m_name, cache_path(), repo_metadata());
+    }
+
+    RepodataIndex& MSubdirData::name_index()
+    {
+        if (!m_json_cache_valid)
+        {
+            throw std::runtime_error("Cache not loaded!");
+        }
+        if (!m_name_index)
+        {
+            m_name_index = std::make_unique<RepodataIndex>(m_json_fn, repo_state());
+            m_name_index->load();
+        }
+        return *m_name_index;
+    }
+
+    bool MSubdirData::sharded() const
+    {
+        return ShardedRepodata::is_index_url(m_url);
+    }
+
+    ShardedRepodata& MSubdirData::shards()
+    {
+        if (!m_json_cache_valid || !sharded())
+        {
+            throw std::runtime_error("Shard index not loaded!");
+        }
+        if (!m_shards)
+        {
+            // the shards are shared by the subdirs of all the channels
+            fs::path shards_dir = fs::path(m_json_fn).parent_path() / "shards";
+            m_shards = std::make_unique<ShardedRepodata>(
+                m_json_fn, rsplit(m_url, "/", 1)[0], shards_dir);
+        }
+        return *m_shards;
+    }
 
-        return MRepo(pool, m_name, cache_path(), meta);
+    MRepo MSubdirData::create_repo(MPool& pool, const std::set<std::string>& names)
+    {
+        if (sharded())
+        {
+            return MRepo(pool, shards(), names, repo_metadata());
+        }
+        return MRepo(pool, name_index(), names, repo_metadata());
     }
 
     void MSubdirData::clear_cache()
@@ -446,5 +745,242 @@ namespace mamba
         {
             fs::remove(m_solv_fn);
         }
+        fs::path index_fn = RepodataIndex::index_path(m_json_fn);
+        if (fs::exists(index_fn))
+        {
+            fs::remove(index_fn);
+        }
+        m_name_index.reset();
+        m_shards.reset();
+    }
+
+    namespace
+    {
+        // the records of a repodata.json by file name
+        std::map<std::string, std::string> read_records(const fs::path& json_file)
+        {
+            std::map<std::string, std::string> res;
+            nlohmann::json j;
+            FILE* fp = open_decompressed(json_file);
+            if (!fp)
+            {
+                LOG_WARNING << "Could not open repodata " << json_file;
+                return res;
+            }
+            try
+            {
+                j = nlohmann::json::parse(fp);
+                fclose(fp);
+            }
+            catch (const std::exception& e)
+            {
+                fclose(fp);
+                LOG_WARNING << "Could not read repodata " << json_file << ": " << e.what();
+                return res;
+            }
+            for (const std::string section : { "packages", "packages.conda" })
+            {
+                if (j.contains(section))
+                {
+                    for (auto& [fn, record] : j[section].items())
+                    {
+                        res[fn] = record.dump();
+                    }
+                }
+            }
+            return res;
+        }
+    }  // namespace
+
+    void MSubdirData::set_full_repodata(const std::string& url, const std::string& repodata_fn)
+    {
+        m_full_url = url;
+        m_full_json_fn = repodata_fn;
+    }
+
+    bool MSubdirData::use_full_repodata()
+    {
+        if (m_full_url.empty())
+        {
+            return false;
+        }
+        LOG_INFO << "Using full repodata for " << m_name;
+
+        m_url = m_full_url;
+        m_json_fn = m_full_json_fn;
+        m_solv_fn = m_json_fn.substr(0, m_json_fn.size() - 4) + "solv";
+        m_full_url.clear();
+        m_full_json_fn.clear();
+
+        m_loaded = false;
+        m_download_complete = false;
+        m_json_cache_valid = false;
+        m_solv_cache_valid = false;
+        m_stale = false;
+        m_mod_etag = nlohmann::json();
+        m_target.reset();
+        m_temp_file.reset();
+        m_name_index.reset();
+        m_patch_journal.reset();
+        m_shards.reset();
+        return true;
+    }
+
+    bool MSubdirData::stale() const
+    {
+        return m_stale;
+    }
+
+    DownloadTarget* MSubdirData::revalidation_target()
+    {
+        if (!m_stale)
+        {
+            return nullptr;
+        }
+        create_target(m_mod_etag);
+        // the cache is still being read, it is only written by finish_revalidation
+        m_target->set_finalize_callback(&MSubdirData::finalize_revalidation, this);
+        m_target->set_ignore_failure(true);
+        return m_target.get();
+    }
+
+    bool MSubdirData::finalize_revalidation()
+    {
+        return check_patch_journal();
+    }
+
+    std::set<std::string> MSubdirData::finish_revalidation()
+    {
+        std::set<std::string> changed;
+        if (!m_stale || !m_target)
+        {
+            return changed;
+        }
+        m_stale = false;
+
+        bool modified = m_target->result == 0 && m_target->http_status != 304
+                        && m_target->http_status < 400;
+        auto old_records = modified ? read_records(m_json_fn)
+                                    : std::map<std::string, std::string>();
+        try
+        {
+            modified = finalize_transfer() && modified;
+        }
+        catch (const std::runtime_error& e)
+        {
+            LOG_WARNING << e.what();
+            modified = false;
+        }
+        if (!modified)
+        {
+            // not modified, or the refresh failed and the stale cache stays in use
+            m_loaded = true;
+            return changed;
+        }
+
+        m_solv_cache_valid = false;
+        m_name_index.reset();
+        m_shards.reset();
+        auto new_records = read_records(m_json_fn);
+
+        for (const auto& [fn, record] : old_records)
+        {
+            auto it = new_records.find(fn);
+            if (it == new_records.end() || it->second != record)
+            {
+                changed.insert(fn);
+            }
+        }
+        for (const auto& [fn, record] : new_records)
+        {
+            if (old_records.find(fn) == old_records.end())
+            {
+                changed.insert(fn);
+            }
+        }
+        LOG_INFO << "Refreshed " << m_name << ", " << changed.size() << " records changed";
+        return changed;
+    }
+
+    SubdirRevalidation::SubdirRevalidation(
+        const std::vector<std::shared_ptr<MSubdirData>>& subdirs)
+    {
+        for (auto& subdir : subdirs)
+        {
+            if (subdir->stale())
+            {
+                m_subdirs.push_back(subdir);
+            }
+        }
+        if (m_subdirs.empty())
+        {
+            return;
+        }
+
+        Console::instance().init_multi_progress();
+        m_multi_dl = std::make_unique<MultiDownloadTarget>();
+        for (auto& subdir : m_subdirs)
+        {
+            m_multi_dl->add(subdir->revalidation_target());
+        }
+        m_thread = thread([this]() {
+            try
+            {
+                m_multi_dl->download(false);
+            }
+            catch (std::exception& e)
+            {
+                LOG_WARNING << "Could not refresh repodata: " << e.what();
+            }
+        });
+    }
+
+    SubdirRevalidation::~SubdirRevalidation()
+    {
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    std::map<std::string, std::set<std::string>> SubdirRevalidation::finish()
+    {
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+        for (auto& subdir : m_subdirs)
+        {
+            auto changed = subdir->finish_revalidation();
+            if (!changed.empty())
+            {
+                m_changed[rsplit(subdir->repo_metadata().url, "/", 1)[0]] = std::move(changed);
+            }
+        }
+        m_subdirs.clear();
+        return m_changed;
+    }
+
+    bool SubdirRevalidation::outdated_solution(
+        bool solved, const std::vector<std::pair<std::string, std::string>>& installed) const
+    {
+        if (m_changed.empty())
+        {
+            return false;
+        }
+        if (!solved)
+        {
+            return true;
+        }
+        for (const auto& [url, fn] : installed)
+        {
+            auto it = m_changed.find(url);
+            if (it != m_changed.end() && it->second.count(fn))
+            {
+                LOG_INFO << "Refreshed repodata changed " << url << "/" << fn;
+                return true;
+            }
+        }
+        return false;
     }
 }  // namespace mamba
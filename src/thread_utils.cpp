@@ -3,6 +3,9 @@
 // Distributed under the terms of the BSD 3-Clause License.
 //
 // The full license is in the file LICENSE, distributed with this software.
+#include <algorithm>
+
+#include "mamba/context.hpp"
 #include "mamba/thread_utils.hpp"
 
 #ifndef _WIN32
@@ -124,6 +127,20 @@ namespace mamba
         clean_var.wait(lk, []() { return thread_count == 0; });
     }
 
+    namespace
+    {
+        // unlike decrease_thread_count, the pool workers do not exit
+        // after each task
+        void decrease_task_count()
+        {
+            {
+                std::unique_lock<std::mutex> lk(clean_mutex);
+                --thread_count;
+            }
+            clean_var.notify_all();
+        }
+    }  // namespace
+
     /*************************
      * thread implementation *
      *************************/
@@ -148,6 +165,140 @@ namespace mamba
         m_thread.detach();
     }
 
+    /******************************
+     * thread_pool implementation *
+     ******************************/
+
+    namespace
+    {
+        // the pool and queue of the current worker thread
+        thread_local thread_pool* current_pool = nullptr;
+        thread_local std::size_t current_queue = 0;
+    }  // namespace
+
+    thread_pool::thread_pool(std::size_t n_threads)
+    {
+        if (n_threads == 0)
+        {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (std::size_t i = 0; i < n_threads; ++i)
+        {
+            m_queues.push_back(std::make_unique<task_queue>());
+        }
+        for (std::size_t i = 0; i < n_threads; ++i)
+        {
+            m_workers.emplace_back(&thread_pool::run, this, i);
+        }
+    }
+
+    thread_pool::~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto& w : m_workers)
+        {
+            w.join();
+        }
+    }
+
+    std::size_t thread_pool::size() const
+    {
+        return m_workers.size();
+    }
+
+    bool thread_pool::in_worker() const
+    {
+        return current_pool == this;
+    }
+
+    thread_pool& thread_pool::global()
+    {
+        static thread_pool pool(
+            static_cast<std::size_t>(std::max(0, Context::instance().max_parallel_tasks)));
+        return pool;
+    }
+
+    void thread_pool::schedule(task t)
+    {
+        increase_thread_count();
+        task counted = [t = std::move(t)]() {
+            t();
+            decrease_task_count();
+        };
+
+        // tasks spawned by a worker go to its own queue
+        std::size_t idx = current_pool == this ? current_queue
+                                               : m_next_queue++ % m_queues.size();
+        {
+            std::lock_guard<std::mutex> lock(m_queues[idx]->mutex);
+            m_queues[idx]->tasks.push_back(std::move(counted));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+        m_cv.notify_one();
+    }
+
+    bool thread_pool::pop(std::size_t idx, task& t)
+    {
+        bool found = false;
+        {
+            // newest task of our own queue first
+            std::lock_guard<std::mutex> lock(m_queues[idx]->mutex);
+            auto& tasks = m_queues[idx]->tasks;
+            if (!tasks.empty())
+            {
+                t = std::move(tasks.back());
+                tasks.pop_back();
+                found = true;
+            }
+        }
+        // otherwise steal the oldest task of another queue
+        for (std::size_t i = 1; !found && i < m_queues.size(); ++i)
+        {
+            auto& queue = *m_queues[(idx + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                t = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                found = true;
+            }
+        }
+        if (found)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_pending;
+        }
+        return found;
+    }
+
+    void thread_pool::run(std::size_t idx)
+    {
+        current_pool = this;
+        current_queue = idx;
+        while (true)
+        {
+            task t;
+            if (pop(idx, t))
+            {
+                t();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || m_pending > 0; });
+            if (m_stop && m_pending == 0)
+            {
+                return;
+            }
+        }
+    }
+
     /**********************
      * interruption_guard *
      **********************/
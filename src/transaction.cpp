@@ -4,7 +4,11 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <map>
 #include <stack>
 #include <thread>
 
@@ -24,8 +28,6 @@ namespace mamba
      * PackageDownloadExtractTarget *
      ********************************/
 
-    std::mutex PackageDownloadExtractTarget::extract_mutex;
-
     static std::mutex lookup_checksum_mutex;
     std::string lookup_checksum(Solvable* s, Id checksum_type)
     {
@@ -70,27 +72,29 @@ namespace mamba
         repodata_record << index.dump(4);
     }
 
+    static std::mutex urls_txt_mutex;
     void PackageDownloadExtractTarget::add_url()
     {
+        std::lock_guard<std::mutex> lock(urls_txt_mutex);
         std::ofstream urls_txt(m_cache_path / "urls.txt", std::ios::app);
         urls_txt << m_url << std::endl;
     }
 
     void PackageDownloadExtractTarget::validate()
     {
-        m_validation_result = VALIDATION_RESULT::VALID;
+        VALIDATION_RESULT result = VALIDATION_RESULT::VALID;
         if (m_expected_size && size_t(m_target->downloaded_size) != m_expected_size)
         {
             LOG_ERROR << "File not valid: file size doesn't match expectation " << m_tarball_path
                       << "\nExpected: " << m_expected_size << "\n";
             m_progress_proxy.mark_as_completed("File size validation error.");
-            m_validation_result = SIZE_ERROR;
+            result = SIZE_ERROR;
         }
         interruption_point();
 
         if (!m_sha256.empty() && !validate::sha256(m_tarball_path, m_sha256))
         {
-            m_validation_result = SHA256_ERROR;
+            result = SHA256_ERROR;
             m_progress_proxy.mark_as_completed("SHA256 sum validation error.");
             LOG_ERROR << "File not valid: SHA256 sum doesn't match expectation " << m_tarball_path
                       << "\nExpected: " << m_sha256 << "\n";
@@ -99,47 +103,43 @@ namespace mamba
         {
             if (!m_md5.empty() && !validate::md5(m_tarball_path, m_md5))
             {
-                m_validation_result = MD5SUM_ERROR;
+                result = MD5SUM_ERROR;
                 m_progress_proxy.mark_as_completed("MD5 sum validation error.");
                 LOG_ERROR << "File not valid: MD5 sum doesn't match expectation " << m_tarball_path
                           << "\nExpected: " << m_md5 << "\n";
             }
         }
+        set_validation_result(result);
     }
 
     bool PackageDownloadExtractTarget::extract()
     {
-        // Extracting is __not__ yet thread safe it seems...
+        // extract() does not depend on the current directory, packages are
+        // extracted in parallel
         interruption_point();
-        LOG_INFO << "Waiting for decompression " << m_tarball_path;
-        m_progress_proxy.set_postfix("Waiting...");
+        m_progress_proxy.set_postfix("Decompressing...");
+        LOG_INFO << "Decompressing " << m_tarball_path;
+        fs::path extract_path;
+        try
         {
-            std::lock_guard<std::mutex> lock(PackageDownloadExtractTarget::extract_mutex);
+            extract_path = mamba::extract(m_tarball_path);
             interruption_point();
-            m_progress_proxy.set_postfix("Decompressing...");
-            LOG_INFO << "Decompressing " << m_tarball_path;
-            fs::path extract_path;
-            try
-            {
-                extract_path = mamba::extract(m_tarball_path);
-                interruption_point();
-                LOG_INFO << "Extracted to " << extract_path;
-                write_repodata_record(extract_path);
-                add_url();
-            }
-            catch (std::exception& e)
-            {
-                LOG_ERROR << "Error when extracting package: " << e.what();
-                m_decompress_exception = e;
-                m_validation_result = VALIDATION_RESULT::EXTRACT_ERROR;
-                m_finished = true;
-                m_progress_proxy.mark_as_completed("Extraction error");
-                return false;
-            }
+            LOG_INFO << "Extracted to " << extract_path;
+            write_repodata_record(extract_path);
+            add_url();
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR << "Error when extracting package: " << e.what();
+            m_decompress_exception = e;
+            set_validation_result(VALIDATION_RESULT::EXTRACT_ERROR);
+            set_finished();
+            m_progress_proxy.mark_as_completed("Extraction error");
+            return false;
         }
 
-        m_finished = true;
-        return m_finished;
+        set_finished();
+        return true;
     }
 
     bool PackageDownloadExtractTarget::extract_from_cache()
@@ -163,7 +163,7 @@ namespace mamba
         if (m_validation_result != VALIDATION_RESULT::VALID)
         {
             // abort here, but set finished to true
-            m_finished = true;
+            set_finished();
             return true;
         }
 
@@ -183,24 +183,89 @@ namespace mamba
 
     bool PackageDownloadExtractTarget::finalize_callback()
     {
+        m_download_finished = true;
         m_progress_proxy.set_progress(100);
         m_progress_proxy.set_postfix("Validating...");
 
         LOG_INFO << "Download finished, validating " << m_tarball_path;
 
-        thread v(&PackageDownloadExtractTarget::validate_extract, this);
-        v.detach();
+        m_extract_future = thread_pool::global().submit(
+            &PackageDownloadExtractTarget::validate_extract, this);
 
         return true;
     }
 
     bool PackageDownloadExtractTarget::finished()
     {
+        std::lock_guard<std::mutex> lock(m_finished_mutex);
         return m_finished;
     }
 
+    void PackageDownloadExtractTarget::set_finished()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_finished_mutex);
+            m_finished = true;
+        }
+        m_finished_cv.notify_all();
+    }
+
+    void PackageDownloadExtractTarget::set_validation_result(VALIDATION_RESULT result)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_finished_mutex);
+            m_validation_result = result;
+            m_validated = true;
+        }
+        m_finished_cv.notify_all();
+    }
+
+    bool PackageDownloadExtractTarget::wait_finished()
+    {
+        std::unique_lock<std::mutex> lock(m_finished_mutex);
+        // the signal handler does not notify us, so wake up regularly to
+        // check for interruptions
+        while (!m_finished_cv.wait_for(
+            lock, std::chrono::milliseconds(100), [this]() { return m_finished; }))
+        {
+            if (is_sig_interrupted())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool PackageDownloadExtractTarget::wait_validated()
+    {
+        std::unique_lock<std::mutex> lock(m_finished_mutex);
+        while (!m_finished_cv.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+            return m_validated || m_finished;
+        }))
+        {
+            if (is_sig_interrupted())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void PackageDownloadExtractTarget::set_download_failed()
+    {
+        // only called from the download thread, as is finalize_callback
+        if (m_target && !m_download_finished)
+        {
+            set_validation_result(VALIDATION_RESULT::DOWNLOAD_ERROR);
+            m_progress_proxy.mark_as_completed("Download error");
+            set_finished();
+        }
+    }
+
     auto PackageDownloadExtractTarget::validation_result() const
     {
+        // also read while the extraction is running, see wait_validated()
+        std::lock_guard<std::mutex> lock(m_finished_mutex);
         return m_validation_result;
     }
 
@@ -234,9 +299,9 @@ namespace mamba
         if (valid && !dest_dir_exists)
         {
             m_progress_proxy = Console::instance().add_progress_bar(m_name);
-            m_validation_result = VALIDATION_RESULT::VALID;
-            thread v(&PackageDownloadExtractTarget::extract_from_cache, this);
-            v.detach();
+            set_validation_result(VALIDATION_RESULT::VALID);
+            m_extract_future = thread_pool::global().submit(
+                &PackageDownloadExtractTarget::extract_from_cache, this);
             return nullptr;
         }
 
@@ -255,7 +320,7 @@ namespace mamba
         else
         {
             LOG_INFO << "Using cache " << m_name;
-            m_finished = true;
+            set_finished();
         }
         return m_target.get();
     }
@@ -289,10 +354,10 @@ namespace mamba
                 "Cannot create transaction without calling solver.solve() first.");
         }
 
-        m_transaction = solver_create_transaction(solver);
+        m_transaction = solver.create_transaction();
         transaction_order(m_transaction, 0);
 
-        auto* pool = static_cast<Solver*>(solver)->pool;
+        auto* pool = m_transaction->pool;
 
         m_history_entry = History::UserRequest::prefilled();
 
@@ -365,14 +430,140 @@ namespace mamba
         }
     }
 
+    MTransaction::MTransaction(MPool& pool,
+                               const std::vector<PackageInfo>& to_remove,
+                               const std::vector<PackageInfo>& to_install,
+                               MultiPackageCache& cache)
+        : m_multi_cache(cache)
+    {
+        Pool* p = pool;
+        if (!to_remove.empty() && p->installed == nullptr)
+        {
+            throw std::runtime_error("Cannot remove packages without installed repo.");
+        }
+
+        m_explicit_repo = std::make_unique<MRepo>(pool, "explicit", to_install);
+        pool.create_whatprovides();
+
+        std::set<std::string> remove_names;
+        for (const auto& pkg : to_remove)
+        {
+            remove_names.insert(pkg.name);
+        }
+
+        // the decisions describe the final state of the prefix
+        Queue decisions;
+        queue_init(&decisions);
+        Id id;
+        Solvable* s;
+        if (p->installed)
+        {
+            std::size_t removed = 0;
+            FOR_REPO_SOLVABLES(p->installed, id, s)
+            {
+                if (remove_names.count(pool_id2str(p, s->name)))
+                {
+                    queue_push(&decisions, -id);
+                    removed++;
+                }
+                else
+                {
+                    queue_push(&decisions, id);
+                }
+            }
+            if (removed != remove_names.size())
+            {
+                queue_free(&decisions);
+                throw std::runtime_error("Cannot remove packages that are not installed.");
+            }
+        }
+        FOR_REPO_SOLVABLES(m_explicit_repo->repo(), id, s)
+        {
+            queue_push(&decisions, id);
+        }
+
+        m_transaction = transaction_create_decisionq(p, &decisions, nullptr);
+        queue_free(&decisions);
+
+        // The repo has no dependency information to order the transaction,
+        // but explicit files are written in dependency order already: keep
+        // the removals first, then link in the order of the packages.
+        std::map<Id, int> position;
+        FOR_REPO_SOLVABLES(m_explicit_repo->repo(), id, s)
+        {
+            position[id] = static_cast<int>(position.size());
+        }
+        auto step_position = [&](Id step) -> int {
+            auto it = position.find(step);
+            if (it == position.end())
+            {
+                it = position.find(transaction_obs_pkg(m_transaction, step));
+            }
+            return it != position.end() ? it->second : -1;
+        };
+        Queue& steps = m_transaction->steps;
+        std::stable_sort(steps.elements, steps.elements + steps.count, [&](Id a, Id b) {
+            return step_position(a) < step_position(b);
+        });
+
+        m_history_entry = History::UserRequest::prefilled();
+        for (const auto& pkg : to_install)
+        {
+            m_history_entry.update.push_back(pkg.url);
+        }
+        for (const auto& pkg : to_remove)
+        {
+            if (!std::any_of(to_install.begin(), to_install.end(), [&](const PackageInfo& i) {
+                    return i.name == pkg.name;
+                }))
+            {
+                m_history_entry.remove.push_back(pkg.name);
+            }
+        }
+
+        // the packages differ from the installed ones on purpose, even if
+        // only their md5 changed
+        m_force_reinstall = true;
+
+        init();
+        if (!empty())
+        {
+            JsonLogger::instance().json_down("actions");
+            JsonLogger::instance().json_write({ { "PREFIX", Context::instance().target_prefix } });
+        }
+    }
+
     MTransaction::~MTransaction()
     {
         LOG_INFO << "Freeing transaction.";
-        transaction_free(m_transaction);
+        finish_fetch();
     }
 
     void MTransaction::init()
     {
+        Pool* pool = m_transaction->pool;
+        std::map<Id, int> remove_index, install_index;
+        auto add_remove = [&](Id p) {
+            auto it = remove_index.find(p);
+            if (it != remove_index.end())
+            {
+                return it->second;
+            }
+            m_to_remove.emplace_back(pool_id2solvable(pool, p));
+            return remove_index[p] = m_to_remove.size() - 1;
+        };
+        auto add_install = [&](Id p) {
+            auto it = install_index.find(p);
+            if (it != install_index.end())
+            {
+                return it->second;
+            }
+            Solvable* s = pool_id2solvable(pool, p);
+            m_to_install.emplace_back(s);
+            m_install_repos.push_back(s->repo->repoid);
+            return install_index[p] = m_to_install.size() - 1;
+        };
+
         Queue classes, pkgs;
 
         queue_init(&classes);
@@ -393,9 +584,19 @@ namespace mamba
             for (int j = 0; j < pkgs.count; j++)
             {
                 Id p = pkgs.elements[j];
-                Solvable* s = m_transaction->pool->solvables + p;
-
-                if (filter(s))
+                Solvable* s = pool->solvables + p;
+                bool is_change = cls == SOLVER_TRANSACTION_DOWNGRADED
+                                 || cls == SOLVER_TRANSACTION_UPGRADED
+                                 || cls == SOLVER_TRANSACTION_CHANGED
+                                 || cls == SOLVER_TRANSACTION_REINSTALLED;
+
+                m_classified.push_back({ cls, filter(s), { PackageInfo(s) } });
+                if (is_change)
+                {
+                    m_classified.back().packages.emplace_back(
+                        pool->solvables + transaction_obs_pkg(m_transaction, p));
+                }
+                if (m_classified.back().ignored)
                 {
                     continue;
                 }
@@ -408,15 +609,14 @@ namespace mamba
                     case SOLVER_TRANSACTION_REINSTALLED:
                         if (cls == SOLVER_TRANSACTION_REINSTALLED && m_force_reinstall == false)
                             break;
-                        m_to_remove.push_back(s);
-                        m_to_install.push_back(m_transaction->pool->solvables
-                                               + transaction_obs_pkg(m_transaction, p));
+                        add_remove(p);
+                        add_install(transaction_obs_pkg(m_transaction, p));
                         break;
                     case SOLVER_TRANSACTION_ERASE:
-                        m_to_remove.push_back(s);
+                        add_remove(p);
                         break;
                     case SOLVER_TRANSACTION_INSTALL:
-                        m_to_install.push_back(s);
+                        add_install(p);
                         break;
                     case SOLVER_TRANSACTION_IGNORE:
                         break;
@@ -431,30 +631,60 @@ namespace mamba
 
         queue_free(&classes);
         queue_free(&pkgs);
-    }
 
-    std::string MTransaction::find_python_version()
-    {
+        // Like conda, all the packages are unlinked first, and the new ones
+        // linked afterwards in transaction order.
+        for (int i = 0; i < m_transaction->steps.count; i++)
+        {
+            Id p = m_transaction->steps.elements[i];
+            Id ttype = transaction_type(m_transaction, p, SOLVER_TRANSACTION_SHOW_ALL);
+
+            if (filter(pool_id2solvable(pool, p)))
+            {
+                continue;
+            }
+
+            switch (ttype)
+            {
+                case SOLVER_TRANSACTION_DOWNGRADED:
+                case SOLVER_TRANSACTION_UPGRADED:
+                case SOLVER_TRANSACTION_CHANGED:
+                case SOLVER_TRANSACTION_REINSTALLED:
+                    if (ttype == SOLVER_TRANSACTION_REINSTALLED && m_force_reinstall == false)
+                        break;
+                    m_steps.emplace_back(add_remove(p),
+                                         add_install(transaction_obs_pkg(m_transaction, p)));
+                    break;
+                case SOLVER_TRANSACTION_ERASE:
+                    m_steps.emplace_back(add_remove(p), -1);
+                    break;
+                case SOLVER_TRANSACTION_INSTALL:
+                    m_steps.emplace_back(-1, add_install(p));
+                    break;
+                case SOLVER_TRANSACTION_IGNORE:
+                    break;
+                default:
+                    LOG_ERROR << "Exec case not handled: " << ttype;
+                    break;
+            }
+        }
+
         // We need to find the python version that will be there after this
         // Transaction is finished in order to compile the noarch packages correctly,
         // for example
-        Pool* pool = m_transaction->pool;
-        assert(pool != nullptr);
-
-        std::string py_ver;
-        Id python = pool_str2id(pool, "python", 0);
-
-        for (Solvable* s : m_to_install)
+        for (const auto& pkg : m_to_install)
         {
-            if (s->name == python)
+            if (pkg.name == "python")
             {
-                py_ver = pool_id2str(pool, s->evr);
-                LOG_INFO << "Found python version in packages to be installed " << py_ver;
-                return py_ver;
+                m_python_version = pkg.version;
+                LOG_INFO << "Found python version in packages to be installed "
+                         << m_python_version;
+                break;
             }
         }
-        if (pool->installed != nullptr)
+        if (m_python_version.empty() && pool->installed != nullptr)
         {
+            Id python = pool_str2id(pool, "python", 0);
             Id p;
             Solvable* s;
 
@@ -462,22 +692,29 @@ namespace mamba
             {
                 if (s->name == python)
                 {
-                    py_ver = pool_id2str(pool, s->evr);
-                    LOG_INFO << "Found python in installed packages " << py_ver;
+                    m_python_version = pool_id2str(pool, s->evr);
+                    LOG_INFO << "Found python in installed packages " << m_python_version;
                     break;
                 }
             }
-        }
-        if (py_ver.size())
-        {
             // we need to make sure that we're not about to remove python!
-            for (Solvable* s : m_to_remove)
+            for (const auto& pkg : m_to_remove)
             {
-                if (s->name == python)
-                    return "";
+                if (pkg.name == "python")
+                {
+                    m_python_version.clear();
+                }
             }
         }
-        return py_ver;
+
+        // the pool is not needed anymore
+        transaction_free(m_transaction);
+        m_transaction = nullptr;
+    }
+
+    std::string MTransaction::find_python_version()
+    {
+        return m_python_version;
     }
 
     class TransactionRollback
@@ -493,26 +730,93 @@ namespace mamba
             m_link_stack.push(link);
         }
 
+        // every step is undone, even if some of them fail
         void rollback()
         {
             while (!m_link_stack.empty())
             {
-                m_link_stack.top().undo();
+                undo(m_link_stack.top());
                 m_link_stack.pop();
             }
 
             while (!m_unlink_stack.empty())
             {
-                m_unlink_stack.top().undo();
+                undo(m_unlink_stack.top());
                 m_unlink_stack.pop();
             }
         }
 
     private:
+        template <class T>
+        void undo(T& step)
+        {
+            try
+            {
+                step.undo();
+            }
+            catch (const std::exception& e)
+            {
+                LOG_ERROR << "Could not roll back: " << e.what();
+            }
+        }
+
         std::stack<UnlinkPackage> m_unlink_stack;
         std::stack<LinkPackage> m_link_stack;
     };
 
+    namespace
+    {
+        // Unlinking a package only removes the files it owns, so the unlinks
+        // of a transaction are independent of each other and can run
+        // concurrently. The executed ones are recorded for the rollback, also
+        // when another one fails.
+        void execute_unlinks(std::vector<UnlinkPackage>& unlinks, TransactionRollback& rollback)
+        {
+            std::vector<std::future<bool>> futures;
+            for (auto& unlink : unlinks)
+            {
+                futures.push_back(
+                    thread_pool::global().submit(&UnlinkPackage::execute, &unlink));
+            }
+
+            std::exception_ptr error;
+            for (std::size_t i = 0; i < futures.size(); ++i)
+            {
+                try
+                {
+                    futures[i].get();
+                    rollback.record(unlinks[i]);
+                }
+                catch (thread_interrupted&)
+                {
+                }
+                catch (...)
+                {
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+            }
+
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }  // namespace
+
+    bool MTransaction::execute(PrefixData& prefix,
+                               const fs::path& cache_dir,
+                               std::vector<MRepo*>& repos)
+    {
+        if (!Context::instance().dry_run && !empty())
+        {
+            start_fetch(cache_dir, repos);
+        }
+        return execute(prefix, cache_dir);
+    }
+
     bool MTransaction::execute(PrefixData& prefix, const fs::path& cache_dir)
     {
         // JSON output
@@ -540,79 +844,101 @@ namespace mamba
 
         TransactionRollback rollback;
 
-        auto* pool = m_transaction->pool;
+        // Like conda, all the packages are unlinked first, and the new ones
+        // linked afterwards in transaction order.
+        std::vector<UnlinkPackage> to_unlink;
+        std::vector<PackageInfo> to_link;
+        // whether the rollback can relink every unlinked package from the cache
+        bool relinkable = true;
+        auto add_unlink = [&](const PackageInfo& p) {
+            to_unlink.emplace_back(p, fs::path(cache_dir), &m_transaction_context);
+            fs::path extracted = fs::path(cache_dir) / p.str() / "info";
+            relinkable = relinkable && fs::exists(extracted / "paths.json")
+                         && fs::exists(extracted / "repodata_record.json");
+        };
 
-        for (int i = 0; i < m_transaction->steps.count && !is_sig_interrupted(); i++)
+        for (const auto& [unlink, link] : m_steps)
         {
-            Id p = m_transaction->steps.elements[i];
-            Id ttype = transaction_type(m_transaction, p, SOLVER_TRANSACTION_SHOW_ALL);
-            Solvable* s = pool_id2solvable(pool, p);
+            if (unlink >= 0 && link >= 0)
+            {
+                const PackageInfo& p_unlink = m_to_remove[unlink];
+                const PackageInfo& p_link = m_to_install[link];
+                Console::stream() << "Changing " << p_unlink.str() << " ==> " << p_link.str();
+
+                add_unlink(p_unlink);
+                to_link.push_back(p_link);
 
-            if (filter(s))
+                m_history_entry.unlink_dists.push_back(p_unlink.long_str());
+                m_history_entry.link_dists.push_back(p_link.long_str());
+            }
+            else if (unlink >= 0)
             {
-                continue;
+                const PackageInfo& p = m_to_remove[unlink];
+                Console::stream() << "Unlinking " << p.str();
+                add_unlink(p);
+                m_history_entry.unlink_dists.push_back(p.long_str());
             }
-
-            switch (ttype)
+            else
             {
-                case SOLVER_TRANSACTION_DOWNGRADED:
-                case SOLVER_TRANSACTION_UPGRADED:
-                case SOLVER_TRANSACTION_CHANGED:
-                case SOLVER_TRANSACTION_REINSTALLED:
-                {
-                    if (ttype == SOLVER_TRANSACTION_REINSTALLED && m_force_reinstall == false)
-                        break;
-
-                    Solvable* s2
-                        = m_transaction->pool->solvables + transaction_obs_pkg(m_transaction, p);
-                    Console::stream()
-                        << "Changing " << PackageInfo(s).str() << " ==> " << PackageInfo(s2).str();
-                    PackageInfo p_unlink(s);
-                    PackageInfo p_link(s2);
-
-                    UnlinkPackage up(p_unlink, fs::path(cache_dir), &m_transaction_context);
-                    up.execute();
-                    rollback.record(up);
-
-                    LinkPackage lp(p_link, fs::path(cache_dir), &m_transaction_context);
-                    lp.execute();
-                    rollback.record(lp);
+                const PackageInfo& p = m_to_install[link];
+                to_link.push_back(p);
+                m_history_entry.link_dists.push_back(p.long_str());
+            }
+        }
 
-                    m_history_entry.unlink_dists.push_back(p_unlink.long_str());
-                    m_history_entry.link_dists.push_back(p_link.long_str());
+        // The packages are linked in transaction order as soon as they are
+        // validated and extracted, while the other downloads are running: a
+        // failed download then relies on the rollback relinking the unlinked
+        // packages from the cache. When one of them is not in the cache
+        // anymore, the prefix is only modified once every download is
+        // validated (the extractions are still running meanwhile).
+        bool fetch_failed = false;
+        // a failed unlink or link (e.g. no space left) rolls back the others,
+        // the prefix is then finalized as usual before rethrowing
+        std::exception_ptr error;
+        try
+        {
+            if (!relinkable && !wait_for_downloads())
+            {
+                fetch_failed = !is_sig_interrupted();
+            }
+            else
+            {
+                execute_unlinks(to_unlink, rollback);
+            }
 
-                    break;
-                }
-                case SOLVER_TRANSACTION_ERASE:
-                {
-                    PackageInfo p(s);
-                    Console::stream() << "Unlinking " << PackageInfo(s).str();
-                    UnlinkPackage up(p, fs::path(cache_dir), &m_transaction_context);
-                    up.execute();
-                    rollback.record(up);
-                    m_history_entry.unlink_dists.push_back(p.long_str());
-                    break;
-                }
-                case SOLVER_TRANSACTION_INSTALL:
+            for (std::size_t i = 0;
+                 i < to_link.size() && !fetch_failed && !is_sig_interrupted();
+                 ++i)
+            {
+                if (!wait_for_fetch(to_link[i].name))
                 {
-                    PackageInfo p(s);
-                    Console::stream() << "Linking " << p.str();
-                    LinkPackage lp(p, fs::path(cache_dir), &m_transaction_context);
-                    lp.execute();
-                    rollback.record(lp);
-                    m_history_entry.link_dists.push_back(p.long_str());
+                    fetch_failed = !is_sig_interrupted();
                     break;
                 }
-                case SOLVER_TRANSACTION_IGNORE:
-                    break;
-                default:
-                    LOG_ERROR << "Exec case not handled: " << ttype;
-                    break;
+                Console::stream() << "Linking " << to_link[i].str();
+                LinkPackage lp(to_link[i], fs::path(cache_dir), &m_transaction_context);
+                lp.execute();
+                rollback.record(lp);
             }
         }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
 
         bool interrupted = is_sig_interrupted();
-        if (interrupted)
+        if (error)
+        {
+            Console::stream() << "Transaction failed, rollbacking";
+            rollback.rollback();
+        }
+        else if (fetch_failed)
+        {
+            Console::stream() << "Found incorrect download, rollbacking";
+            rollback.rollback();
+        }
+        else if (interrupted)
         {
             Console::stream() << "Transaction interrupted, rollbacking";
             rollback.rollback();
@@ -622,39 +948,43 @@ namespace mamba
             Console::stream() << "Transaction finished";
             prefix.history().add_entry(m_history_entry);
         }
+        finish_fetch();
+        m_transaction_context.dir_cache->prune_empty_directories();
+        m_transaction_context.file_index->save();
+        // last, once every record is written
+        try
+        {
+            prefix.update_index();
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not update the package record index: " << e.what();
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        if (fetch_failed)
+        {
+            throw std::runtime_error("Found incorrect download. Aborting");
+        }
         return !interrupted;
     }
 
     auto MTransaction::to_conda() -> to_conda_type
     {
-        Id real_repo_key = pool_str2id(m_transaction->pool, "solvable:real_repo_url", 1);
-
         to_install_type to_install_structured;
         to_remove_type to_remove_structured;
 
-        for (Solvable* s : m_to_remove)
+        for (const auto& pkg : m_to_remove)
         {
-            const char* mediafile = solvable_lookup_str(s, SOLVABLE_MEDIAFILE);
-            to_remove_structured.emplace_back(s->repo->name, mediafile);
+            to_remove_structured.emplace_back(pkg.channel, pkg.fn);
         }
 
-        for (Solvable* s : m_to_install)
+        for (const auto& pkg : m_to_install)
         {
-            const char* mediafile = solvable_lookup_str(s, SOLVABLE_MEDIAFILE);
-            std::string s_json = solvable_to_json(s).dump(4);
-
-            std::string channel;
-            if (solvable_lookup_str(s, real_repo_key))
-            {
-                channel = solvable_lookup_str(s, real_repo_key);
-            }
-            else
-            {
-                channel = s->repo->name;  // note this can and should be <unknown> when
-                                          // e.g. installing from a tarball
-            }
-
-            to_install_structured.emplace_back(channel, mediafile, s_json);
+            to_install_structured.emplace_back(pkg.channel, pkg.fn, pkg.json().dump(4));
         }
 
         to_specs_type specs;
@@ -669,16 +999,16 @@ namespace mamba
         std::vector<nlohmann::json> to_fetch;
         std::vector<nlohmann::json> to_link;
 
-        for (Solvable* s : m_to_install)
+        for (const auto& pkg : m_to_install)
         {
-            if (this->m_multi_cache.query(s))
+            if (this->m_multi_cache.query(pkg))
             {
-                to_link.push_back(solvable_to_json(s));
+                to_link.push_back(pkg.json());
             }
             else
             {
-                to_fetch.push_back(solvable_to_json(s));
-                to_link.push_back(solvable_to_json(s));
+                to_fetch.push_back(pkg.json());
+                to_link.push_back(pkg.json());
             }
         }
 
@@ -699,22 +1029,28 @@ namespace mamba
         }
     }
 
-    bool MTransaction::fetch_extract_packages(const std::string& cache_dir,
-                                              std::vector<MRepo*>& repos)
+    void MTransaction::start_fetch(const fs::path& cache_dir, std::vector<MRepo*>& repos)
     {
-        fs::path cache_path(cache_dir);
-        std::vector<std::unique_ptr<PackageDownloadExtractTarget>> targets;
-        MultiDownloadTarget multi_dl;
+        if (m_fetch_started)
+        {
+            return;
+        }
+        m_fetch_started = true;
 
+        m_multi_dl = std::make_unique<MultiDownloadTarget>();
         Console::instance().init_multi_progress();
 
-        for (auto& s : m_to_install)
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
         {
-            std::string url;
+            Id repoid = m_install_repos[i];
             MRepo* mamba_repo = nullptr;
+            if (m_explicit_repo && m_explicit_repo->id() == repoid)
+            {
+                mamba_repo = m_explicit_repo.get();
+            }
             for (auto& r : repos)
             {
-                if (r->repo() == s->repo)
+                if (r->id() == repoid)
                 {
                     mamba_repo = r;
                     break;
@@ -729,52 +1065,116 @@ namespace mamba
                 continue;
             }
 
-            targets.emplace_back(std::make_unique<PackageDownloadExtractTarget>(s));
-            multi_dl.add(targets[targets.size() - 1]->target(cache_path, m_multi_cache));
+            m_fetch_targets.emplace_back(
+                std::make_unique<PackageDownloadExtractTarget>(m_to_install[i]));
+            m_multi_dl->add(m_fetch_targets.back()->target(cache_dir, m_multi_cache));
         }
 
-        interruption_guard g([]() { Console::instance().init_multi_progress(); });
-
-        bool downloaded = multi_dl.download(true);
-        bool all_valid = true;
+        m_fetch_thread = thread([this]() {
+            try
+            {
+                m_downloaded = m_multi_dl->download(true);
+            }
+            catch (std::exception& e)
+            {
+                LOG_ERROR << "Download failed: " << e.what();
+            }
+            if (!m_downloaded)
+            {
+                // do not let anybody wait for packages that will never arrive
+                for (auto& t : m_fetch_targets)
+                {
+                    t->set_download_failed();
+                }
+            }
+        });
+    }
 
-        if (!downloaded)
+    bool MTransaction::wait_for_fetch(PackageDownloadExtractTarget& target, bool extracted)
+    {
+        if (!(extracted ? target.wait_finished() : target.wait_validated()))
         {
-            LOG_ERROR << "Download didn't finish!";
             return false;
         }
-        // make sure that all targets have finished extracting
-        while (!is_sig_interrupted())
+        auto result = target.validation_result();
+        if (result != PackageDownloadExtractTarget::VALIDATION_RESULT::VALID
+            && result != PackageDownloadExtractTarget::VALIDATION_RESULT::UNDEFINED)
         {
-            bool all_finished = true;
-            for (const auto& t : targets)
+            if (result != PackageDownloadExtractTarget::VALIDATION_RESULT::DOWNLOAD_ERROR)
             {
-                if (!t->finished())
-                {
-                    all_finished = false;
-                    break;
-                }
+                // the extraction (if any) has finished with the failure
+                target.wait_finished();
+                target.clear_cache();
             }
-            if (all_finished)
+            return false;
+        }
+        return true;
+    }
+
+    bool MTransaction::wait_for_fetch(const std::string& name)
+    {
+        for (const auto& t : m_fetch_targets)
+        {
+            if (t->name() == name)
             {
-                break;
+                return wait_for_fetch(*t, true);
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
+        // not fetched by this transaction
+        return true;
+    }
+
+    bool MTransaction::wait_for_downloads()
+    {
+        for (const auto& t : m_fetch_targets)
+        {
+            if (!wait_for_fetch(*t, false))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void MTransaction::finish_fetch()
+    {
+        if (m_fetch_thread.joinable())
+        {
+            m_fetch_thread.join();
+            // the validation and extraction tasks hold on to the targets
+            wait_for_all_threads();
+        }
+    }
+
+    bool MTransaction::fetch_extract_packages(const std::string& cache_dir,
+                                              std::vector<MRepo*>& repos)
+    {
+        interruption_guard g([]() { Console::instance().init_multi_progress(); });
 
-        for (const auto& t : targets)
+        start_fetch(cache_dir, repos);
+
+        bool all_valid = true;
+        for (const auto& t : m_fetch_targets)
         {
-            if (t->validation_result() != PackageDownloadExtractTarget::VALIDATION_RESULT::VALID
-                && t->validation_result()
-                       != PackageDownloadExtractTarget::VALIDATION_RESULT::UNDEFINED)
+            if (!wait_for_fetch(*t, true))
             {
-                t->clear_cache();
                 all_valid = false;
-                throw std::runtime_error("Found incorrect download. Aborting");
+                break;
             }
         }
+        finish_fetch();
+
+        if (!m_downloaded)
+        {
+            LOG_ERROR << "Download didn't finish!";
+            return false;
+        }
+        if (!all_valid && !is_sig_interrupted())
+        {
+            throw std::runtime_error("Found incorrect download. Aborting");
+        }
 
-        return !is_sig_interrupted() && downloaded && all_valid;
+        return !is_sig_interrupted() && all_valid;
     }
 
     bool MTransaction::empty()
@@ -798,6 +1198,16 @@ namespace mamba
         return res;
     }
 
+    bool MTransaction::prompt()
+    {
+        print();
+        if (Context::instance().dry_run || empty())
+        {
+            return true;
+        }
+        return Console::prompt("Confirm changes", 'y');
+    }
+
     void MTransaction::print()
     {
         if (Context::instance().json)
@@ -850,21 +1260,16 @@ namespace mamba
                           printers::alignment::left,
                           printers::alignment::right });
         t.set_padding({ 2, 2, 2, 2, 5 });
-        Queue classes, pkgs;
-
-        queue_init(&classes);
-        queue_init(&pkgs);
 
         using rows = std::vector<std::vector<printers::FormattedString>>;
 
         rows downgraded, upgraded, changed, erased, installed, ignored;
         std::size_t total_size = 0;
-        auto* pool = m_transaction->pool;
 
-        auto format_row = [this, pool, &total_size](rows& r, Solvable* s, printers::format flag) {
-            std::ptrdiff_t dlsize = solvable_lookup_num(s, SOLVABLE_DOWNLOADSIZE, -1);
+        auto format_row = [this, &total_size](
+                              rows& r, const PackageInfo& s, printers::format flag) {
             printers::FormattedString dlsize_s;
-            if (dlsize != -1)
+            if (s.size != 0)
             {
                 if (static_cast<std::size_t>(flag)
                     & static_cast<std::size_t>(printers::format::yellow))
@@ -878,107 +1283,70 @@ namespace mamba
                 }
                 else
                 {
-                    std::stringstream s;
-                    to_human_readable_filesize(s, dlsize);
-                    dlsize_s.s = s.str();
+                    std::stringstream s_size;
+                    to_human_readable_filesize(s_size, s.size);
+                    dlsize_s.s = s_size.str();
                     // Hacky hacky
                     if (static_cast<std::size_t>(flag)
                         & static_cast<std::size_t>(printers::format::green))
                     {
-                        total_size += dlsize;
+                        total_size += s.size;
                     }
                 }
             }
             printers::FormattedString name;
-            name.s = pool_id2str(pool, s->name);
+            name.s = s.name;
             name.flag = flag;
-            const char* build_string = solvable_lookup_str(s, SOLVABLE_BUILDFLAVOR);
-
-            std::string channel;
-            Id real_repo_key = pool_str2id(pool, "solvable:real_repo_url", 1);
-            if (solvable_lookup_str(s, real_repo_key))
-            {
-                channel = solvable_lookup_str(s, real_repo_key);
-            }
-            else
-            {
-                channel = s->repo->name;  // note this can and should be <unknown> when
-                                          // e.g. installing from a tarball
-            }
 
             r.push_back({ name,
-                          printers::FormattedString(pool_id2str(pool, s->evr)),
-                          printers::FormattedString(build_string ? build_string : ""),
-                          printers::FormattedString(cut_repo_name(channel)),
+                          printers::FormattedString(s.version),
+                          printers::FormattedString(s.build_string),
+                          printers::FormattedString(cut_repo_name(s.channel)),
                           dlsize_s });
         };
 
-        int mode = SOLVER_TRANSACTION_SHOW_OBSOLETES | SOLVER_TRANSACTION_OBSOLETE_IS_UPGRADE;
-        transaction_classify(m_transaction, mode, &classes);
-        Id cls;
-        for (int i = 0; i < classes.count; i += 4)
+        for (const auto& c : m_classified)
         {
-            cls = classes.elements[i];
-            transaction_classify_pkgs(
-                m_transaction, mode, cls, classes.elements[i + 2], classes.elements[i + 3], &pkgs);
-
-            for (int j = 0; j < pkgs.count; j++)
+            const PackageInfo& s = c.packages.front();
+            if (c.ignored)
             {
-                Id p = pkgs.elements[j];
-                Solvable* s = m_transaction->pool->solvables + p;
-
-                if (filter(s))
-                {
-                    format_row(ignored, s, printers::format::yellow);
-                    continue;
-                }
-                switch (cls)
-                {
-                    case SOLVER_TRANSACTION_UPGRADED:
-                        format_row(upgraded, s, printers::format::red);
-                        format_row(upgraded,
-                                   m_transaction->pool->solvables
-                                       + transaction_obs_pkg(m_transaction, p),
-                                   printers::format::green);
+                format_row(ignored, s, printers::format::yellow);
+                continue;
+            }
+            switch (c.cls)
+            {
+                case SOLVER_TRANSACTION_UPGRADED:
+                    format_row(upgraded, s, printers::format::red);
+                    format_row(upgraded, c.packages.back(), printers::format::green);
+                    break;
+                case SOLVER_TRANSACTION_CHANGED:
+                case SOLVER_TRANSACTION_REINSTALLED:
+                    if (c.cls == SOLVER_TRANSACTION_REINSTALLED && m_force_reinstall == false)
                         break;
-                    case SOLVER_TRANSACTION_CHANGED:
-                    case SOLVER_TRANSACTION_REINSTALLED:
-                        if (cls == SOLVER_TRANSACTION_REINSTALLED && m_force_reinstall == false)
-                            break;
 
-                        format_row(changed, s, printers::format::red);
-                        format_row(changed,
-                                   m_transaction->pool->solvables
-                                       + transaction_obs_pkg(m_transaction, p),
-                                   printers::format::green);
-                        break;
-                    case SOLVER_TRANSACTION_DOWNGRADED:
-                        format_row(downgraded, s, printers::format::red);
-                        format_row(downgraded,
-                                   m_transaction->pool->solvables
-                                       + transaction_obs_pkg(m_transaction, p),
-                                   printers::format::green);
-                        break;
-                    case SOLVER_TRANSACTION_ERASE:
-                        format_row(erased, s, printers::format::red);
-                        break;
-                    case SOLVER_TRANSACTION_INSTALL:
-                        format_row(installed, s, printers::format::green);
-                        break;
-                    case SOLVER_TRANSACTION_IGNORE:
-                        break;
-                    case SOLVER_TRANSACTION_VENDORCHANGE:
-                    case SOLVER_TRANSACTION_ARCHCHANGE:
-                    default:
-                        LOG_ERROR << "Print case not handled: " << cls;
-                        break;
-                }
+                    format_row(changed, s, printers::format::red);
+                    format_row(changed, c.packages.back(), printers::format::green);
+                    break;
+                case SOLVER_TRANSACTION_DOWNGRADED:
+                    format_row(downgraded, s, printers::format::red);
+                    format_row(downgraded, c.packages.back(), printers::format::green);
+                    break;
+                case SOLVER_TRANSACTION_ERASE:
+                    format_row(erased, s, printers::format::red);
+                    break;
+                case SOLVER_TRANSACTION_INSTALL:
+                    format_row(installed, s, printers::format::green);
+                    break;
+                case SOLVER_TRANSACTION_IGNORE:
+                    break;
+                case SOLVER_TRANSACTION_VENDORCHANGE:
+                case SOLVER_TRANSACTION_ARCHCHANGE:
+                default:
+                    LOG_ERROR << "Print case not handled: " << c.cls;
+                    break;
             }
         }
 
-        queue_free(&classes);
-        queue_free(&pkgs);
-
         std::stringstream summary;
         summary << "Summary:\n\n";
         if (installed.size())
@@ -1018,4 +1386,68 @@ namespace mamba
         t.add_row({ summary.str() });
         t.print(std::cout);
     }
+
+    std::vector<PackageInfo> explicit_specs_to_packages(const std::vector<std::string>& specs)
+    {
+        std::vector<PackageInfo> res;
+        for (auto& spec : specs)
+        {
+            std::string line(strip(spec));
+            if (line.empty() || line[0] == '#' || line[0] == '@')
+            {
+                continue;
+            }
+            std::size_t hash = line.find_first_of('#');
+            MatchSpec ms(line.substr(0, hash));
+            if (ms.url.empty())
+            {
+                throw std::runtime_error("Not an explicit package url: " + line);
+            }
+            PackageInfo p(ms.name);
+            p.url = ms.url;
+            p.build_string = ms.build;
+            p.version = ms.version;
+            p.channel = ms.channel;
+            p.subdir = ms.subdir;
+            p.fn = ms.fn;
+            if (hash != std::string::npos)
+            {
+                p.md5 = line.substr(hash + 1);
+            }
+            res.push_back(std::move(p));
+        }
+        return res;
+    }
+
+    std::pair<std::vector<PackageInfo>, std::vector<PackageInfo>> diff_prefix_packages(
+        const PrefixData& prefix, const std::vector<PackageInfo>& packages)
+    {
+        std::vector<PackageInfo> to_remove, to_install;
+        const auto& records = prefix.records();
+        std::set<std::string> wanted;
+        for (const auto& pkg : packages)
+        {
+            wanted.insert(pkg.name);
+            auto it = records.find(pkg.name);
+            if (it != records.end())
+            {
+                const PackageInfo& installed = it->second;
+                if (installed.version == pkg.version && installed.build_string == pkg.build_string
+                    && (installed.md5.empty() || pkg.md5.empty() || installed.md5 == pkg.md5))
+                {
+                    continue;
+                }
+                to_remove.push_back(installed);
+            }
+            to_install.push_back(pkg);
+        }
+        for (const auto& [name, record] : records)
+        {
+            if (wanted.find(name) == wanted.end())
+            {
+                to_remove.push_back(record);
+            }
+        }
+        return { to_remove, to_install };
+    }
 }  // namespace mamba
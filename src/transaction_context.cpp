@@ -73,6 +73,8 @@ namespace mamba
         : has_python(py_version.size() != 0)
         , target_prefix(prefix)
         , python_version(py_version)
+        , dir_cache(std::make_shared<DirectoryCache>(prefix))
+        , file_index(std::make_shared<PrefixFileIndex>(prefix))
     {
         if (python_version.size() == 0)
         {
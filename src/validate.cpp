@@ -5,7 +5,9 @@
 // The full license is in the file LICENSE, distributed with this software.
 
 #include <iostream>
+#include <stdexcept>
 
+#include "openssl/evp.h"
 #include "openssl/md5.h"
 #include "openssl/sha.h"
 #include "mamba/validate.hpp"
@@ -40,6 +42,16 @@ namespace validate
         return ::mamba::hex_string(hash);
     }
 
+    std::string sha256sum_string(const std::string& data)
+    {
+        std::array<unsigned char, SHA256_DIGEST_LENGTH> hash;
+        if (!EVP_Digest(data.data(), data.size(), hash.data(), nullptr, EVP_sha256(), nullptr))
+        {
+            throw std::runtime_error("Could not compute the sha256 of a string");
+        }
+        return ::mamba::hex_string(hash);
+    }
+
     std::string md5sum(const std::string& path)
     {
         std::array<unsigned char, MD5_DIGEST_LENGTH> hash;
@@ -0,0 +1,226 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+// Solves every environment of a corpus (one environment per line, its specs
+// separated by spaces) with the default solver and with the solver
+// portfolio, against repodata.json files in decreasing channel priority:
+//
+//   benchmark_solver [--portfolio N] [--repeat N] [--virtual __glibc=2.35]
+//                    [--batch N] corpus.txt repodata.json...
+//
+// With --batch, the whole corpus is also solved on one pool, one environment
+// after the other and with MSolver::solve_batch in N threads.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "mamba/context.hpp"
+#include "mamba/pool.hpp"
+#include "mamba/repo.hpp"
+#include "mamba/solver.hpp"
+#include "mamba/util.hpp"
+
+using namespace mamba;
+
+namespace
+{
+    struct result
+    {
+        bool success = false;
+        double ms = 0;
+        std::string winner;
+    };
+
+    std::vector<MRepo> load_repos(MPool& pool,
+                                  const std::vector<fs::path>& repodata_files,
+                                  const std::vector<PackageInfo>& virtual_packages)
+    {
+        std::vector<MRepo> repos;
+        repos.emplace_back(pool, "virtual", virtual_packages);
+        int priority = repodata_files.size();
+        for (const auto& file : repodata_files)
+        {
+            RepoMetadata meta{ "file://" + fs::absolute(file).string(), false, "", "" };
+            repos.emplace_back(pool, file.string(), file, meta);
+            repos.back().set_priority(priority--, 0);
+        }
+        return repos;
+    }
+
+    result solve(const std::vector<fs::path>& repodata_files,
+                 const std::vector<PackageInfo>& virtual_packages,
+                 const std::vector<std::string>& specs,
+                 std::size_t portfolio)
+    {
+        MPool pool;
+        auto repos = load_repos(pool, repodata_files, virtual_packages);
+
+        // the repos are loaded from their .solv cache after the first run
+        auto start = std::chrono::steady_clock::now();
+        MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+        solver.set_portfolio(portfolio);
+        solver.add_jobs(specs, SOLVER_INSTALL);
+        result res;
+        res.success = solver.solve();
+        res.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                     .count();
+        res.winner = solver.portfolio_winner();
+        return res;
+    }
+
+    // the whole corpus on one pool, in `threads` threads with solve_batch
+    // (which clones the pool for every thread) or one after the other if 0
+    double solve_corpus(const std::vector<fs::path>& repodata_files,
+                        const std::vector<PackageInfo>& virtual_packages,
+                        const std::vector<std::vector<std::string>>& corpus,
+                        std::size_t threads)
+    {
+        MPool pool;
+        auto repos = load_repos(pool, repodata_files, virtual_packages);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<MSolver>> solvers;
+        std::vector<MSolver*> solver_ptrs;
+        for (const auto& specs : corpus)
+        {
+            solvers.push_back(
+                std::make_unique<MSolver>(pool, std::vector<std::pair<int, int>>{
+                                                    { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } }));
+            solvers.back()->add_jobs(specs, SOLVER_INSTALL);
+            solver_ptrs.push_back(solvers.back().get());
+        }
+        if (threads)
+        {
+            MSolver::solve_batch(solver_ptrs, threads);
+        }
+        else
+        {
+            for (auto* solver : solver_ptrs)
+            {
+                solver->solve();
+            }
+        }
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::size_t portfolio = std::thread::hardware_concurrency();
+    int repeat = 3;
+    std::size_t batch = 0;
+    std::vector<PackageInfo> virtual_packages;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--portfolio" && i + 1 < argc)
+        {
+            portfolio = std::stoul(argv[++i]);
+        }
+        else if (arg == "--repeat" && i + 1 < argc)
+        {
+            repeat = std::stoi(argv[++i]);
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batch = std::stoul(argv[++i]);
+        }
+        else if (arg == "--virtual" && i + 1 < argc)
+        {
+            auto name_version = split(argv[++i], "=", 1);
+            virtual_packages.emplace_back(
+                name_version[0], name_version.size() > 1 ? name_version[1] : "0", "0", 0);
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+    if (args.size() < 2)
+    {
+        std::cerr << "usage: benchmark_solver [--portfolio N] [--repeat N] "
+                     "[--virtual name=version] [--batch N] corpus.txt repodata.json..."
+                  << std::endl;
+        return 1;
+    }
+
+    std::vector<std::vector<std::string>> corpus;
+    std::ifstream corpus_file(args[0]);
+    std::string line;
+    while (std::getline(corpus_file, line))
+    {
+        line = strip(line);
+        if (!line.empty() && line[0] != '#')
+        {
+            corpus.push_back(split(line, " "));
+        }
+    }
+    std::vector<fs::path> repodata_files(args.begin() + 1, args.end());
+
+    Context::instance().quiet = true;
+    // the portfolio and the batch run in the global thread pool, sized on first use
+    Context::instance().max_parallel_tasks = static_cast<int>(std::max(portfolio, batch));
+    double total_default = 0, total_portfolio = 0;
+    std::cout << std::left << std::setw(50) << "environment" << std::right << std::setw(12)
+              << "default ms" << std::setw(14) << "portfolio ms"
+              << "  winner" << std::endl;
+    for (const auto& specs : corpus)
+    {
+        result best_default, best_portfolio;
+        for (int i = 0; i < repeat; ++i)
+        {
+            result r = solve(repodata_files, virtual_packages, specs, 0);
+            if (i == 0 || r.ms < best_default.ms)
+            {
+                best_default = r;
+            }
+            r = solve(repodata_files, virtual_packages, specs, portfolio);
+            if (i == 0 || r.ms < best_portfolio.ms)
+            {
+                best_portfolio = r;
+            }
+        }
+        total_default += best_default.ms;
+        total_portfolio += best_portfolio.ms;
+
+        std::string name = join(" ", specs);
+        if (name.size() > 48)
+        {
+            name = name.substr(0, 45) + "...";
+        }
+        std::cout << std::left << std::setw(50) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(12) << best_default.ms << std::setw(14)
+                  << best_portfolio.ms << "  "
+                  << (best_portfolio.success ? best_portfolio.winner : "(no solution)")
+                  << (best_default.success != best_portfolio.success ? " MISMATCH" : "")
+                  << std::endl;
+    }
+    std::cout << std::left << std::setw(50) << "total" << std::right << std::setw(12)
+              << total_default << std::setw(14) << total_portfolio << std::endl;
+
+    if (batch)
+    {
+        double best_sequential = 0, best_batch = 0;
+        for (int i = 0; i < repeat; ++i)
+        {
+            double ms = solve_corpus(repodata_files, virtual_packages, corpus, 0);
+            best_sequential = i == 0 ? ms : std::min(best_sequential, ms);
+            ms = solve_corpus(repodata_files, virtual_packages, corpus, batch);
+            best_batch = i == 0 ? ms : std::min(best_batch, ms);
+        }
+        std::cout << "\none pool, " << corpus.size() << " environments: " << best_sequential
+                  << " ms one after the other, " << best_batch << " ms in a batch of " << batch
+                  << " threads" << std::endl;
+    }
+    return 0;
+}
@@ -1,8 +1,11 @@
 import argparse
 import base64
+import hashlib
+import json
 import os
 import re
 import socketserver
+import tempfile
 from http.server import HTTPServer, SimpleHTTPRequestHandler
 
 parser = argparse.ArgumentParser(description="Start a simple conda package server.")
@@ -21,6 +24,11 @@ parser.add_argument(
     type=str,
     help="auth method (none, basic, or token)",
 )
+parser.add_argument(
+    "--shards",
+    action="store_true",
+    help="serve the repodata of every subdir as shards (repodata_shards.json)",
+)
 args = parser.parse_args()
 
 os.chdir(args.directory)
@@ -86,6 +94,56 @@ class CondaTokenHandler(SimpleHTTPRequestHandler):
         self.wfile.write(b"no valid api key received")
 
 
+class ShardsMixin:
+    """ Serves <subdir>/repodata_shards.json and <subdir>/shards/<sha256>.json,
+    generated from <subdir>/repodata.json. """
+
+    shards_dir = tempfile.mkdtemp(prefix="shards-")
+    index_pattern = re.compile("^(.*)/repodata_shards.json$")
+    shard_pattern = re.compile("^(.*)/shards/([0-9a-f]{64}).json$")
+
+    def generate_shards(self, subdir):
+        repodata_file = os.path.join(os.getcwd(), subdir, "repodata.json")
+        out = os.path.join(self.shards_dir, subdir)
+        index_file = os.path.join(out, "repodata_shards.json")
+        if not os.path.exists(repodata_file):
+            return None
+        if os.path.exists(index_file) and os.path.getmtime(
+            index_file
+        ) >= os.path.getmtime(repodata_file):
+            return out
+
+        with open(repodata_file) as f:
+            repodata = json.load(f)
+        shards = {}
+        for section in ("packages", "packages.conda"):
+            for fn, record in repodata.get(section, {}).items():
+                shard = shards.setdefault(record["name"], {})
+                shard.setdefault(section, {})[fn] = record
+        os.makedirs(os.path.join(out, "shards"), exist_ok=True)
+        index = {"info": repodata.get("info", {}), "shards": {}}
+        for name, shard in shards.items():
+            data = json.dumps(shard, sort_keys=True).encode("utf-8")
+            sha256 = hashlib.sha256(data).hexdigest()
+            with open(os.path.join(out, "shards", sha256 + ".json"), "wb") as f:
+                f.write(data)
+            index["shards"][name] = sha256
+        with open(index_file, "w") as f:
+            json.dump(index, f)
+        return out
+
+    def translate_path(self, path):
+        path = path.split("?", 1)[0]
+        for pattern in (self.index_pattern, self.shard_pattern):
+            match = pattern.match(path)
+            if match:
+                subdir = match.group(1).strip("/")
+                out = self.generate_shards(subdir)
+                if out:
+                    return os.path.join(out, path[len(match.group(1)) + 1 :])
+        return super().translate_path(path)
+
+
 if not args.auth or args.auth == "none":
     handler = SimpleHTTPRequestHandler
 elif not args.auth or args.auth == "basic":
@@ -93,10 +151,14 @@ elif not args.auth or args.auth == "basic":
 elif not args.auth or args.auth == "token":
     handler = CondaTokenHandler
 
+if args.shards:
+    handler = type("ShardsHandler", (ShardsMixin, handler), {})
+
 PORT = args.port
 
 server = HTTPServer(("", PORT), handler)
-print("Server started at localhost:" + str(PORT))
+# the port is picked by the system with --port 0
+print("Server started at localhost:" + str(server.server_address[1]), flush=True)
 try:
     server.serve_forever()
 except:
@@ -1,10 +1,25 @@
 #include <gtest/gtest.h>
 
+#include <reproc++/reproc.hpp>
+
 #include "mamba/context.hpp"
 #include "mamba/fsutil.hpp"
 #include "mamba/history.hpp"
 #include "mamba/link.hpp"
 #include "mamba/match_spec.hpp"
+#include "mamba/package_handling.hpp"
+#include "mamba/patch_journal.hpp"
+#include "mamba/pool_snapshot.hpp"
+#include "mamba/prefix_data.hpp"
+#include "mamba/prefix_file_index.hpp"
+#include "mamba/repo.hpp"
+#include "mamba/repodata_index.hpp"
+#include "mamba/sharded_repodata.hpp"
+#include "mamba/solver.hpp"
+#include "mamba/subdirdata.hpp"
+#include "mamba/thread_utils.hpp"
+#include "mamba/transaction.hpp"
+#include "mamba/validate.hpp"
 
 namespace mamba
 {
@@ -22,6 +37,84 @@ namespace mamba
     //     lp.execute();
     // }
 
+    // serves a directory over HTTP with reposerver.py (copied next to the
+    // test binary), on a port picked by the system
+    class RepoServer
+    {
+    public:
+        RepoServer(const fs::path& directory)
+        {
+            reproc::options options;
+            options.redirect.err.type = reproc::redirect::discard;
+            options.stop = { { reproc::stop::terminate, reproc::milliseconds(1000) },
+                             { reproc::stop::kill, reproc::infinite } };
+            std::vector<std::string> args
+                = { "python", "reposerver.py", "-d", directory.string(), "-p", "0" };
+            if (m_process.start(args, options))
+            {
+                throw std::runtime_error("Could not start reposerver.py");
+            }
+            // "Server started at localhost:<port>"
+            std::string line;
+            uint8_t c;
+            while (m_process.read(reproc::stream::out, &c, 1).first == 1 && c != '\n')
+            {
+                line.push_back(static_cast<char>(c));
+            }
+            m_url = "http://localhost:" + rsplit(line, ":", 1).back();
+        }
+
+        const std::string& url() const
+        {
+            return m_url;
+        }
+
+    private:
+        reproc::process m_process;
+        std::string m_url;
+    };
+
+    // writes a repodata.json with the given records, which need at least a
+    // name and a version (build "0" and build number 0 by default)
+    fs::path write_repodata(const fs::path& file, const nlohmann::json& records)
+    {
+        fs::create_directories(file.parent_path());
+        nlohmann::json repodata = { { "packages", nlohmann::json::object() } };
+        for (auto record : records)
+        {
+            record.emplace("build", "0");
+            record.emplace("build_number", 0);
+            std::string fn = concat(record["name"].get<std::string>(),
+                                    "-",
+                                    record["version"].get<std::string>(),
+                                    "-",
+                                    record["build"].get<std::string>(),
+                                    ".tar.bz2");
+            repodata["packages"][fn] = record;
+        }
+        std::ofstream(file) << repodata.dump();
+        return file;
+    }
+
+    // the "name-version" of the packages installed once the solution of
+    // `solver` is applied
+    std::set<std::string> installed_result(MPool& pool, MSolver& solver)
+    {
+        std::set<std::string> res;
+        Transaction* trans = solver.create_transaction();
+        Queue q;
+        queue_init(&q);
+        transaction_installedresult(trans, &q);
+        for (int i = 0; i < q.count; ++i)
+        {
+            Solvable* s = pool_id2solvable(pool, q.elements[i]);
+            res.insert(concat(pool_id2str(pool, s->name), "-", pool_id2str(pool, s->evr)));
+        }
+        queue_free(&q);
+        transaction_free(trans);
+        return res;
+    }
+
     TEST(match_spec, parse_version_build)
     {
         std::string v, b;
@@ -312,6 +405,1368 @@ namespace mamba
         }
     }
 
+    TEST(link, dir_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path();
+        {
+            std::ofstream src(prefix / "source.txt");
+            src << "test";
+        }
+
+        DirectoryCache dir_cache(prefix);
+        dir_cache.create_directories(fs::path("lib") / "a" / "b");
+        EXPECT_TRUE(fs::is_directory(prefix / "lib" / "a" / "b"));
+        EXPECT_FALSE(dir_cache.lexists(fs::path("lib") / "a" / "b" / "file.txt"));
+
+        dir_cache.create_hard_link(prefix / "source.txt", fs::path("lib") / "a" / "b" / "file.txt");
+        EXPECT_TRUE(dir_cache.lexists(fs::path("lib") / "a" / "b" / "file.txt"));
+        EXPECT_EQ(read_contents(prefix / "lib" / "a" / "b" / "file.txt"), "test");
+
+        // not empty
+        EXPECT_FALSE(dir_cache.remove_empty_directory(fs::path("lib") / "a" / "b"));
+        EXPECT_TRUE(dir_cache.remove(fs::path("lib") / "a" / "b" / "file.txt"));
+        EXPECT_FALSE(dir_cache.remove(fs::path("lib") / "a" / "b" / "file.txt"));
+        EXPECT_TRUE(dir_cache.remove_empty_directory(fs::path("lib") / "a" / "b"));
+        EXPECT_FALSE(fs::exists(prefix / "lib" / "a" / "b"));
+
+        // recreating a removed directory works through the cache
+        dir_cache.create_directories(fs::path("lib") / "a" / "b");
+        EXPECT_TRUE(fs::is_directory(prefix / "lib" / "a" / "b"));
+        EXPECT_FALSE(dir_cache.remove_empty_directory(""));
+
+        // pruning removes the empty parents bottom-up, but keeps non-empty ones
+        dir_cache.create_directories(fs::path("lib") / "c");
+        dir_cache.create_hard_link(prefix / "source.txt", fs::path("lib") / "c" / "file.txt");
+        dir_cache.mark_for_pruning({ "lib/a/b", "lib/c" });
+        EXPECT_EQ(dir_cache.prune_empty_directories(), 2);
+        EXPECT_FALSE(fs::exists(prefix / "lib" / "a"));
+        EXPECT_TRUE(fs::exists(prefix / "lib" / "c" / "file.txt"));
+        EXPECT_EQ(dir_cache.prune_empty_directories(), 0);
+    }
+
+    TEST(link, file_index)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path();
+        fs::create_directories(prefix / "conda-meta");
+        {
+            nlohmann::json j;
+            j["paths_data"]["paths"] = { { { "_path", "bin/a" } }, { { "_path", "lib/common" } } };
+            std::ofstream(prefix / "conda-meta" / "a-1.0-0.json") << j.dump();
+        }
+
+        {
+            // built from the package records
+            PrefixFileIndex index(prefix);
+            EXPECT_TRUE(index.contains("a-1.0-0"));
+            EXPECT_EQ(index.owner("bin/a"), "a-1.0-0");
+            EXPECT_EQ(index.owner("bin/b"), "");
+
+            std::ofstream(prefix / "conda-meta" / "b-1.0-0.json") << "{}";
+            index.add("b-1.0-0", { "bin/b", "lib/common" });
+            EXPECT_EQ(index.owner("lib/common"), "b-1.0-0");
+            EXPECT_EQ(index.owned_files("a-1.0-0"), std::vector<std::string>({ "bin/a" }));
+            EXPECT_EQ(index.files("a-1.0-0").size(), 2);
+            index.save();
+        }
+        EXPECT_TRUE(fs::exists(PrefixFileIndex::index_path(prefix)));
+
+        {
+            // read back from the saved index
+            PrefixFileIndex index(prefix);
+            EXPECT_EQ(index.owner("bin/b"), "b-1.0-0");
+            EXPECT_EQ(index.owner("lib/common"), "b-1.0-0");
+            index.remove("b-1.0-0");
+            // handed back to the package that had it before
+            EXPECT_EQ(index.owner("lib/common"), "a-1.0-0");
+            EXPECT_EQ(index.owned_files("a-1.0-0").size(), 2);
+            EXPECT_EQ(index.owner("bin/a"), "a-1.0-0");
+        }
+
+        // records removed behind our back are dropped from the index
+        fs::remove(prefix / "conda-meta" / "b-1.0-0.json");
+        {
+            PrefixFileIndex index(prefix);
+            EXPECT_FALSE(index.contains("b-1.0-0"));
+            EXPECT_EQ(index.owner("bin/b"), "");
+            EXPECT_EQ(index.owner("lib/common"), "a-1.0-0");
+
+            // the separators of the format are escaped in the paths
+            std::ofstream(prefix / "conda-meta" / "c-1.0-0.json") << "{}";
+            index.add("c-1.0-0", { "share/a\tb", "share/c\nd", "share/e\\tf" });
+            index.save();
+        }
+        PrefixFileIndex index(prefix);
+        EXPECT_EQ(index.files("c-1.0-0"),
+                  std::vector<std::string>({ "share/a\tb", "share/c\nd", "share/e\\tf" }));
+        EXPECT_EQ(index.owner("share/c\nd"), "c-1.0-0");
+    }
+
+    TEST(link, file_index_install_order)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path();
+        fs::path conda_meta = prefix / "conda-meta";
+        fs::create_directories(conda_meta);
+        {
+            nlohmann::json j;
+            j["paths_data"]["paths"] = { { { "_path", "lib/common" } } };
+            std::ofstream(conda_meta / "z-1.0-0.json") << j.dump();
+            std::ofstream(conda_meta / "b-1.0-0.json") << j.dump();
+        }
+        // z was installed first, b clobbers its file although it sorts first
+        auto now = fs::last_write_time(conda_meta / "b-1.0-0.json");
+        fs::last_write_time(conda_meta / "z-1.0-0.json", now - std::chrono::hours(1));
+
+        {
+            PrefixFileIndex index(prefix);
+            EXPECT_EQ(index.owner("lib/common"), "b-1.0-0");
+            index.save();
+        }
+        {
+            PrefixFileIndex index(prefix);
+            EXPECT_EQ(index.owner("lib/common"), "b-1.0-0");
+            // reinstalled last, takes the file back
+            index.add("z-1.0-0", { "lib/common" });
+            index.save();
+        }
+        PrefixFileIndex index(prefix);
+        EXPECT_EQ(index.owner("lib/common"), "z-1.0-0");
+        EXPECT_TRUE(index.owned_files("b-1.0-0").empty());
+    }
+
+    TEST(link, parallel_files)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path() / "prefix";
+        fs::path pkgs_dir = tmp_dir.path() / "pkgs";
+        PackageInfo pkg("many", "1.0", "0", 0);
+        fs::path source = pkgs_dir / pkg.str();
+        fs::create_directories(source / "info");
+        fs::create_directories(prefix / "conda-meta");
+
+        // spread over several chunks of the thread pool
+        nlohmann::json paths = nlohmann::json::array();
+        for (int i = 0; i < 300; ++i)
+        {
+            std::string path = "share/" + std::to_string(i % 7) + "/f" + std::to_string(i);
+            fs::create_directories((source / path).parent_path());
+            std::ofstream(source / path) << i;
+            paths.push_back({ { "_path", path }, { "path_type", "hardlink" } });
+        }
+        std::ofstream(source / "info" / "paths.json")
+            << nlohmann::json({ { "paths", paths }, { "paths_version", 1 } });
+        std::ofstream(source / "info" / "repodata_record.json") << pkg.json();
+
+        TransactionContext context(prefix, "");
+        LinkPackage lp(pkg, pkgs_dir, &context);
+        EXPECT_TRUE(lp.execute());
+
+        auto linked = read_prefix_record_paths(prefix / "conda-meta" / "many-1.0-0.json");
+        ASSERT_EQ(linked.size(), 300);
+        for (int i = 0; i < 300; ++i)
+        {
+            EXPECT_EQ(linked[i].path, paths[i]["_path"].get<std::string>());
+            EXPECT_EQ(linked[i].sha256_in_prefix, validate::sha256sum(prefix / linked[i].path));
+        }
+        EXPECT_EQ(context.file_index->owner("share/3/f10"), "many-1.0-0");
+    }
+
+    TEST(link, stream_paths)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path pkg = tmp_dir.path();
+        fs::create_directories(pkg / "info");
+        {
+            std::ofstream paths_json(pkg / "info" / "paths.json");
+            paths_json << R"({"paths": [
+                {"_path": "bin/tool", "path_type": "hardlink", "sha256": "abc",
+                 "size_in_bytes": 12, "prefix_placeholder": "/opt/placeholder",
+                 "file_mode": "binary", "extra": {"nested": [1, 2]}},
+                {"_path": "lib/link", "path_type": "softlink", "sha256": "def",
+                 "size_in_bytes": 0, "no_link": true}
+            ], "paths_version": 1})";
+        }
+
+        auto paths = read_paths(pkg);
+        ASSERT_EQ(paths.size(), 2);
+        EXPECT_EQ(paths[0].path, "bin/tool");
+        EXPECT_EQ(paths[0].path_type, PathType::HARDLINK);
+        EXPECT_EQ(paths[0].sha256, "abc");
+        EXPECT_EQ(paths[0].size_in_bytes, 12);
+        EXPECT_EQ(paths[0].prefix_placeholder, "/opt/placeholder");
+        EXPECT_EQ(paths[0].file_mode, FileMode::BINARY);
+        EXPECT_EQ(paths[1].path_type, PathType::SOFTLINK);
+        EXPECT_EQ(paths[1].sha256, "");
+        EXPECT_TRUE(paths[1].no_link);
+
+        paths[0].sha256_in_prefix = "123";
+        paths[1].path = "lib/\"quoted\"";
+        nlohmann::json record = { { "name", "pkg" }, { "depends", { "a", "b" } } };
+        {
+            std::ofstream out(pkg / "record.json");
+            write_prefix_record(out, record, paths);
+        }
+
+        std::ifstream in(pkg / "record.json");
+        nlohmann::json j;
+        in >> j;
+        EXPECT_EQ(j["name"], "pkg");
+        EXPECT_EQ(j["files"], nlohmann::json({ "bin/tool", "lib/\"quoted\"" }));
+        EXPECT_EQ(j["paths_data"]["paths_version"], 1);
+        EXPECT_EQ(j["paths_data"]["paths"][0]["sha256_in_prefix"], "123");
+
+        auto read_back = read_prefix_record_paths(pkg / "record.json");
+        ASSERT_EQ(read_back.size(), 2);
+        EXPECT_EQ(read_back[0].path, "bin/tool");
+        EXPECT_EQ(read_back[0].sha256_in_prefix, "123");
+        EXPECT_EQ(read_back[1].path, "lib/\"quoted\"");
+        EXPECT_EQ(read_back[1].path_type, PathType::SOFTLINK);
+    }
+
+    TEST(prefix_data, load_headers)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path conda_meta = tmp_dir.path() / "conda-meta";
+        fs::create_directories(conda_meta);
+        // as written by mamba, the parse stops at "files"
+        {
+            std::ofstream out(conda_meta / "a-1.0-0.json");
+            nlohmann::json record = { { "name", "a" },
+                                      { "version", "1.0" },
+                                      { "build", "0" },
+                                      { "build_number", 0 },
+                                      { "depends", { "b >=1" } },
+                                      { "channel", "conda-forge" } };
+            PathData path;
+            path.path = "lib/a";
+            write_prefix_record(out, record, { path });
+            out << "garbage after the paths";
+        }
+        // as written by conda, sorted keys
+        std::ofstream(conda_meta / "b-1.0-0.json")
+            << R"({"build": "0", "build_number": 0, "depends": [], "files": ["lib/b"],
+                   "link": {"source": "/pkgs/b", "type": 1}, "name": "b",
+                   "paths_data": {"paths": [{"_path": "lib/b"}], "paths_version": 1},
+                   "subdir": "linux-64", "version": "1.0"})";
+        for (int i = 0; i < 40; ++i)
+        {
+            std::ofstream(conda_meta / concat("c", std::to_string(i), "-1.0-0.json"))
+                << R"({"name": "c)" << i << R"(", "version": "1.0", "build": "0"})";
+        }
+
+        auto header = read_prefix_record_header(conda_meta / "b-1.0-0.json");
+        EXPECT_FALSE(header.contains("files"));
+        EXPECT_FALSE(header.contains("paths_data"));
+        EXPECT_EQ(header["link"]["type"], 1);
+        EXPECT_EQ(header["subdir"], "linux-64");
+
+        PrefixData prefix_data(tmp_dir.path().string());
+        prefix_data.load();
+        const auto& records = prefix_data.records();
+        ASSERT_EQ(records.size(), 42);
+        EXPECT_EQ(records.at("a").depends, std::vector<std::string>({ "b >=1" }));
+        EXPECT_EQ(records.at("a").channel, "conda-forge");
+        EXPECT_EQ(records.at("b").version, "1.0");
+        EXPECT_EQ(records.at("c39").name, "c39");
+        EXPECT_EQ(prefix_data.full_record("b")["files"], nlohmann::json({ "lib/b" }));
+        EXPECT_THROW(prefix_data.full_record("d"), std::runtime_error);
+
+        std::ofstream(conda_meta / "d-1.0-0.json") << R"({"name": "d", "version": )";
+        EXPECT_THROW(PrefixData(tmp_dir.path().string()).update_index(), std::runtime_error);
+    }
+
+    TEST(prefix_data, record_index)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path conda_meta = tmp_dir.path() / "conda-meta";
+        fs::create_directories(conda_meta);
+        std::ofstream(conda_meta / "a-1.0-0.json")
+            << R"({"name": "a", "version": "1.0", "build": "py_0", "build_number": 3,
+                   "channel": "conda-forge", "md5": "0123", "size": 42,
+                   "depends": ["b >=1", "c"], "constrains": ["d <2"], "files": ["lib/a"]})";
+        std::ofstream(conda_meta / "b-1.0-0.json")
+            << R"({"name": "b", "version": "1.0", "build": "0", "depends": ["c"]})";
+
+        fs::path index = PrefixData::index_path(tmp_dir.path());
+        PrefixData prefix_data(tmp_dir.path().string());
+        prefix_data.load();
+        ASSERT_TRUE(fs::exists(index));
+
+        PrefixData from_index(tmp_dir.path().string());
+        from_index.load();
+        ASSERT_EQ(from_index.records().size(), 2);
+        for (const auto& [name, record] : prefix_data.records())
+        {
+            EXPECT_EQ(from_index.records().at(name).json(), record.json());
+        }
+        EXPECT_EQ(from_index.full_record("a")["files"], nlohmann::json({ "lib/a" }));
+
+        // a record rewritten in place does not change the mtime of conda-meta,
+        // nor does a record created in the same tick as the index
+        auto index_mtime = fs::last_write_time(index);
+        std::ofstream(conda_meta / "b-1.0-0.json")
+            << R"({"name": "b", "version": "1.0", "build": "1", "depends": []})";
+        std::ofstream(conda_meta / "c-1.0-0.json")
+            << R"({"name": "c", "version": "1.0", "build": "0", "depends": []})";
+        fs::last_write_time(conda_meta, index_mtime);
+        PrefixData cached(tmp_dir.path().string());
+        cached.load();
+        EXPECT_EQ(cached.records().at("b").build_string, "1");
+        EXPECT_EQ(cached.records().count("c"), 1);
+        EXPECT_EQ(cached.records().at("a").depends, std::vector<std::string>({ "b >=1", "c" }));
+        // unchanged records are not written again
+        fs::last_write_time(index, index_mtime - std::chrono::seconds(1));
+        PrefixData unchanged(tmp_dir.path().string());
+        unchanged.load();
+        EXPECT_EQ(unchanged.records().size(), 3);
+        EXPECT_EQ(fs::last_write_time(index), index_mtime - std::chrono::seconds(1));
+        fs::remove(conda_meta / "c-1.0-0.json");
+
+        // removed records are dropped
+        fs::remove(conda_meta / "a-1.0-0.json");
+        fs::last_write_time(conda_meta, fs::last_write_time(index) + std::chrono::seconds(1));
+        PrefixData removed(tmp_dir.path().string());
+        removed.load();
+        EXPECT_EQ(removed.records().size(), 1);
+        EXPECT_EQ(removed.records().count("a"), 0);
+
+        // an invalid index is rebuilt
+        std::ofstream(index, std::ios::binary) << "mamba-records 1";
+        PrefixData rebuilt(tmp_dir.path().string());
+        rebuilt.load();
+        EXPECT_EQ(rebuilt.records().size(), 1);
+        EXPECT_GT(fs::file_size(index), 16);
+    }
+
+    TEST(pool_snapshot, roundtrip)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path repodata = tmp_dir.path() / "repodata.json";
+        std::ofstream(repodata) << R"({"packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["b"]},
+            "b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": []}
+        }})";
+        RepoMetadata metadata = { "file:///test/linux-64/repodata.json", false, "etag-1", "" };
+
+        PoolSnapshot snapshot(tmp_dir.path());
+        {
+            MPool pool;
+            MRepo repo(pool, "test", repodata, metadata);
+            repo.set_priority(2, 1);
+            snapshot.add_repo(metadata, pool.repo_state(repo.repo()), 2, 1);
+            std::vector<MRepo> repos;
+            EXPECT_FALSE(snapshot.load(pool, repos));
+            EXPECT_TRUE(snapshot.save(pool, { &repo }));
+        }
+        EXPECT_TRUE(fs::exists(snapshot.path()));
+
+        MPool pool;
+        std::vector<MRepo> repos;
+        EXPECT_TRUE(snapshot.load(pool, repos));
+        ASSERT_EQ(repos.size(), 1);
+        EXPECT_EQ(repos[0].size(), 2);
+        EXPECT_EQ(repos[0].url(), "file:///test/linux-64");
+        EXPECT_EQ(repos[0].priority(), std::make_tuple(2, 1));
+        EXPECT_EQ(pool.repo_state(repos[0].repo()), repodata_state(metadata, repodata));
+
+        MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+        solver.add_jobs({ "a" }, SOLVER_INSTALL);
+        EXPECT_TRUE(solver.solve());
+
+        // the repodata changed, the snapshot is not used anymore
+        PoolSnapshot changed(tmp_dir.path());
+        changed.add_repo({ metadata.url, false, "etag-2", "" }, "repodata changed", 2, 1);
+        MPool other_pool;
+        std::vector<MRepo> other_repos;
+        EXPECT_EQ(changed.path(), snapshot.path());
+        EXPECT_FALSE(changed.load(other_pool, other_repos));
+        EXPECT_TRUE(other_repos.empty());
+    }
+
+    TEST(solver, solution_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path repodata = write_repodata(
+            tmp_dir.path() / "repodata.json",
+            { { { "name", "a" }, { "version", "1.0" }, { "depends", { "b >=2" } } },
+              { { "name", "b" }, { "version", "1.0" } },
+              { { "name", "b" }, { "version", "2.0" } } });
+
+        auto solve = [&](const std::string& etag, std::set<std::string>& result) {
+            MPool pool;
+            MRepo repo(pool, "test", repodata, { "file:///test/repodata.json", false, etag, "" });
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.set_solution_cache(tmp_dir.path());
+            solver.add_jobs({ "a" }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            result = installed_result(pool, solver);
+            return solver.solution_from_cache();
+        };
+
+        std::set<std::string> expected = { "a-1.0", "b-2.0" }, result;
+        EXPECT_FALSE(solve("etag-1", result));
+        EXPECT_EQ(result, expected);
+        EXPECT_TRUE(solve("etag-1", result));
+        EXPECT_EQ(result, expected);
+        // different repodata, different key
+        EXPECT_FALSE(solve("etag-2", result));
+
+        // a stored solution that does not satisfy the dependencies is ignored
+        for (auto& p : fs::directory_iterator(tmp_dir.path() / "solutions"))
+        {
+            nlohmann::json j;
+            std::ifstream(p.path()) >> j;
+            for (auto& pkg : j["solution"])
+            {
+                if (pkg["name"] == "b")
+                {
+                    pkg["version"] = "1.0";
+                }
+            }
+            std::ofstream(p.path()) << j.dump();
+        }
+        EXPECT_FALSE(solve("etag-1", result));
+        EXPECT_EQ(result, expected);
+    }
+
+    TEST(solver, solution_cache_constrains)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path repodata = write_repodata(
+            tmp_dir.path() / "repodata.json",
+            { { { "name", "a" }, { "version", "1.0" }, { "constrains", { "c >=2" } } },
+              { { "name", "c" }, { "version", "1.0" } },
+              { { "name", "c" }, { "version", "2.0" } } });
+
+        auto solve = [&](std::set<std::string>& result) {
+            MPool pool;
+            MRepo repo(pool, "test", repodata, { "file:///test/repodata.json", false, "", "" });
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.set_solution_cache(tmp_dir.path());
+            solver.add_jobs({ "a", "c" }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            result = installed_result(pool, solver);
+            return solver.solution_from_cache();
+        };
+
+        std::set<std::string> expected = { "a-1.0", "c-2.0" }, result;
+        EXPECT_FALSE(solve(result));
+        EXPECT_EQ(result, expected);
+        EXPECT_TRUE(solve(result));
+
+        // a stored solution breaking a constraint is ignored, although it
+        // fulfills the jobs and the dependencies
+        for (auto& p : fs::directory_iterator(tmp_dir.path() / "solutions"))
+        {
+            nlohmann::json j;
+            std::ifstream(p.path()) >> j;
+            for (auto& pkg : j["solution"])
+            {
+                if (pkg["name"] == "c")
+                {
+                    pkg["version"] = "1.0";
+                }
+            }
+            std::ofstream(p.path()) << j.dump();
+        }
+        EXPECT_FALSE(solve(result));
+        EXPECT_EQ(result, expected);
+    }
+
+    TEST(solver, channel_specific_jobs)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path stable = write_repodata(tmp_dir.path() / "stable" / "repodata.json",
+                                         { { { "name", "b" }, { "version", "1.0" } } });
+        fs::path experimental
+            = write_repodata(tmp_dir.path() / "experimental" / "repodata.json",
+                             { { { "name", "b" }, { "version", "2.0" } } });
+
+        auto solve = [&](const std::vector<std::string>& pins, const std::string& spec) {
+            MPool pool;
+            MRepo stable_repo(
+                pool,
+                "stable",
+                stable,
+                { "https://conda.anaconda.org/bioconda/linux-64/repodata.json", false, "", "" });
+            MRepo experimental_repo(
+                pool,
+                "experimental",
+                experimental,
+                { "https://conda.anaconda.org/bioconda-experimental/linux-64/repodata.json",
+                  false,
+                  "",
+                  "" });
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            for (auto& pin : pins)
+            {
+                solver.add_pin(pin);
+            }
+            solver.add_jobs({ spec }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            return installed_result(pool, solver);
+        };
+
+        using names = std::set<std::string>;
+        EXPECT_EQ(solve({}, "b"), names({ "b-2.0" }));
+        // not a substring match of the channel
+        EXPECT_EQ(solve({}, "bioconda::b"), names({ "b-1.0" }));
+        EXPECT_EQ(solve({}, "https://conda.anaconda.org/bioconda::b"), names({ "b-1.0" }));
+        EXPECT_EQ(solve({ "bioconda::b" }, "b"), names({ "b-1.0" }));
+        EXPECT_EQ(solve({ "bioconda-experimental::b" }, "b"), names({ "b-2.0" }));
+    }
+
+    TEST(pool, prune_lower_priority)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path high = write_repodata(tmp_dir.path() / "high" / "repodata.json",
+                                       { { { "name", "a" }, { "version", "1.0" } },
+                                         { { "name", "b" }, { "version", "1.0" } } });
+        fs::path low = write_repodata(tmp_dir.path() / "low" / "repodata.json",
+                                      { { { "name", "a" }, { "version", "2.0" } },
+                                        { { "name", "c" }, { "version", "1.0" } } });
+
+        auto solve = [&](const std::string& spec, const std::set<std::string>& keep_names) {
+            MPool pool;
+            MRepo high_repo(pool, "high", high, { "file:///high/repodata.json", false, "", "" });
+            MRepo low_repo(pool, "low", low, { "file:///low/repodata.json", false, "", "" });
+            high_repo.set_priority(1, 0);
+            low_repo.set_priority(0, 0);
+            EXPECT_EQ(pool.prune_lower_priority(keep_names), keep_names.empty() ? 1 : 0);
+            EXPECT_FALSE(pool.considered_state().empty());
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs({ spec }, SOLVER_INSTALL);
+            return solver.solve();
+        };
+
+        EXPECT_TRUE(solve("a", {}));
+        EXPECT_TRUE(solve("c", {}));
+        // a-2.0 is not considered
+        EXPECT_FALSE(solve("a >=2", {}));
+        EXPECT_TRUE(solve("a >=2", { "a" }));
+    }
+
+    TEST(pool, matchspec_memo)
+    {
+        MPool pool;
+        Id id = pool.matchspec("python >=3.7");
+        EXPECT_EQ(pool.matchspec("python >=3.7"), id);
+        EXPECT_EQ(pool_conda_matchspec(pool, "python >=3.7"), id);
+        EXPECT_EQ(pool.matchspec_misses(), 1);
+        EXPECT_EQ(pool.matchspec_hits(), 1);
+
+        std::vector<PackageInfo> infos;
+        for (const char* name : { "a", "b", "c" })
+        {
+            PackageInfo info(name, "1.0", "0", 0);
+            info.depends = { "python >=3.7", "zlib" };
+            infos.push_back(info);
+        }
+        MRepo repo(pool, "memo", infos);
+        // "zlib" is parsed once, every other dependency is a hit
+        EXPECT_EQ(pool.matchspec_misses(), 2);
+        EXPECT_EQ(pool.matchspec_hits(), 6);
+
+        MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+        solver.add_jobs({ "zlib" }, SOLVER_INSTALL);
+        EXPECT_EQ(pool.matchspec_misses(), 2);
+        EXPECT_EQ(pool.matchspec_hits(), 7);
+    }
+
+    TEST(solver, freeze_installed)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path installed = write_repodata(
+            tmp_dir.path() / "installed.json",
+            { { { "name", "a" }, { "version", "1.0" }, { "depends", { "x <2" } } },
+              { { "name", "x" }, { "version", "1.0" } } });
+        fs::path channel = write_repodata(
+            tmp_dir.path() / "channel.json",
+            { { { "name", "a" }, { "version", "2.0" } },
+              { { "name", "x" }, { "version", "2.0" } },
+              { { "name", "e" }, { "version", "1.0" } },
+              { { "name", "e" }, { "version", "2.0" }, { "constrains", { "a >=2" } } } });
+
+        auto solve = [&](const std::string& spec, bool freeze) {
+            MPool pool;
+            MRepo installed_repo(pool, "installed", installed.string(), "");
+            installed_repo.set_installed();
+            MRepo channel_repo(pool, "channel", channel.string(), "file:///channel");
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.set_postsolve_flags({ { MAMBA_FREEZE_INSTALLED, freeze } });
+            solver.add_jobs({ spec }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            return installed_result(pool, solver);
+        };
+
+        using names = std::set<std::string>;
+        EXPECT_EQ(solve("e", false), names({ "a-2.0", "e-2.0", "x-1.0" }));
+        // a is locked, the constraint of e-2.0 cannot be met
+        EXPECT_EQ(solve("e", true), names({ "a-1.0", "e-1.0", "x-1.0" }));
+        // the locked solve fails, a has to be updated
+        EXPECT_EQ(solve("x >=2", true), names({ "a-2.0", "x-2.0" }));
+    }
+
+    TEST(solver, portfolio)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path installed = write_repodata(
+            tmp_dir.path() / "installed.json",
+            { { { "name", "a" }, { "version", "1.0" }, { "depends", { "x <2" } } },
+              { { "name", "x" }, { "version", "1.0" } } });
+        fs::path channel = write_repodata(
+            tmp_dir.path() / "channel.json",
+            { { { "name", "a" }, { "version", "2.0" }, { "depends", { "b >=2" } } },
+              { { "name", "b" }, { "version", "1.0" } },
+              { { "name", "b" }, { "version", "2.0" } },
+              { { "name", "x" }, { "version", "2.0" } } });
+
+        auto solve = [&](std::size_t portfolio,
+                         const std::vector<std::string>& specs,
+                         const std::vector<std::string>& pins) {
+            MPool pool;
+            MRepo installed_repo(pool, "installed", installed.string(), "");
+            installed_repo.set_installed();
+            MRepo channel_repo(pool, "channel", channel.string(), "file:///channel");
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.set_portfolio(portfolio);
+            for (auto& pin : pins)
+            {
+                solver.add_pin(pin);
+            }
+            solver.add_jobs(specs, SOLVER_INSTALL);
+            if (!solver.solve())
+            {
+                EXPECT_FALSE(solver.problems_to_str().empty());
+                return std::set<std::string>();
+            }
+            EXPECT_EQ(solver.portfolio_winner().empty(), portfolio < 2);
+            return installed_result(pool, solver);
+        };
+
+        using names = std::set<std::string>;
+        // the configurations that are not taken finish in the thread pool
+        EXPECT_EQ(solve(8, { "b" }, {}), names({ "a-1.0", "b-2.0", "x-1.0" }));
+        wait_for_all_threads();
+        EXPECT_EQ(get_thread_count(), 0);
+        EXPECT_EQ(solve(8, { "x >=2" }, {}), names({ "a-2.0", "b-2.0", "x-2.0" }));
+        EXPECT_EQ(solve(8, { "b" }, { "b <2" }), names({ "a-1.0", "b-1.0", "x-1.0" }));
+        EXPECT_EQ(solve(8, { "b", "x >=2" }, { "b <2" }), names());
+        // the solutions of every configuration satisfy the jobs
+        for (std::size_t size = 0; size <= 8; ++size)
+        {
+            names res = solve(size, { "a >=2" }, {});
+            EXPECT_TRUE(res.count("a-2.0") && res.count("b-2.0") && res.count("x-1.0"));
+        }
+    }
+
+    TEST(solver, batch)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path installed = write_repodata(tmp_dir.path() / "installed.json",
+                                            { { { "name", "a" }, { "version", "1.0" } },
+                                              { { "name", "z" }, { "version", "1.0" } } });
+        fs::path channel = write_repodata(
+            tmp_dir.path() / "channel.json",
+            { { { "name", "a" }, { "version", "2.0" }, { "depends", { "b >=2" } } },
+              { { "name", "b" }, { "version", "1.0" } },
+              { { "name", "b" }, { "version", "2.0" } },
+              { { "name", "z" }, { "version", "2.0" } } });
+
+        MPool pool;
+        MRepo installed_repo(pool, "installed", installed.string(), "");
+        installed_repo.set_installed();
+        MRepo channel_repo(pool, "channel", channel.string(), "file:///channel");
+
+        std::vector<std::vector<std::string>> job_sets = {
+            { "b" }, { "a >=2" }, { "b <2", "a >=2" }, { "b", "z >=2" }, { "b <2" }
+        };
+        std::vector<std::unique_ptr<MSolver>> solvers;
+        std::vector<MSolver*> batch;
+        for (const auto& jobs : job_sets)
+        {
+            solvers.push_back(
+                std::make_unique<MSolver>(pool, std::vector<std::pair<int, int>>{}));
+            solvers.back()->freeze_installed = jobs.size() == 1;
+            solvers.back()->add_jobs(jobs, SOLVER_INSTALL);
+            batch.push_back(solvers.back().get());
+        }
+        EXPECT_EQ(MSolver::solve_batch(batch, 2),
+                  std::vector<bool>({ true, true, false, true, true }));
+        EXPECT_FALSE(solvers[2]->problems_to_str().empty());
+
+        // the same solutions as solving one by one
+        for (std::size_t i = 0; i < job_sets.size(); ++i)
+        {
+            if (i == 2)
+            {
+                continue;
+            }
+            MSolver solver(pool, {});
+            solver.freeze_installed = job_sets[i].size() == 1;
+            solver.add_jobs(job_sets[i], SOLVER_INSTALL);
+            ASSERT_TRUE(solver.solve());
+            EXPECT_EQ(installed_result(pool, *solvers[i]), installed_result(pool, solver));
+        }
+        using names = std::set<std::string>;
+        EXPECT_EQ(installed_result(pool, *solvers[0]), names({ "a-1.0", "b-2.0", "z-1.0" }));
+        EXPECT_EQ(installed_result(pool, *solvers[3]), names({ "a-1.0", "b-2.0", "z-2.0" }));
+    }
+
+    TEST(repodata_index, sparse)
+    {
+        EXPECT_EQ(dependency_name("python >=3.6,<3.7.0a0"), "python");
+        EXPECT_EQ(dependency_name("openssl"), "openssl");
+        EXPECT_EQ(dependency_name("numpy>=1.0"), "numpy");
+        EXPECT_EQ(dependency_name("zlib[version='>=1.2']"), "zlib");
+
+        TemporaryDirectory tmp_dir;
+        fs::path repodata = tmp_dir.path() / "repodata.json";
+        std::ofstream(repodata) << R"({"info": {"subdir": "linux-64"}, "packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["b >=1"]},
+            "b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["c"]},
+            "c-1.0-0.tar.bz2": {"name": "c", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": []},
+            "d-1.0-0.tar.bz2": {"name": "d", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["e"]}
+        }, "packages.conda": {
+            "c-2.0-0.conda": {"name": "c", "version": "2.0", "build": "0",
+                              "build_number": 0, "depends": []},
+            "e-1.0-0.conda": {"name": "e", "version": "1.0", "build": "0",
+                              "build_number": 0, "depends": []}
+        }})";
+
+        RepodataIndex index(repodata, "state-1");
+        index.load();
+        EXPECT_TRUE(fs::exists(RepodataIndex::index_path(repodata)));
+        EXPECT_TRUE(index.contains("e"));
+        EXPECT_EQ(index.dependencies("a"), std::vector<std::string>({ "b" }));
+
+        auto names = RepodataIndex::reachable({ &index }, { "a" });
+        EXPECT_EQ(names, std::set<std::string>({ "a", "b", "c" }));
+
+        auto sparse = nlohmann::json::parse(index.repodata(names));
+        EXPECT_EQ(sparse["info"]["subdir"], "linux-64");
+        EXPECT_EQ(sparse["packages"].size(), 3);
+        EXPECT_EQ(sparse["packages.conda"].size(), 1);
+        EXPECT_EQ(sparse["packages.conda"]["c-2.0-0.conda"]["version"], "2.0");
+
+        MPool pool;
+        MRepo repo(pool, index, names, { "file:///test/repodata.json", false, "", "" });
+        EXPECT_EQ(repo.size(), 4);
+
+        // a new state rebuilds the index
+        std::ofstream(repodata) << R"({"packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["f"]}
+        }})";
+        RepodataIndex updated(repodata, "state-2");
+        updated.load();
+        EXPECT_FALSE(updated.contains("b"));
+        EXPECT_EQ(updated.dependencies("a"), std::vector<std::string>({ "f" }));
+    }
+
+    TEST(repodata, zstd_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json = tmp_dir.path() / "repodata.json";
+        std::ofstream(json) << R"({"info": {"subdir": "linux-64"}, "packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["b"]},
+            "b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": []}
+        }})";
+        EXPECT_FALSE(is_zstd_file(json));
+
+        // the cache keeps its name, compressed in place
+        fs::path compressed = tmp_dir.path() / "compressed.json";
+        compress_zstd_file(json, compressed, 3);
+        EXPECT_TRUE(is_zstd_file(compressed));
+
+        FILE* fp = open_decompressed(compressed);
+        ASSERT_NE(fp, nullptr);
+        std::string content;
+        char buffer[256];
+        std::size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        {
+            content.append(buffer, n);
+        }
+        fclose(fp);
+        EXPECT_EQ(nlohmann::json::parse(content)["packages"].size(), 2);
+
+        MPool pool;
+        MRepo repo(pool, "test", compressed, { "file:///test/repodata.json", false, "", "" });
+        EXPECT_EQ(repo.size(), 2);
+
+        RepodataIndex index(compressed, "state-1");
+        index.load();
+        EXPECT_EQ(index.dependencies("a"), std::vector<std::string>({ "b" }));
+    }
+
+    TEST(patch_journal, apply)
+    {
+        EXPECT_EQ(PatchJournal::url("https://conda.anaconda.org/c/linux-64/repodata.json"),
+                  "https://conda.anaconda.org/c/linux-64/repodata.patches.jsonl");
+        EXPECT_TRUE(PatchJournal::is_journal_url(PatchJournal::url("file:///repodata.json")));
+
+        TemporaryDirectory tmp_dir;
+        fs::path journal_file = tmp_dir.path() / "repodata.patches.jsonl";
+        std::ofstream(journal_file)
+            << R"({"from": "h0", "to": "h1", "patch": [{"op": "add", "path": "/packages/c-1.0-0.tar.bz2", "value": {"name": "c", "version": "1.0", "build": "0", "build_number": 0, "depends": []}}]})"
+            << "\n"
+            << R"({"from": "h1", "to": "h2", "patch": [{"op": "remove", "path": "/packages/b-1.0-0.tar.bz2"}, {"op": "replace", "path": "/packages/a-1.0-0.tar.bz2/depends/0", "value": "c"}]})"
+            << "\n"
+            << R"({"latest": "h2"})"
+            << "\n";
+
+        auto repodata = nlohmann::json::parse(R"({"info": {"subdir": "linux-64"}, "packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["b"]},
+            "b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": []}
+        }})");
+
+        PatchJournal journal(journal_file, "h0");
+        EXPECT_TRUE(journal.applies());
+        EXPECT_FALSE(journal.up_to_date());
+        EXPECT_EQ(journal.latest(), "h2");
+
+        std::set<std::string> changed;
+        EXPECT_TRUE(journal.apply(repodata, changed));
+        EXPECT_EQ(changed,
+                  std::set<std::string>(
+                      { "a-1.0-0.tar.bz2", "b-1.0-0.tar.bz2", "c-1.0-0.tar.bz2" }));
+        EXPECT_FALSE(repodata["packages"].contains("b-1.0-0.tar.bz2"));
+        EXPECT_EQ(repodata["packages"]["a-1.0-0.tar.bz2"]["depends"][0], "c");
+
+        EXPECT_TRUE(PatchJournal(journal_file, "h2").up_to_date());
+        EXPECT_FALSE(PatchJournal(journal_file, "unknown").applies());
+        EXPECT_FALSE(PatchJournal(journal_file, "").applies());
+
+        // other changes than records
+        std::ofstream(journal_file)
+            << R"({"from": "h2", "to": "h3", "patch": [{"op": "replace", "path": "/info/subdir", "value": "noarch"}]})"
+            << "\n";
+        PatchJournal info_journal(journal_file, "h2");
+        EXPECT_TRUE(info_journal.applies());
+        changed.clear();
+        EXPECT_FALSE(info_journal.apply(repodata, changed));
+        EXPECT_EQ(repodata["info"]["subdir"], "noarch");
+    }
+
+    TEST(repo, update_records)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_file = tmp_dir.path() / "repodata.json";
+        fs::path solv_file = tmp_dir.path() / "repodata.solv";
+        std::ofstream(json_file) << R"({"packages": {
+            "a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": ["b"]},
+            "b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",
+                                "build_number": 0, "depends": []}
+        }})";
+        RepoMetadata previous{ "file:///test/repodata.json", false, "", "", "h1" };
+        RepoMetadata patched{ "file:///test/repodata.json", false, "", "", "h2" };
+        {
+            MPool pool;
+            MRepo repo(pool, "test", json_file, previous);
+            EXPECT_TRUE(fs::exists(solv_file));
+        }
+        {
+            MPool pool;
+            MRepo repo(pool, "test", solv_file.string(), previous);
+            repo.update_records(
+                { "b-1.0-0.tar.bz2", "c-1.0-0.tar.bz2" },
+                R"({"packages": {"c-1.0-0.tar.bz2": {"name": "c", "version": "1.0", "build": "0", "build_number": 0, "depends": []}}})",
+                patched);
+        }
+
+        // read back from the .solv alone
+        fs::remove(json_file);
+        MPool pool;
+        MRepo repo(pool, "test", solv_file.string(), patched);
+        EXPECT_EQ(repo.size(), 2);
+        std::set<std::string> names;
+        Id id;
+        Solvable* s;
+        FOR_REPO_SOLVABLES(repo.repo(), id, s)
+        {
+            names.insert(pool_id2str(pool, s->name));
+        }
+        EXPECT_EQ(names, std::set<std::string>({ "a", "c" }));
+        EXPECT_THROW(MRepo(pool, "test", solv_file.string(), previous), std::runtime_error);
+    }
+
+    TEST(repo, installed_solv_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path conda_meta = tmp_dir.path() / "conda-meta";
+        fs::create_directories(conda_meta);
+        std::ofstream(conda_meta / "a-1.0-0.json")
+            << R"({"name": "a", "version": "1.0", "build": "0", "build_number": 0,
+                   "depends": ["b >=1"]})";
+        std::ofstream(conda_meta / "b-1.0-0.json")
+            << R"({"name": "b", "version": "1.0", "build": "0", "build_number": 0})";
+
+        auto installed = [&]() {
+            MPool pool;
+            MRepo repo = MRepo::from_conda_meta(pool, tmp_dir.path());
+            std::map<std::string, int> res;
+            Id id;
+            Solvable* s;
+            FOR_REPO_SOLVABLES(repo.repo(), id, s)
+            {
+                Queue q;
+                queue_init(&q);
+                solvable_lookup_deparray(s, SOLVABLE_REQUIRES, &q, -1);
+                res[concat(pool_id2str(pool, s->name), "-", pool_id2str(pool, s->evr))] = q.count;
+                queue_free(&q);
+            }
+            EXPECT_TRUE(starts_with(pool.repo_state(repo.repo()), "conda-meta "));
+            return res;
+        };
+        using records = std::map<std::string, int>;
+        EXPECT_EQ(installed(), records({ { "a-1.0", 1 }, { "b-1.0", 0 } }));
+        EXPECT_TRUE(fs::exists(conda_meta / "installed.solv"));
+
+        // unchanged records are not read again
+        fs::path b = conda_meta / "b-1.0-0.json";
+        auto size = fs::file_size(b);
+        auto mtime = fs::last_write_time(b);
+        std::ofstream(b) << "{" << std::string(size - 1, ' ');
+        fs::last_write_time(b, mtime);
+        EXPECT_EQ(installed(), records({ { "a-1.0", 1 }, { "b-1.0", 0 } }));
+
+        // the changed ones are
+        fs::remove(conda_meta / "a-1.0-0.json");
+        std::ofstream(conda_meta / "c-2.0-0.json")
+            << R"({"name": "c", "version": "2.0", "build": "0", "build_number": 0,
+                   "depends": ["b", "a"]})";
+        EXPECT_EQ(installed(), records({ { "b-1.0", 0 }, { "c-2.0", 2 } }));
+        EXPECT_EQ(installed(), records({ { "b-1.0", 0 }, { "c-2.0", 2 } }));
+        std::ofstream(b) << "{" << std::string(size + 1, ' ');
+        EXPECT_THROW(installed(), std::exception);
+
+        // loaded records are taken as they are
+        PrefixData prefix_data(tmp_dir.path().string());
+        prefix_data.load_single_record(conda_meta / "c-2.0-0.json");
+        MPool pool;
+        MRepo repo(pool, prefix_data);
+        EXPECT_EQ(repo.size(), 1);
+        EXPECT_TRUE(starts_with(pool.repo_state(repo.repo()), "prefix"));
+        // conda-meta is not read in place of records that are not loaded
+        MRepo empty(pool, PrefixData(tmp_dir.path().string()));
+        EXPECT_EQ(empty.size(), 0);
+    }
+
+    TEST(sharded_repodata, fetch)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path subdir = tmp_dir.path() / "channel" / "linux-64";
+        fs::path cache = tmp_dir.path() / "cache" / "shards";
+        fs::create_directories(subdir / "shards");
+        nlohmann::json index = { { "info", { { "subdir", "linux-64" } } },
+                                 { "shards", nlohmann::json::object() } };
+        auto add_shard = [&](const std::string& name, const nlohmann::json& depends) {
+            nlohmann::json record = { { "name", name },
+                                      { "version", "1.0" },
+                                      { "build", "0" },
+                                      { "build_number", 0 },
+                                      { "depends", depends } };
+            nlohmann::json shard = { { "packages", { { name + "-1.0-0.tar.bz2", record } } } };
+            std::string hash = validate::sha256sum_string(shard.dump());
+            std::ofstream(subdir / "shards" / (hash + ".json")) << shard.dump();
+            index["shards"][name] = hash;
+        };
+        add_shard("a", { "b >=1", "c" });
+        add_shard("b", { "c" });
+        add_shard("c", nlohmann::json::array());
+        add_shard("d", { "a" });
+        std::ofstream(subdir / "repodata_shards.json") << index.dump();
+
+        std::string subdir_url = "file://" + subdir.string();
+        ShardedRepodata shards(subdir / "repodata_shards.json", subdir_url, cache);
+        EXPECT_TRUE(shards.contains("d"));
+        auto names = ShardedRepodata::fetch({ &shards }, { "a" });
+        EXPECT_EQ(names, std::set<std::string>({ "a", "b", "c" }));
+        EXPECT_EQ(shards.dependencies("a"), std::vector<std::string>({ "b", "c" }));
+        // the shard of d is not needed
+        EXPECT_TRUE(fs::exists(cache / (index["shards"]["a"].get<std::string>() + ".json")));
+        EXPECT_FALSE(fs::exists(cache / (index["shards"]["d"].get<std::string>() + ".json")));
+
+        MPool pool;
+        RepoMetadata meta{ subdir_url + "/repodata_shards.json", false, "", "" };
+        MRepo repo(pool, shards, names, meta);
+        EXPECT_EQ(repo.size(), 3);
+
+        // the shards are verified against their hash
+        std::string d_hash = index["shards"]["d"].get<std::string>();
+        std::ofstream(subdir / "shards" / (d_hash + ".json")) << "{}";
+        ShardedRepodata tampered(subdir / "repodata_shards.json", subdir_url, cache);
+        EXPECT_THROW(ShardedRepodata::fetch({ &tampered }, { "d" }), std::runtime_error);
+        EXPECT_FALSE(fs::exists(cache / (d_hash + ".json")));
+    }
+
+    TEST(subdirdata, stale_while_revalidate)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path channel = tmp_dir.path() / "channel";
+        fs::path cache_dir = tmp_dir.path() / "cache";
+        fs::create_directories(cache_dir);
+        fs::path repodata = channel / "linux-64" / "repodata.json";
+        nlohmann::json records = { { { "name", "a" }, { "version", "1.0" } } };
+        write_repodata(repodata, records);
+
+        auto& ctx = Context::instance();
+        bool stale_while_revalidate = ctx.stale_while_revalidate;
+        ctx.stale_while_revalidate = true;
+
+        RepoServer server(channel);
+        std::string url = server.url() + "/linux-64/repodata.json";
+        auto make_subdir = [&]() {
+            auto subdir = std::make_shared<MSubdirData>(
+                "channel/linux-64", url, cache_dir / cache_fn_url(url));
+            subdir->load();
+            if (subdir->target())
+            {
+                MultiDownloadTarget dl;
+                dl.add(subdir->target());
+                dl.download(true);
+            }
+            return subdir;
+        };
+        auto solve = [](MSubdirData& subdir, const std::string& spec) {
+            MPool pool;
+            subdir.create_repo(pool);
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs({ spec }, SOLVER_INSTALL);
+            return solver.solve();
+        };
+
+        // the cache has no max-age, it is stale on the next load
+        auto subdir = make_subdir();
+        EXPECT_TRUE(subdir->loaded());
+        EXPECT_FALSE(subdir->stale());
+
+        // the file is newer than the cached Last-Modified, it is downloaded again
+        records.push_back({ { "name", "a" }, { "version", "2.0" } });
+        write_repodata(repodata, records);
+        fs::last_write_time(repodata, fs::file_time_type::clock::now() + std::chrono::hours(1));
+        subdir = make_subdir();
+        EXPECT_TRUE(subdir->stale());
+        {
+            SubdirRevalidation revalidation({ subdir });
+            // solved with the stale repodata while refreshing
+            EXPECT_FALSE(solve(*subdir, "a >=2"));
+            auto changed = revalidation.finish();
+            EXPECT_EQ(changed[server.url() + "/linux-64"],
+                      std::set<std::string>({ "a-2.0-0.tar.bz2" }));
+            EXPECT_TRUE(revalidation.outdated_solution(false, {}));
+            EXPECT_TRUE(revalidation.outdated_solution(
+                true, { { server.url() + "/linux-64", "a-2.0-0.tar.bz2" } }));
+            EXPECT_FALSE(revalidation.outdated_solution(
+                true, { { server.url() + "/linux-64", "a-1.0-0.tar.bz2" } }));
+        }
+        EXPECT_FALSE(subdir->stale());
+        EXPECT_TRUE(solve(*subdir, "a >=2"));
+
+        // not modified (304), the retry is not needed
+        subdir = make_subdir();
+        EXPECT_TRUE(subdir->stale());
+        {
+            SubdirRevalidation revalidation({ subdir });
+            EXPECT_TRUE(revalidation.finish().empty());
+            EXPECT_FALSE(revalidation.outdated_solution(false, {}));
+        }
+        EXPECT_TRUE(solve(*subdir, "a >=2"));
+
+        ctx.stale_while_revalidate = stale_while_revalidate;
+    }
+
+    TEST(subdirdata, current_repodata_fallback)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path channel = tmp_dir.path() / "channel";
+        fs::path cache_dir = tmp_dir.path() / "cache";
+        fs::create_directories(cache_dir);
+        nlohmann::json a1 = { { "name", "a" }, { "version", "1.0" } };
+        nlohmann::json a2 = { { "name", "a" }, { "version", "2.0" } };
+        write_repodata(channel / "linux-64" / "current_repodata.json",
+                       nlohmann::json::array({ a2 }));
+        write_repodata(channel / "linux-64" / "repodata.json", { a1, a2 });
+        // noarch does not publish current_repodata.json
+        write_repodata(channel / "noarch" / "repodata.json",
+                       { { { "name", "b" }, { "version", "1.0" } } });
+
+        // as install_specs does it, see RETRY_FULL_REPODATA
+        auto load_subdirs = [&](bool use_current) {
+            std::vector<std::shared_ptr<MSubdirData>> subdirs;
+            MultiDownloadTarget dl;
+            for (std::string platform : { "linux-64", "noarch" })
+            {
+                std::string subdir_url = "file://" + (channel / platform).string();
+                std::string full_url = subdir_url + "/repodata.json";
+                std::string url = use_current ? subdir_url + "/current_repodata.json" : full_url;
+                auto subdir = std::make_shared<MSubdirData>(
+                    "channel/" + platform, url, cache_dir / cache_fn_url(url));
+                if (use_current)
+                {
+                    subdir->set_full_repodata(full_url, cache_dir / cache_fn_url(full_url));
+                }
+                subdir->load();
+                dl.add(subdir->target());
+                subdirs.push_back(subdir);
+            }
+            dl.download(true);
+
+            MultiDownloadTarget full_dl;
+            for (auto& subdir : subdirs)
+            {
+                if (!subdir->loaded() && subdir->use_full_repodata())
+                {
+                    subdir->load();
+                    full_dl.add(subdir->target());
+                }
+            }
+            full_dl.download(true);
+            return subdirs;
+        };
+        auto solve = [](std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                        const std::vector<std::string>& specs) {
+            MPool pool;
+            for (auto& subdir : subdirs)
+            {
+                EXPECT_TRUE(subdir->loaded());
+                subdir->create_repo(pool);
+            }
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs(specs, SOLVER_INSTALL);
+            return solver.solve();
+        };
+
+        // noarch falls back to the full repodata on its own
+        auto subdirs = load_subdirs(true);
+        EXPECT_TRUE(ends_with(subdirs[0]->repo_metadata().url, "/current_repodata.json"));
+        EXPECT_TRUE(ends_with(subdirs[1]->repo_metadata().url, "/noarch/repodata.json"));
+        EXPECT_TRUE(solve(subdirs, { "a", "b" }));
+        // a-1.0 is only in the full repodata, the solve is retried without
+        // current_repodata.json
+        EXPECT_FALSE(solve(subdirs, { "a <2", "b" }));
+        subdirs = load_subdirs(false);
+        EXPECT_TRUE(ends_with(subdirs[0]->repo_metadata().url, "/linux-64/repodata.json"));
+        EXPECT_TRUE(solve(subdirs, { "a <2", "b" }));
+    }
+
+    TEST(transaction, diff_prefix_packages)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path();
+        fs::create_directories(prefix / "conda-meta");
+        auto add_record = [&](const std::string& name,
+                              const std::string& version,
+                              const std::string& md5) {
+            nlohmann::json j = { { "name", name },
+                                 { "version", version },
+                                 { "build", "0" },
+                                 { "build_number", 0 },
+                                 { "md5", md5 } };
+            std::ofstream(prefix / "conda-meta" / (name + "-" + version + "-0.json")) << j.dump();
+        };
+        add_record("a", "1.0", "aaa");
+        add_record("b", "1.0", "bbb");
+        add_record("c", "1.0", "ccc");
+        add_record("d", "1.0", "ddd");
+        PrefixData prefix_data(prefix);
+        prefix_data.load();
+
+        std::string url = "https://conda.anaconda.org/conda-forge/linux-64/";
+        auto packages = explicit_specs_to_packages({ "# platform: linux-64",
+                                                     "@EXPLICIT",
+                                                     url + "a-1.0-0.tar.bz2#aaa",
+                                                     url + "b-2.0-0.tar.bz2#bbb",
+                                                     "",
+                                                     url + "c-1.0-0.tar.bz2#changed",
+                                                     url + "e-1.0-0.tar.bz2" });
+        ASSERT_EQ(packages.size(), 4);
+        EXPECT_EQ(packages[1].name, "b");
+        EXPECT_EQ(packages[1].version, "2.0");
+        EXPECT_EQ(packages[1].build_string, "0");
+        EXPECT_EQ(packages[1].md5, "bbb");
+        EXPECT_EQ(packages[1].fn, "b-2.0-0.tar.bz2");
+        EXPECT_EQ(packages[3].md5, "");
+
+        auto [to_remove, to_install] = diff_prefix_packages(prefix_data, packages);
+        std::vector<std::string> removed, installed;
+        for (auto& p : to_remove)
+            removed.push_back(p.str());
+        for (auto& p : to_install)
+            installed.push_back(p.str());
+        EXPECT_EQ(removed, std::vector<std::string>({ "b-1.0-0", "c-1.0-0", "d-1.0-0" }));
+        EXPECT_EQ(installed, std::vector<std::string>({ "b-2.0-0", "c-1.0-0", "e-1.0-0" }));
+
+        EXPECT_THROW(explicit_specs_to_packages({ "numpy >=1.0" }), std::runtime_error);
+    }
+
+    TEST(transaction, outlives_pool)
+    {
+        TemporaryDirectory tmp_dir;
+        auto package = [](const std::string& name, const std::string& version) {
+            PackageInfo pkg(name, version, "0", 0);
+            pkg.subdir = "linux-64";
+            pkg.fn = name + "-" + version + "-0.tar.bz2";
+            pkg.url = "https://conda.anaconda.org/conda-forge/linux-64/" + pkg.fn;
+            pkg.size = 100;
+            return pkg;
+        };
+
+        MultiPackageCache cache({ tmp_dir.path() });
+        auto pool = std::make_unique<MPool>();
+        MRepo installed(*pool, "installed", { package("a", "1.0"), package("b", "1.0") });
+        installed.set_installed();
+        MRepo channel(*pool, "channel", { package("a", "2.0"), package("python", "3.9") });
+        auto solver = std::make_unique<MSolver>(
+            *pool, std::vector<std::pair<int, int>>{ { SOLVER_FLAG_ALLOW_UNINSTALL, 1 } });
+        solver->add_jobs({ "a >=2", "python" }, SOLVER_INSTALL);
+        solver->add_jobs({ "b" }, SOLVER_ERASE);
+        ASSERT_TRUE(solver->solve());
+
+        MTransaction trans(*solver, cache);
+        solver.reset();
+        pool.reset();
+
+        EXPECT_FALSE(trans.empty());
+        EXPECT_EQ(trans.find_python_version(), "3.9");
+        auto [specs, to_install, to_remove] = trans.to_conda();
+        std::set<std::string> installed_fns, removed_fns;
+        for (const auto& [c, fn, json] : to_install)
+        {
+            EXPECT_EQ(c, "https://conda.anaconda.org/conda-forge/linux-64");
+            installed_fns.insert(fn);
+        }
+        for (const auto& [c, fn] : to_remove)
+        {
+            removed_fns.insert(fn);
+        }
+        EXPECT_EQ(installed_fns,
+                  std::set<std::string>({ "a-2.0-0.tar.bz2", "python-3.9-0.tar.bz2" }));
+        EXPECT_EQ(removed_fns, std::set<std::string>({ "a-1.0-0.tar.bz2", "b-1.0-0.tar.bz2" }));
+        trans.print();
+    }
+
+    TEST(transaction, execute_fetches)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path prefix = tmp_dir.path() / "prefix";
+        fs::path pkgs_dir = tmp_dir.path() / "pkgs";
+        fs::path channel = tmp_dir.path() / "channel";
+        fs::create_directories(prefix / "conda-meta");
+        fs::create_directories(pkgs_dir);
+        fs::create_directories(channel);
+
+        // a broken package lacks the file listed in its paths.json
+        auto make_package = [&](const std::string& version,
+                                const std::string& name = "a",
+                                bool broken = false) {
+            PackageInfo pkg(name, version, "0", 0);
+            pkg.subdir = "linux-64";
+            pkg.fn = name + "-" + version + "-0.tar.bz2";
+            pkg.url = "file://" + (channel / pkg.fn).string();
+            fs::path dir = tmp_dir.path() / ("src-" + name + "-" + version);
+            fs::create_directories(dir / "info");
+            fs::create_directories(dir / "bin");
+            if (!broken)
+            {
+                std::ofstream(dir / "bin" / name) << version;
+            }
+            std::ofstream(dir / "info" / "index.json")
+                << nlohmann::json({ { "name", name },
+                                    { "version", version },
+                                    { "build", "0" },
+                                    { "build_number", 0 } });
+            std::ofstream(dir / "info" / "paths.json") << nlohmann::json(
+                { { "paths", { { { "_path", "bin/" + name }, { "path_type", "hardlink" } } } },
+                  { "paths_version", 1 } });
+            create_package(dir, channel / pkg.fn, 1);
+            return pkg;
+        };
+        auto read_file = [](const fs::path& path) {
+            std::ifstream in(path);
+            return std::string(std::istreambuf_iterator<char>(in), {});
+        };
+
+        auto execute = [&](const std::vector<PackageInfo>& to_remove,
+                           const std::vector<PackageInfo>& to_install) {
+            PrefixData prefix_data(prefix);
+            prefix_data.load();
+            auto pool = std::make_unique<MPool>();
+            MRepo installed(*pool, prefix_data);
+            MultiPackageCache cache({ pkgs_dir });
+            MTransaction trans(*pool, to_remove, to_install, cache);
+            // the repos are matched by id once their pool is freed
+            pool.reset();
+            std::vector<MRepo*> repos = { &installed };
+            return trans.execute(prefix_data, pkgs_dir, repos);
+        };
+
+        // fetched and linked by execute()
+        PackageInfo a1 = make_package("1.0");
+        EXPECT_TRUE(execute({}, { a1 }));
+        EXPECT_EQ(read_file(prefix / "bin" / "a"), "1.0");
+
+        PackageInfo a2 = make_package("2.0");
+        EXPECT_TRUE(execute({ a1 }, { a2 }));
+        EXPECT_EQ(read_file(prefix / "bin" / "a"), "2.0");
+        EXPECT_TRUE(fs::exists(prefix / "conda-meta" / "a-2.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "conda-meta" / "a-1.0-0.json"));
+
+        // a failing link rolls back the whole transaction, and the prefix is
+        // finalized
+        PackageInfo a4 = make_package("4.0");
+        PackageInfo b1 = make_package("1.0", "b", true);
+        EXPECT_ANY_THROW(execute({ a2 }, { a4, b1 }));
+        EXPECT_EQ(read_file(prefix / "bin" / "a"), "2.0");
+        EXPECT_TRUE(fs::exists(prefix / "conda-meta" / "a-2.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "conda-meta" / "a-4.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "conda-meta" / "b-1.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "bin" / "b"));
+        {
+            PrefixFileIndex index(prefix);
+            EXPECT_EQ(index.owner("bin/a"), "a-2.0-0");
+            EXPECT_EQ(index.owner("bin/b"), "");
+        }
+
+        // an invalid download found while linking is rolled back by
+        // relinking the installed package from the cache
+        PackageInfo a3 = make_package("3.0");
+        a3.sha256 = std::string(64, '0');
+        ASSERT_TRUE(fs::exists(pkgs_dir / "a-2.0-0" / "info" / "repodata_record.json"));
+        EXPECT_THROW(execute({ a2 }, { a3 }), std::runtime_error);
+        EXPECT_EQ(read_file(prefix / "bin" / "a"), "2.0");
+        EXPECT_TRUE(fs::exists(prefix / "conda-meta" / "a-2.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "conda-meta" / "a-3.0-0.json"));
+        {
+            PrefixFileIndex index(prefix);
+            EXPECT_EQ(index.owner("bin/a"), "a-2.0-0");
+        }
+
+        // it fails before anything is unlinked when the cache entry of the
+        // installed package is gone
+        fs::remove_all(pkgs_dir / "a-2.0-0");
+        fs::remove(pkgs_dir / "a-2.0-0.tar.bz2");
+        EXPECT_THROW(execute({ a2 }, { a3 }), std::runtime_error);
+        EXPECT_EQ(read_file(prefix / "bin" / "a"), "2.0");
+        EXPECT_TRUE(fs::exists(prefix / "conda-meta" / "a-2.0-0.json"));
+        EXPECT_FALSE(fs::exists(prefix / "conda-meta" / "a-3.0-0.json"));
+        EXPECT_FALSE(fs::exists(pkgs_dir / "a-3.0-0.tar.bz2"));
+    }
+
     TEST(utils, quote_for_shell)
     {
         if (!on_win)
@@ -79,4 +79,84 @@ namespace mamba
         EXPECT_EQ(res2, 5);
     }
 #endif
+
+    TEST(thread_pool, futures)
+    {
+        thread_pool pool(3);
+        EXPECT_EQ(pool.size(), 3);
+
+        std::vector<std::future<int>> futures;
+        for (int i = 0; i < 20; ++i)
+        {
+            futures.push_back(pool.submit([](int x) { return x * x; }, i));
+        }
+        for (int i = 0; i < 20; ++i)
+        {
+            EXPECT_EQ(futures[i].get(), i * i);
+        }
+
+        auto failing = pool.submit([]() { throw std::runtime_error("failed"); });
+        EXPECT_THROW(failing.get(), std::runtime_error);
+    }
+
+    TEST(thread_pool, bounded)
+    {
+        thread_pool pool(2);
+        std::atomic<int> running(0), max_running(0);
+        std::vector<std::future<void>> futures;
+        for (int i = 0; i < 10; ++i)
+        {
+            futures.push_back(pool.submit([&]() {
+                int r = ++running;
+                int m = max_running;
+                while (r > m && !max_running.compare_exchange_weak(m, r))
+                {
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                --running;
+            }));
+        }
+        for (auto& f : futures)
+        {
+            f.get();
+        }
+        EXPECT_LE(max_running, 2);
+    }
+
+    TEST(thread_pool, nested_submit)
+    {
+        thread_pool pool(2);
+        EXPECT_FALSE(pool.in_worker());
+        auto outer = pool.submit([&pool]() {
+            EXPECT_TRUE(pool.in_worker());
+            std::vector<std::future<int>> inner;
+            for (int i = 0; i < 4; ++i)
+            {
+                inner.push_back(pool.submit([i]() { return i; }));
+            }
+            return inner;
+        });
+        int sum = 0;
+        for (auto& f : outer.get())
+        {
+            sum += f.get();
+        }
+        EXPECT_EQ(sum, 6);
+        wait_for_all_threads();
+        EXPECT_EQ(get_thread_count(), 0);
+    }
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    TEST(thread_pool, interrupt)
+    {
+        thread_pool pool(1);
+        set_sig_interrupted();
+        auto f = pool.submit([]() { return 1; });
+        EXPECT_THROW(f.get(), thread_interrupted);
+        reset_sig_interrupted();
+
+        auto g = pool.submit([]() { return 2; });
+        EXPECT_EQ(g.get(), 2);
+    }
+#endif
 }  // namespace mamba